@@ -0,0 +1,234 @@
+/*
+ * Plasma GC marking benchmark
+ * vim: ts=4 sw=4 et
+ *
+ * Copyright (C) 2020 Plasma Team
+ * Distributed under the terms of the MIT license, see ../LICENSE.code
+ *
+ * This program times full collections of a live list or binary tree of
+ * three word cells.  A long list is the worst case for a recursive
+ * marker, which needs a C stack frame for each cell.  See README.md.
+ */
+
+#include "pz_common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <vector>
+
+#include "pz_gc.h"
+#include "pz_gc_util.h"
+#include "pz_option.h"
+
+#include "pz_gc.impl.h"
+
+using namespace pz;
+
+static const size_t Cell_Words = 3;
+
+class BenchTracer : public AbstractGCTracer {
+  public:
+    void *root;
+
+    explicit BenchTracer(Heap *heap) :
+        AbstractGCTracer(heap),
+        root(nullptr) {}
+
+    virtual void do_trace(HeapMarkState *state) const {
+        if (root) {
+            state->mark_root(root);
+        }
+    }
+};
+
+static void *
+make_list(GCCapability &gc_cap, size_t num_cells);
+
+static void *
+make_tree(GCCapability &gc_cap, size_t num_cells);
+
+static size_t
+count_list(void *list);
+
+static size_t
+count_tree(void *tree);
+
+static double
+now();
+
+static void
+usage(const char *progname, FILE *stream);
+
+int
+main(int argc, char *argv[])
+{
+    if (argc < 2 || argc > 4) {
+        usage(argv[0], stderr);
+        return EXIT_FAILURE;
+    }
+    bool tree;
+    if (0 == strcmp(argv[1], "list")) {
+        tree = false;
+    } else if (0 == strcmp(argv[1], "tree")) {
+        tree = true;
+    } else {
+        usage(argv[0], stderr);
+        return EXIT_FAILURE;
+    }
+    size_t num_cells = argc > 2 ? strtoul(argv[2], nullptr, 10) : 1000000;
+    unsigned num_collections = argc > 3 ? atoi(argv[3]) : 20;
+    if (num_cells == 0 || num_collections == 0) {
+        usage(argv[0], stderr);
+        return EXIT_FAILURE;
+    }
+
+    // Options reads PZ_RUNTIME_OPTS once it has parsed a command line,
+    // which normally names the program to run.
+    Options options;
+    char *options_argv[] = {argv[0], argv[1], nullptr};
+    if (options.parse(2, options_argv) != Options::Mode::NORMAL) {
+        return EXIT_FAILURE;
+    }
+
+    NoRootsTracer global_roots(nullptr);
+    Heap heap(options, global_roots);
+    if (!heap.init()) {
+        fprintf(stderr, "Couldn't initialise the heap.\n");
+        return EXIT_FAILURE;
+    }
+
+    BenchTracer tracer(&heap);
+    {
+        // The heap grows rather than collecting while the structure is
+        // only partly reachable.
+        NoGCScope no_gc(&tracer);
+        tracer.root = tree ? make_tree(no_gc, num_cells) :
+            make_list(no_gc, num_cells);
+        no_gc.abort_if_oom("building the structure");
+    }
+
+    double total = 0.0;
+    double min = 0.0;
+    for (unsigned i = 0; i < num_collections; i++) {
+        double start = now();
+        heap.maybe_collect(&tracer);
+        double seconds = now() - start;
+
+        total += seconds;
+        if (i == 0 || seconds < min) {
+            min = seconds;
+        }
+    }
+
+    size_t found = tree ? count_tree(tracer.root) : count_list(tracer.root);
+    if (found != num_cells) {
+        fprintf(stderr, "Found %zu of %zu cells after collecting.\n",
+                found, num_cells);
+        return EXIT_FAILURE;
+    }
+
+    printf("%s of %zu cells: %u collections, mean %.1fms, min %.1fms\n",
+            tree ? "tree" : "list", num_cells, num_collections,
+            total / num_collections * 1e3, min * 1e3);
+
+    tracer.root = nullptr;
+    return heap.finalise() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static void *
+make_list(GCCapability &gc_cap, size_t num_cells)
+{
+    void **list = nullptr;
+
+    for (size_t i = 0; i < num_cells; i++) {
+        void **cell = static_cast<void**>(gc_cap.alloc(Cell_Words));
+        if (!cell) return nullptr;
+
+        cell[0] = list;
+        cell[1] = reinterpret_cast<void*>(i);
+        cell[2] = nullptr;
+        list = cell;
+    }
+
+    return list;
+}
+
+/*
+ * A complete binary tree, the children of the i'th cell allocated are the
+ * 2i+1'th and 2i+2'th.
+ */
+static void *
+make_tree(GCCapability &gc_cap, size_t num_cells)
+{
+    std::vector<void**> cells(num_cells);
+
+    for (size_t i = 0; i < num_cells; i++) {
+        cells[i] = static_cast<void**>(gc_cap.alloc(Cell_Words));
+        if (!cells[i]) return nullptr;
+    }
+    for (size_t i = 0; i < num_cells; i++) {
+        size_t left = 2*i + 1;
+        size_t right = 2*i + 2;
+
+        cells[i][0] = left < num_cells ? cells[left] : nullptr;
+        cells[i][1] = right < num_cells ? cells[right] : nullptr;
+        cells[i][2] = reinterpret_cast<void*>(i);
+    }
+
+    return cells[0];
+}
+
+static size_t
+count_list(void *list)
+{
+    size_t count = 0;
+
+    for (void **cell = static_cast<void**>(list); cell;
+            cell = static_cast<void**>(cell[0]))
+    {
+        count++;
+    }
+
+    return count;
+}
+
+static size_t
+count_tree(void *tree)
+{
+    size_t count = 0;
+    std::vector<void**> todo;
+
+    if (tree) {
+        todo.push_back(static_cast<void**>(tree));
+    }
+    while (!todo.empty()) {
+        void **cell = todo.back();
+        todo.pop_back();
+        count++;
+
+        for (unsigned i = 0; i < 2; i++) {
+            if (cell[i]) {
+                todo.push_back(static_cast<void**>(cell[i]));
+            }
+        }
+    }
+
+    return count;
+}
+
+static double
+now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+usage(const char *progname, FILE *stream)
+{
+    fprintf(stream, "%s list|tree [CELLS [COLLECTIONS]]\n", progname);
+}
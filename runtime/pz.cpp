@@ -44,13 +44,26 @@ PZ::init()
 {
     if (!heap()->init()) return false;
 
+    if (!m_options.alloc_profile().empty()) {
+        m_alloc_profiler.reset(new AllocProfiler(heap()));
+    }
+
     return true;
 }
 
 bool
 PZ::finalise()
 {
-    return heap()->finalise();
+    bool result = true;
+
+    if (m_alloc_profiler) {
+        if (!m_alloc_profiler->write(m_options.alloc_profile().c_str())) {
+            result = false;
+        }
+        m_alloc_profiler.reset();
+    }
+
+    return heap()->finalise() && result;
 }
 
 Module *
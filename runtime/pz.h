@@ -18,6 +18,7 @@
 #include "pz_gc.h"
 
 #include "pz_module.h"
+#include "pz_profile.h"
 
 namespace pz {
 
@@ -30,6 +31,7 @@ class PZ : public AbstractGCTracer {
     std::unordered_map<std::string, Module*>  m_modules;
     std::unique_ptr<Module>                   m_entry_module;
     std::unique_ptr<Heap>                     m_heap;
+    std::unique_ptr<AllocProfiler>            m_alloc_profiler;
 
   public:
     explicit PZ(const Options &options);
@@ -40,6 +42,9 @@ class PZ : public AbstractGCTracer {
 
     Heap * heap() { return m_heap.get(); }
 
+    // Non-null if allocations are being profiled.
+    AllocProfiler * alloc_profiler() { return m_alloc_profiler.get(); }
+
     Module * new_module(const std::string &name);
 
     const Options & options() const { return m_options; }
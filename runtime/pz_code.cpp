@@ -35,6 +35,7 @@ Proc::add_context(GCCapability &gc_cap, unsigned offset, const char *filename,
         assert(m_filename == filename);
     } else {
         m_filename = filename;
+        gc_cap.write_barrier(this);
     }
 
     set_context(gc_cap, offset, line);
@@ -11,6 +11,7 @@
 
 #include "pz_common.h"
 
+#include "pz_closure.h"
 #include "pz_data.h"
 #include "pz_util.h"
 
@@ -28,7 +29,7 @@ Struct::calculate_layout()
     assert(!m_layout_calculated);
     m_layout_calculated = true;
 #endif
-    unsigned size = 0;
+    unsigned size = m_closure_env ? sizeof(Closure) : 0;
 
     for (unsigned i = 0; i < num_fields(); i++) {
         unsigned field_size = width_to_bytes(m_fields[i].width);
@@ -38,6 +39,33 @@ Struct::calculate_layout()
         size += field_size;
     }
     m_total_size = size;
+
+    m_has_ptr_map = total_words() <= GC_Max_Precise_Words;
+    m_ptr_map = 0;
+    if (m_has_ptr_map) {
+        // The closure's data points back to the struct itself and needn't
+        // be traced, but its code must be.
+        if (m_closure_env) {
+            m_ptr_map |= PtrMap(1);
+        }
+        for (unsigned i = 0; i < num_fields(); i++) {
+            if (m_fields[i].width == PZW_PTR) {
+                assert(m_fields[i].offset % WORDSIZE_BYTES == 0);
+                m_ptr_map |=
+                    PtrMap(1) << (m_fields[i].offset / WORDSIZE_BYTES);
+            }
+        }
+    }
+}
+
+void
+Struct::make_closure_env()
+{
+    m_closure_env = true;
+#ifdef PZ_DEV
+    m_layout_calculated = false;
+#endif
+    calculate_layout();
 }
 
 /*
@@ -53,10 +81,14 @@ data_new_array_data(GCCapability &gc_tracer,
 }
 
 void *
-data_new_struct_data(GCCapability &gc_tracer, size_t size)
+data_new_struct_data(GCCapability &gc_tracer, const Struct *struct_)
 {
-    // TODO: Use this during execution of PZT_ALLOC.
-    return gc_tracer.alloc_bytes(size);
+    if (struct_->has_ptr_map()) {
+        return gc_tracer.alloc_precise(struct_->total_words(),
+                struct_->ptr_map());
+    } else {
+        return gc_tracer.alloc_bytes(struct_->total_size());
+    }
 }
 
 /*
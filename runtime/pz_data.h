@@ -13,6 +13,7 @@
 
 #include "pz_cxx_future.h"
 #include "pz_format.h"
+#include "pz_gc.h"
 #include "pz_gc_util.h"
 
 namespace pz {
@@ -35,6 +36,11 @@ class Struct : public GCNew {
     Struct_Field             *m_fields;
     unsigned                  m_num_fields;
     unsigned                  m_total_size;
+    // Structs that are small enough are traced precisely using this map
+    // of their pointer fields.
+    bool                      m_has_ptr_map;
+    PtrMap                    m_ptr_map;
+    bool                      m_closure_env;
 #ifdef PZ_DEV
     bool                      m_layout_calculated;
 #endif
@@ -43,6 +49,7 @@ class Struct : public GCNew {
     Struct() = delete;
     explicit Struct(NoGCScope &gc_cap, unsigned num_fields)
         : m_num_fields(num_fields)
+        , m_closure_env(false)
 #ifdef PZ_DEV
         , m_layout_calculated(false)
 #endif
@@ -52,6 +59,15 @@ class Struct : public GCNew {
 
     unsigned num_fields() const { return m_num_fields; }
     unsigned total_size() const { return m_total_size; }
+    unsigned total_words() const {
+        return AlignUp(m_total_size, WORDSIZE_BYTES) / WORDSIZE_BYTES;
+    }
+
+    bool has_ptr_map() const { return m_has_ptr_map; }
+    PtrMap ptr_map() const {
+        assert(m_has_ptr_map);
+        return m_ptr_map;
+    }
 
     uint16_t field_offset(unsigned num) const
     {
@@ -69,6 +85,15 @@ class Struct : public GCNew {
 
     void calculate_layout();
 
+    /*
+     * Lay the struct out again with room for a Closure before its fields,
+     * so that a closure can be made in place in its environment.  This
+     * must happen before any code or data is written with its field
+     * offsets.
+     */
+    void make_closure_env();
+    bool is_closure_env() const { return m_closure_env; }
+
     Struct(const Struct &) = delete;
     void operator=(const Struct &other) = delete;
 };
@@ -96,10 +121,22 @@ data_new_array_data(GCCapability &gc_tracer, PZ_Width width,
     uint32_t num_elements);
 
 /*
- * Allocate space for struct data.
+ * Allocate space for struct data.  Unless the struct is too large it is
+ * tagged with its pointer map so that only its pointer fields are traced.
  */
 void *
-data_new_struct_data(GCCapability &gc_tracer, size_t size);
+data_new_struct_data(GCCapability &gc_tracer, const Struct *struct_);
+
+inline void *
+data_new_struct_data(AllocBuffer &buffer, const Struct *struct_)
+{
+    if (struct_->has_ptr_map()) {
+        return buffer.alloc_precise(struct_->total_words(),
+                struct_->ptr_map());
+    } else {
+        return buffer.alloc_bytes(struct_->total_size());
+    }
+}
 
 /*
  * Functions for storing data in memory
@@ -13,14 +13,20 @@
 #include <sys/mman.h>
 #include <unistd.h>
 
+#include <algorithm>
+
 #include "pz_util.h"
 
 #include "pz_gc.h"
 #include "pz_gc_util.h"
 
 #include "pz_gc.impl.h"
+#include "pz_gc_immortal.h"
 #include "pz_gc_layout.h"
 #include "pz_gc_layout.impl.h"
+#include "pz_gc_mark.h"
+#include "pz_gc_stats.h"
+#include "pz_gc_sweep.h"
 
 /*
  * Plasma GC
@@ -31,13 +37,16 @@
  * currently a little bit better than that.
  *
  *  * Mark/Sweep
- *  * Non-moving
- *  * Conservative
+ *  * Non-moving, except that with gc_compact medium sized cells that only
+ *    precise fields point to may slide together.
+ *  * Conservative, except that small structs allocated with a pointer map
+ *    have only their pointer fields scanned.
  *  * Interior pointers (up to 7 byte offset)
- *  * Block based, each block contains cells of a particular size, a marking
- *    bitmap and free list pointer (the free list is made of unused cell
- *    contents.
+ *  * Block based, each block contains cells of a particular size and
+ *    bitmaps of the allocated and marked cells.
  *  * Blocks are allocated from Chunks.  We allocate chunks from the OS.
+ *  * The code and data of modules are allocated in an immortal region
+ *    that is never swept, only its pointers into the heap are marked.
  *
  * This GC is fairly simple.  There are a few changes we could make to
  * improve it in the medium term:
@@ -46,7 +55,8 @@
  *
  * In the slightly longer term we should:
  *
- *  * Use accurate pointer information and test it by adding compaction.
+ *  * Use accurate pointer information everywhere (not just for structs)
+ *    so that compaction can move more cells.
  *
  * In the long term, and with much tweaking, this GC will become the
  * tenured and maybe the tenured/mutable part of a larger GC with more
@@ -73,6 +83,36 @@ heap_get_collections(const Heap *heap)
     return heap->collections();
 }
 
+bool
+heap_get_stat(const Heap *heap, const char *name, int64_t *value)
+{
+    return heap->stats().get(name, value);
+}
+
+bool
+heap_set_max_size(Heap *heap, size_t size_bytes)
+{
+    return heap->set_max_size(size_bytes);
+}
+
+size_t
+heap_get_max_size(const Heap *heap)
+{
+    return heap->max_size();
+}
+
+bool
+heap_set_gc_cpu_target(Heap *heap, unsigned percent)
+{
+    return heap->set_cpu_target(percent);
+}
+
+unsigned
+heap_get_gc_cpu_target(const Heap *heap)
+{
+    return heap->cpu_target();
+}
+
 void
 heap_set_meta_info(Heap *heap, void *obj, void *meta)
 {
@@ -88,17 +128,29 @@ heap_interior_ptr_to_ptr(const Heap *heap, void *ptr)
 void *
 Heap::interior_ptr_to_ptr(void *iptr) const
 {
-    CellPtrBOP cellb = ptr_to_bop_cell_interior(iptr);
-    if (cellb.is_valid()) {
-        return cellb.pointer();
-    } else {
-        CellPtrFit cellf = ptr_to_fit_cell_interior(iptr);
-        if (cellf.is_valid()) {
-            return cellf.pointer();
+    Chunk *chunk = m_chunk_map->lookup(iptr);
+    if (!chunk) return m_immortal->interior_ptr_to_ptr(iptr);
+
+    switch (chunk->type()) {
+        case CT_BOP: {
+            CellPtrBOP cell =
+                static_cast<ChunkBOP*>(chunk)->ptr_to_cell_interior(iptr);
+            return cell.is_valid() ? cell.pointer() : nullptr;
+        }
+        case CT_FIT: {
+            ChunkFit *chunk_fit = static_cast<ChunkFit*>(chunk);
+            chunk_fit->ensure_swept(m_options);
+            CellPtrFit cell = chunk_fit->ptr_to_cell_interior(iptr);
+            return cell.is_valid() ? cell.pointer() : nullptr;
         }
+        case CT_LARGE: {
+            CellPtrLarge cell =
+                static_cast<ChunkLarge*>(chunk)->ptr_to_cell_interior(iptr);
+            return cell.is_valid() ? cell.pointer() : nullptr;
+        }
+        default:
+            return nullptr;
     }
-
-    return nullptr;
 }
 
 void *
@@ -120,8 +172,7 @@ bool
 ChunkFit::is_empty()
 {
     CellPtrFit cell = first_cell();
-    return !cell.is_allocated() && cell.size() ==
-        ((Payload_Bytes - CellPtrFit::CellInfoOffset) / WORDSIZE_BYTES);
+    return !cell.is_allocated() && cell.size() == Max_Cell_Size;
 }
 
 /***************************************************************************/
@@ -138,11 +189,38 @@ void Heap::init_statics()
 
 Heap::Heap(const Options &options_, AbstractGCTracer &trace_global_roots_)
         : m_options(options_)
-        , m_chunk_bop(nullptr)
-        , m_chunk_fit(nullptr)
+        , m_chunk_map(nullptr)
+        , m_block_index(nullptr)
+        , m_mark_stack(nullptr)
+        , m_stats(nullptr)
+        , m_sweeper(nullptr)
+        , m_immortal(nullptr)
         , m_usage(0)
         , m_threshold(GC_Initial_Threshold)
+        , m_max_size(options_.gc_max_heap())
+        , m_cpu_target(options_.gc_cpu_target())
+        , m_mark_rate(0.0)
+        , m_alloc_rate(0.0)
+        , m_survival_rate(0.0)
+        , m_live(0)
+        , m_last_collect_end(0.0)
+        , m_full_threshold(GC_Initial_Threshold)
+        , m_next_full(false)
+        , m_last_remembered(nullptr)
+        , m_marking(false)
+        , m_slice_bytes(0)
+        , m_next_slice(0)
+        , m_mark_limit(0)
+        , m_mark_slices(0)
+        , m_mark_slices_seconds(0.0)
+        , m_mark_start_allocated(0)
         , m_collections(0)
+        , m_allocated(0)
+        , m_sample_interval(options_.alloc_profile().empty() ? 0 :
+                options_.alloc_profile_interval())
+        , m_next_sample(0)
+        , m_sample_random(0x9e3779b97f4a7c15ull)
+        , m_reported_backing(-1)
         , m_trace_global_roots(trace_global_roots_)
 #ifdef PZ_DEV
         , m_in_no_gc_scope(false)
@@ -152,8 +230,14 @@ Heap::Heap(const Options &options_, AbstractGCTracer &trace_global_roots_)
 Heap::~Heap()
 {
     // Check that finalise was called.
-    assert(!m_chunk_bop);
-    assert(!m_chunk_fit);
+    assert(m_chunks_bop.empty());
+    assert(m_chunks_fit.empty());
+    assert(!m_chunk_map);
+    assert(!m_block_index);
+    assert(!m_mark_stack);
+    assert(!m_stats);
+    assert(!m_sweeper);
+    assert(!m_immortal);
 }
 
 bool
@@ -161,42 +245,233 @@ Heap::init()
 {
     init_statics();
 
-    assert(!m_chunk_bop);
-    Chunk *chunk = Chunk::new_chunk();
-    if (chunk) {
-        m_chunk_bop = chunk->initalise_as_bop();
-    } else {
-        return false;
+    assert(!m_chunk_map);
+    m_chunk_map = new ChunkMap();
+    assert(!m_block_index);
+    m_block_index = new BlockIndex();
+    assert(!m_mark_stack);
+    m_mark_stack = new MarkStack();
+    assert(!m_stats);
+    m_stats = new GCStats(m_options.gc_max_pause());
+    if (!m_options.gc_stats().empty()) {
+        GCStats::install_signal_handler();
+    }
+    assert(!m_sweeper);
+    if (m_options.gc_background_sweep()) {
+        m_sweeper = new Sweeper(m_options);
     }
+    assert(!m_immortal);
+    m_immortal = new ImmortalRegion();
 
-    assert(!m_chunk_fit);
-    chunk = Chunk::new_chunk();
-    if (chunk) {
-        m_chunk_fit = chunk->initalise_as_fit();
-    } else {
-        return false;
+    assert(m_chunks_bop.empty());
+    if (!new_chunk_bop()) return false;
+
+    assert(m_chunks_fit.empty());
+    if (!new_chunk_fit()) return false;
+
+    if (m_sample_interval) {
+        m_next_sample = next_sample_interval();
     }
 
+    m_last_collect_end = now();
     return true;
 }
 
-Chunk*
-Chunk::new_chunk()
+ChunkBOP *
+Heap::new_chunk_bop()
+{
+    Chunk *chunk = Chunk::new_chunk(m_options.gc_huge_pages());
+    if (!chunk) return nullptr;
+
+    if (!m_chunk_map->insert(chunk, GC_Chunk_Size)) {
+        chunk->destroy();
+        return nullptr;
+    }
+    report_backing(chunk);
+
+    ChunkBOP *chunk_bop = chunk->initalise_as_bop();
+    m_chunks_bop.push_back(chunk_bop);
+    m_chunks_bop_free.push_back(chunk_bop);
+
+#ifdef PZ_DEV
+    if (m_options.gc_trace()) {
+        fprintf(stderr, "Mapped new BOP chunk %p, %ld BOP chunks total\n",
+                chunk_bop, m_chunks_bop.size());
+    }
+#endif
+
+    return chunk_bop;
+}
+
+ChunkFit *
+Heap::new_chunk_fit()
 {
-    Chunk *chunk;
+    Chunk *chunk = Chunk::new_chunk(m_options.gc_huge_pages());
+    if (!chunk) return nullptr;
 
-    chunk = static_cast<Chunk*>(mmap(NULL, GC_Chunk_Size,
-            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
-    if (MAP_FAILED == chunk) {
-        perror("mmap");
+    if (!m_chunk_map->insert(chunk, GC_Chunk_Size)) {
+        chunk->destroy();
         return nullptr;
     }
+    report_backing(chunk);
 
+    ChunkFit *chunk_fit = chunk->initalise_as_fit();
+    m_chunks_fit.push_back(chunk_fit);
+
+#ifdef PZ_DEV
+    if (m_options.gc_trace()) {
+        fprintf(stderr, "Mapped new Fit chunk %p, %ld Fit chunks total\n",
+                chunk_fit, m_chunks_fit.size());
+    }
+#endif
+
+    return chunk_fit;
+}
+
+void
+Heap::report_backing(const Chunk *chunk)
+{
+    if (!m_options.gc_huge_pages()) return;
+    if (m_reported_backing == chunk->backing()) return;
+
+    fprintf(stderr, "Note: GC chunks are mapped with %s\n",
+            page_backing_name(chunk->backing()));
+    m_reported_backing = chunk->backing();
+}
+
+const char *
+page_backing_name(PageBacking backing)
+{
+    switch (backing) {
+        case PB_NORMAL:
+            return "normal pages";
+        case PB_TRANSPARENT_HUGE:
+            return "transparent huge pages";
+        case PB_HUGETLB:
+            return "hugetlb pages";
+    }
+    return "unknown pages";
+}
+
+/*
+ * madvise(MADV_HUGEPAGE) succeeds even if transparent huge pages are
+ * turned off, so check that they aren't.
+ */
+static bool
+transparent_huge_pages_enabled()
+{
+    static int enabled = -1;
+
+    if (enabled < 0) {
+        enabled = 1;
+        FILE *file = fopen("/sys/kernel/mm/transparent_hugepage/enabled",
+                "r");
+        if (file) {
+            char buffer[128];
+            if (fgets(buffer, sizeof(buffer), file) &&
+                    strstr(buffer, "[never]"))
+            {
+                enabled = 0;
+            }
+            fclose(file);
+        }
+    }
+
+    return enabled;
+}
+
+Chunk*
+Chunk::new_chunk(bool huge_pages)
+{
+    PageBacking backing = PB_NORMAL;
+    void *mem = nullptr;
+
+    if (huge_pages) {
+        mem = map_aligned(GC_Chunk_Size, true);
+        if (mem) backing = PB_HUGETLB;
+    }
+    if (!mem) {
+        mem = map_aligned(GC_Chunk_Size);
+        if (!mem) return nullptr;
+#ifdef MADV_HUGEPAGE
+        if (huge_pages && transparent_huge_pages_enabled() &&
+                0 == madvise(mem, GC_Chunk_Size, MADV_HUGEPAGE))
+        {
+            backing = PB_TRANSPARENT_HUGE;
+        }
+#endif
+    }
+
+    Chunk *chunk = static_cast<Chunk*>(mem);
     new(chunk) Chunk();
+    chunk->m_backing = backing;
 
     return chunk;
 }
 
+void*
+Chunk::map_aligned(size_t size_bytes, bool hugetlb)
+{
+    uint8_t *mem;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+    if (hugetlb) {
+#ifdef MAP_HUGETLB
+        flags |= MAP_HUGETLB;
+#else
+        return nullptr;
+#endif
+    }
+
+    /*
+     * mmap doesn't let us ask for alignment, so we map an extra chunk's
+     * worth of memory and then unmap the parts before and after an aligned
+     * region.  Huge pages are aligned to their size, so these parts are
+     * whole huge pages.
+     */
+    mem = static_cast<uint8_t*>(mmap(NULL, size_bytes + GC_Chunk_Size,
+            PROT_READ | PROT_WRITE, flags, -1, 0));
+    if (MAP_FAILED == mem) {
+        // Huge pages are often unavailable, the caller falls back.
+        if (!hugetlb) {
+            perror("mmap");
+        }
+        return nullptr;
+    }
+
+    uint8_t *aligned = reinterpret_cast<uint8_t*>(
+        AlignUp(reinterpret_cast<size_t>(mem), GC_Chunk_Size));
+    size_t before = aligned - mem;
+    size_t after = GC_Chunk_Size - before;
+    if (before > 0 && -1 == munmap(mem, before)) {
+        perror("munmap");
+    }
+    if (after > 0 && -1 == munmap(aligned + size_bytes, after)) {
+        perror("munmap");
+    }
+
+    return aligned;
+}
+
+size_t
+Chunk::release_memory(void *start, void *end)
+{
+    size_t page_size = m_backing == PB_NORMAL ?
+        Heap::s_page_size : GC_Huge_Page_Size;
+    uintptr_t first = AlignUp(reinterpret_cast<uintptr_t>(start),
+            page_size);
+    uintptr_t last = reinterpret_cast<uintptr_t>(end) & ~(page_size - 1);
+    if (first >= last) return 0;
+
+    if (-1 == madvise(reinterpret_cast<void*>(first), last - first,
+                MADV_DONTNEED))
+    {
+        perror("madvise");
+        return 0;
+    }
+    return last - first;
+}
+
 bool
 Chunk::destroy() {
     if (-1 == munmap(this, GC_Chunk_Size)) {
@@ -207,12 +482,20 @@ Chunk::destroy() {
     return true;
 }
 
+ChunkBOP::ChunkBOP() : Chunk(CT_BOP), m_wilderness(0), m_sweep_limit(0)
+{
+    memset(m_free_blocks, 0, sizeof(m_free_blocks));
+    memset(m_idle_blocks, 0, sizeof(m_idle_blocks));
+}
+
 ChunkBOP*
 Chunk::initalise_as_bop()
 {
     assert(m_type == CT_INVALID);
+    PageBacking backing = m_backing;
     ChunkBOP *chunk_bop = reinterpret_cast<ChunkBOP*>(this);
     new(chunk_bop) ChunkBOP();
+    chunk_bop->m_backing = backing;
     return chunk_bop;
 }
 
@@ -220,99 +503,177 @@ ChunkFit*
 Chunk::initalise_as_fit()
 {
     assert(m_type == CT_INVALID);
+    PageBacking backing = m_backing;
     ChunkFit *chunk_fit = reinterpret_cast<ChunkFit*>(this);
     new(chunk_fit) ChunkFit();
+    chunk_fit->m_backing = backing;
     return chunk_fit;
 }
 
+CellStartMap::CellStartMap()
+{
+    memset(m_l0, 0, sizeof(m_l0));
+    memset(m_l1, 0, sizeof(m_l1));
+    memset(m_l2, 0, sizeof(m_l2));
+}
+
+ChunkLarge*
+ChunkLarge::new_chunk(size_t size_in_words)
+{
+    size_t size_bytes = AlignUp(Header_Bytes + size_in_words * WORDSIZE_BYTES,
+            Heap::s_page_size);
+    ChunkLarge *chunk = static_cast<ChunkLarge*>(map_aligned(size_bytes));
+    if (!chunk) return nullptr;
+
+    new(chunk) ChunkLarge(size_in_words);
+
+    return chunk;
+}
+
+size_t
+ChunkLarge::mapped_bytes() const
+{
+    return AlignUp(Header_Bytes + m_size * WORDSIZE_BYTES, Heap::s_page_size);
+}
+
+bool
+ChunkLarge::destroy()
+{
+    if (-1 == munmap(this, mapped_bytes())) {
+        perror("munmap");
+        return false;
+    }
+
+    return true;
+}
+
 bool
 Heap::finalise()
 {
     bool result = true;
 
-    if (m_chunk_bop) {
-        if (!m_chunk_bop->destroy()) {
+    if (!m_options.gc_stats().empty()) {
+        m_stats->dump_json(m_options.gc_stats().c_str());
+    }
+
+    // Stop the sweeper before unmapping the chunks it may be sweeping.
+    delete m_sweeper;
+    m_sweeper = nullptr;
+
+    for (ChunkBOP *chunk : m_chunks_bop) {
+        if (!chunk->destroy()) {
+            result = false;
+        }
+    }
+    m_chunks_bop.clear();
+    m_chunks_bop_free.clear();
+
+    for (ChunkFit *chunk : m_chunks_fit) {
+        if (!chunk->destroy()) {
             result = false;
         }
-        m_chunk_bop = nullptr;
     }
+    m_chunks_fit.clear();
 
-    if (m_chunk_fit) {
-        if (!m_chunk_fit->destroy()) {
+    for (ChunkLarge *chunk : m_chunks_large) {
+        if (!chunk->destroy()) {
             result = false;
         }
-        m_chunk_fit = nullptr;
     }
+    m_chunks_large.clear();
+
+    delete m_chunk_map;
+    m_chunk_map = nullptr;
+    delete m_block_index;
+    m_block_index = nullptr;
+    delete m_mark_stack;
+    m_mark_stack = nullptr;
+    delete m_stats;
+    m_stats = nullptr;
+    delete m_immortal;
+    m_immortal = nullptr;
 
     return result;
 }
 
 /***************************************************************************/
 
-Block::Block(const Options &options, size_t cell_size_) :
-        m_header(cell_size_)
+ChunkMap::ChunkMap() : m_low(0), m_high(0)
 {
-    assert(cell_size_ >= GC_Min_Cell_Size);
-    memset(m_header.bitmap, 0, GC_Cells_Per_Block * sizeof(uint8_t));
-
-#if PZ_DEV
-    if (options.gc_poison()) {
-        memset(m_bytes, Poison_Byte, Payload_Bytes);
-    }
-#endif
-
-    sweep(options);
+    memset(m_leaves, 0, sizeof(m_leaves));
 }
 
-/***************************************************************************/
-
-size_t
-Block::usage()
+ChunkMap::~ChunkMap()
 {
-    return num_allocated() * size() * WORDSIZE_BYTES;
+    for (unsigned i = 0; i < Num_Leaves; i++) {
+        delete[] m_leaves[i];
+    }
 }
 
-unsigned Block::num_allocated()
+bool
+ChunkMap::insert(Chunk *chunk, size_t size_bytes)
 {
-    unsigned count = 0;
+    assert((reinterpret_cast<uintptr_t>(chunk) & ~GC_Chunk_Mask) == 0);
+
+    uintptr_t first = index_of(chunk);
+    uintptr_t last = index_of(reinterpret_cast<uint8_t*>(chunk) +
+            size_bytes - 1);
+    if (last >= Num_Leaves * Leaf_Entries) {
+        fprintf(stderr, "Chunk %p is outside the GC's address range\n",
+                chunk);
+        return false;
+    }
 
-    for (unsigned i = 0; i < num_cells(); i++) {
-        CellPtrBOP cell(this, i);
-        if (cell.is_allocated()) {
-            count++;
+    for (uintptr_t index = first; index <= last; index++) {
+        Chunk **&leaf = m_leaves[index >> Leaf_Bits];
+        if (!leaf) {
+            leaf = new Chunk*[Leaf_Entries]();
         }
+
+        assert(!leaf[index & (Leaf_Entries - 1)]);
+        leaf[index & (Leaf_Entries - 1)] = chunk;
     }
 
-    return count;
+    uintptr_t low = reinterpret_cast<uintptr_t>(chunk);
+    uintptr_t high = low + size_bytes;
+    if (m_low == m_high) {
+        m_low = low;
+        m_high = high;
+    } else {
+        m_low = std::min(m_low, low);
+        m_high = std::max(m_high, high);
+    }
+    return true;
 }
 
-size_t
-ChunkBOP::usage()
+void
+ChunkMap::remove(Chunk *chunk, size_t size_bytes)
 {
-    size_t usage = 0;
-
-    for (unsigned i = 0; i < m_wilderness; i++) {
-        if (m_blocks[i].is_in_use()) {
-            usage += m_blocks[i].usage();
-        }
+    uintptr_t first = index_of(chunk);
+    uintptr_t last = index_of(reinterpret_cast<uint8_t*>(chunk) +
+            size_bytes - 1);
+
+    for (uintptr_t index = first; index <= last; index++) {
+        Chunk **leaf = m_leaves[index >> Leaf_Bits];
+        assert(leaf && leaf[index & (Leaf_Entries - 1)] == chunk);
+        leaf[index & (Leaf_Entries - 1)] = nullptr;
     }
-
-    return usage;
 }
 
-size_t
-ChunkFit::usage()
+/***************************************************************************/
+
+Block::Block(const Options &options, size_t cell_size_) :
+        m_header(cell_size_)
 {
-    size_t size = 0;
+    assert(cell_size_ >= GC_Min_Cell_Size);
 
-    CellPtrFit cell = first_cell();
-    while (cell.is_valid()) {
-        if (cell.is_allocated()) {
-            size += cell.size() * WORDSIZE_BYTES + CellPtrFit::CellInfoOffset;
-        }
-        cell = cell.next_in_chunk();
+#if PZ_DEV
+    if (options.gc_poison()) {
+        memset(m_bytes, Poison_Byte, Payload_Bytes);
     }
-    return size;
+#endif
+
+    sweep(options);
 }
 
 /***************************************************************************/
@@ -320,17 +681,37 @@ ChunkFit::usage()
 void
 Heap::set_meta_info(void *obj, void *meta)
 {
+    if (m_immortal->contains(obj)) {
+        *ImmortalRegion::meta(obj) = meta;
+        return;
+    }
+
+    CellPtrLarge cell_large = ptr_to_large_cell(obj);
+    if (cell_large.is_valid()) {
+        *cell_large.meta() = meta;
+        return;
+    }
+
     CellPtrFit cell = ptr_to_fit_cell(obj);
-    assert(cell.is_valid());
+    assert(cell.is_valid() && cell.has_meta());
     *cell.meta() = meta;
 }
 
 void *
 Heap::meta_info(void *obj) const
 {
+    if (m_immortal->contains(obj)) {
+        return *ImmortalRegion::meta(obj);
+    }
+
+    CellPtrLarge cell_large = ptr_to_large_cell(obj);
+    if (cell_large.is_valid()) {
+        return *cell_large.meta();
+    }
+
     CellPtrFit cell = ptr_to_fit_cell(obj);
     assert(cell.is_valid());
-    return *cell.meta();
+    return cell.has_meta() ? *cell.meta() : nullptr;
 }
 
 /***************************************************************************/
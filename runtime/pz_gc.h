@@ -10,6 +10,7 @@
 #define PZ_GC_H
 
 #include "pz_option.h"
+#include "pz_util.h"
 
 namespace pz {
 
@@ -17,6 +18,15 @@ class AbstractGCTracer;
 
 class Heap;
 
+/*
+ * A pointer map describes which words of a small object may hold pointers,
+ * bit i is set if word i may.  Objects allocated with a pointer map are
+ * traced precisely, the collector never treats their other words as
+ * pointers.  Such objects may be at most GC_Max_Precise_Words long.
+ */
+typedef uintptr_t PtrMap;
+static const unsigned GC_Max_Precise_Words = WORDSIZE_BITS - 1;
+
 /*
  * Get current heap usage.
  */
@@ -29,6 +39,35 @@ heap_get_usage(const Heap *heap);
 unsigned
 heap_get_collections(const Heap *heap);
 
+/*
+ * Limit the heap's usage to this many bytes, zero removes the limit.  An
+ * allocation that can't be satisfied within the limit runs out of memory.
+ * Returns false, and leaves the limit, if the heap is already larger.
+ */
+bool
+heap_set_max_size(Heap *heap, size_t size_bytes);
+
+size_t
+heap_get_max_size(const Heap *heap);
+
+/*
+ * The percentage of CPU time the collector aims to use, zero grows the
+ * heap by a fixed factor instead.  Returns false if the target is out of
+ * range.
+ */
+bool
+heap_set_gc_cpu_target(Heap *heap, unsigned percent);
+
+unsigned
+heap_get_gc_cpu_target(const Heap *heap);
+
+/*
+ * Get a collector statistic by name, see pz_gc_stats.cpp for the names.
+ * Returns false if there's no such statistic.
+ */
+bool
+heap_get_stat(const Heap *heap, const char *name, int64_t *value);
+
 /*
  * Attach some meta-information to an object.  The object must have been
  * allocated with one of the _meta allocation functions.
@@ -49,6 +88,7 @@ heap_interior_ptr_to_ptr(const Heap *heap, void *ptr);
 
 class CellPtrBOP;
 class CellPtrFit;
+class CellPtrLarge;
 
 class HeapMarkState {
   private:
@@ -67,6 +107,8 @@ class HeapMarkState {
     mark_root(CellPtrBOP &cell_bop);
     void
     mark_root(CellPtrFit &cell_fit);
+    void
+    mark_root(CellPtrLarge &cell_large);
 
     /*
      * heap_ptr is a pointer into the heap that a root needs to keep alive.
@@ -9,6 +9,8 @@
 #ifndef PZ_GC_IMPL_H
 #define PZ_GC_IMPL_H
 
+#include <vector>
+
 #include "pz_util.h"
 #include "pz_gc.h"
 #include "pz_gc_util.h"
@@ -18,9 +20,19 @@ namespace pz {
 class CellPtr;
 class CellPtrBOP;
 class CellPtrFit;
+class CellPtrLarge;
 class Block;
+class BlockIndex;
+class Chunk;
 class ChunkBOP;
 class ChunkFit;
+class ChunkLarge;
+class ChunkMap;
+class GCStats;
+class ImmortalRegion;
+class MarkStack;
+struct CollectionStats;
+class Sweeper;
 
 class Heap {
   private:
@@ -28,17 +40,100 @@ class Heap {
 
     static size_t       s_page_size;
 
-    // For now there's exactly two chunks: one for small allocations
-    // (big bag of pages aka "bop"), and one for medium sized allocations
-    // (best fit with splitting). (Big allocations will be implemented
-    // later).
-    ChunkBOP*           m_chunk_bop;
-    ChunkFit*           m_chunk_fit;
+    // There are three kinds of chunks: those for small allocations (big
+    // bag of pages aka "bop"), those for medium sized allocations (best fit
+    // with splitting), and those holding a single large object.  We start
+    // with one BOP and one Fit chunk and map more as the heap grows.
+    std::vector<ChunkBOP*> m_chunks_bop;
+    std::vector<ChunkFit*> m_chunks_fit;
+    std::vector<ChunkLarge*> m_chunks_large;
+
+    // BOP chunks that may have free blocks, the last one is used first.
+    std::vector<ChunkBOP*> m_chunks_bop_free;
+
+    // Find the chunk for any address.
+    ChunkMap*           m_chunk_map;
+
+    // Find a block with free cells of a given size.
+    BlockIndex*         m_block_index;
+
+    // Cells that have been marked but not yet scanned.
+    MarkStack*          m_mark_stack;
+
+    // Statistics about past collections.
+    GCStats*            m_stats;
+
+    // The background sweeper thread, if enabled.
+    Sweeper*            m_sweeper;
+
+    // Objects allocated with an immortal GCCapability, which are never
+    // freed.
+    ImmortalRegion*     m_immortal;
+
+    // The allocation buffers that must be emptied before collecting.
+    std::vector<AllocBuffer*> m_alloc_buffers;
 
     size_t              m_usage;
     size_t              m_threshold;
+
+    // The heap sizing policy, see pz_gc_policy.cpp.  A limit of zero is no
+    // limit, a CPU target of zero grows the heap by a fixed factor.
+    size_t              m_max_size;
+    unsigned            m_cpu_target;
+    // Smoothed measurements from earlier collections, zero until
+    // measured.  Rates are in bytes per second.
+    double              m_mark_rate;
+    double              m_alloc_rate;
+    double              m_survival_rate;
+    // The usage just after the last collection, and when it finished.
+    size_t              m_live;
+    double              m_last_collect_end;
+
+    // When generational, cells that survive a collection keep their mark
+    // so minor collections only trace cells allocated since.  Full
+    // collections clear the marks first.
+    size_t              m_full_threshold;
+    bool                m_next_full;
+
+    // Objects that pointers were stored into since the last collection,
+    // other than those the allocation buffers remember.  Each cell's
+    // remembered bit is set while it is in one of these sets.
+    std::vector<void*>  m_remembered;
+    void               *m_last_remembered;
+
+    // With a gc_max_pause, whether an incremental collection is marking.
+    // Meanwhile new cells are allocated marked and stores are remembered
+    // so that the fields of marked cells can be scanned again.  Marking
+    // takes a slice every m_slice_bytes, once m_allocated reaches
+    // m_next_slice, and finishes in one pause if the usage goes beyond
+    // m_mark_limit.
+    bool                m_marking;
+    size_t              m_slice_bytes;
+    size_t              m_next_slice;
+    size_t              m_mark_limit;
+    // The slices of this collection, including the pause that started
+    // it, and the seconds they took.  The value of m_allocated when it
+    // started.
+    unsigned            m_mark_slices;
+    double              m_mark_slices_seconds;
+    size_t              m_mark_start_allocated;
+
     unsigned            m_collections;
 
+    // The bytes allocated since the heap was created, runs given to
+    // allocation buffers count when they're given.
+    size_t              m_allocated;
+
+    // The mean number of bytes between the allocation profiler's samples,
+    // or zero if it's off.  The value of m_allocated to take the next
+    // sample at, and the state for randomising the intervals.
+    size_t              m_sample_interval;
+    size_t              m_next_sample;
+    uint64_t            m_sample_random;
+
+    // The PageBacking of the last chunk reported, or -1.
+    int                 m_reported_backing;
+
     AbstractGCTracer   &m_trace_global_roots;
 
   public:
@@ -52,13 +147,30 @@ class Heap {
 
     enum AllocOpts {
         NORMAL,
-        META
+        META,
+        // A small cell whose last word holds a pointer map.
+        PRECISE
     };
 
-    void * alloc(size_t size_in_words, GCCapability &gc_cap, AllocOpts opts);
+    /*
+     * If a buffer is given and this is a small allocation then also refill
+     * the buffer's run for this size class.
+     */
+    void * alloc(size_t size_in_words, GCCapability &gc_cap, AllocOpts opts,
+        AllocBuffer *buffer = nullptr);
     void * alloc_bytes(size_t size_in_bytes, GCCapability &gc_cap,
         AllocOpts opts);
 
+    /*
+     * Allocate an object that is traced using this pointer map, the cell
+     * has room for the map after the object.
+     */
+    void * alloc_precise(size_t size_in_words, PtrMap ptr_map,
+        GCCapability &gc_cap, AllocBuffer *buffer = nullptr);
+
+    void add_alloc_buffer(AllocBuffer *buffer);
+    void remove_alloc_buffer(AllocBuffer *buffer);
+
     /*
      * Note that usage is an over-estimate, it can contain block-internal
      * fragmentation.
@@ -67,6 +179,18 @@ class Heap {
 
     unsigned collections() const { return m_collections; }
 
+    const GCStats & stats() const { return *m_stats; }
+
+    size_t max_size() const { return m_max_size; }
+    unsigned cpu_target() const { return m_cpu_target; }
+
+    /*
+     * Change the sizing policy at runtime.  These return false if the
+     * value is invalid, a limit is invalid if the heap is already larger.
+     */
+    bool set_max_size(size_t size_bytes);
+    bool set_cpu_target(unsigned percent);
+
     Heap(const Heap &) = delete;
     Heap& operator=(const Heap &) = delete;
 
@@ -78,6 +202,20 @@ class Heap {
         collect(thread_tracer);
     }
 
+    /*
+     * Remember an object that a pointer was stored into, for
+     * GCCapability::write_barrier().
+     */
+    void write_barrier(void *obj);
+
+    /*
+     * Only old (marked) cells need remembering, each is remembered once
+     * until the remembered sets are cleared so that they stay no bigger
+     * than the heap.  Returns true if the caller should add obj to its
+     * remembered set.
+     */
+    bool remember(void *obj);
+
     void set_meta_info(void *obj, void *meta);
 
     void * meta_info(void *obj) const;
@@ -85,31 +223,156 @@ class Heap {
   private:
     void collect(const AbstractGCTracer *thread_tracer);
 
+    // Mark the cells that the immortal region points to, as roots.
+    void mark_immortal(HeapMarkState &state);
+
     bool is_empty() const { return usage() == 0; };
 
-    // Returns the number of cells marked recursively.
+    // Returns the number of cells marked recursively.  When marking in
+    // parallel or incrementally the cell is only pushed on the mark stack.
     template<typename Cell>
     unsigned mark(Cell &cell);
 
-    unsigned mark_field(void *ptr);
+    // Start an incremental collection by marking the roots, see
+    // pz_gc_incremental.cpp.  collect() finishes it.
+    void start_marking(const AbstractGCTracer *thread_tracer);
+
+    // Mark for up to gc_max_pause microseconds.  Returns false if marking
+    // is complete and the collection can finish.
+    bool mark_slice();
+
+    // Record a pause of incremental marking.
+    void record_mark_slice(double start);
+
+    // The allocation buffers' runs were marked when they were allocated,
+    // unmark their unused cells so that they're freed.
+    void unmark_unused_runs();
+
+    void set_remember_stores(bool remember);
+
+    // Mark the cell this field points to, if any, and push its fields
+    // onto the mark stack.  Returns the number of cells marked.  If
+    // Parallel then this is safe to call from multiple marking threads
+    // with different stacks, at the cost of atomic operations.  Fit cells
+    // are pinned unless the field is precise.
+    template<bool Parallel>
+    unsigned mark_field(MarkStack &stack, void *ptr, bool precise);
+
+    // Push the fields of a marked cell onto the mark stack.  For cells
+    // with meta information that is also a field.
+    static void push_fields(MarkStack &stack, CellPtrBOP &cell);
+    static void push_fields(MarkStack &stack, CellPtrFit &cell);
+    static void push_fields(MarkStack &stack, CellPtrLarge &cell);
+
+    // The pointer map of a precise cell, masked to the cell's size.
+    static PtrMap cell_ptr_map(CellPtrBOP &cell);
+
+    // Mark the cells these fields point to.  Returns the number of cells
+    // marked.
+    template<bool Parallel>
+    unsigned scan_fields(MarkStack &stack, void **fields, size_t num_fields);
+
+    // Scan the fields on the mark stack until it is empty.  Returns the
+    // number of cells marked.
+    unsigned drain_mark_stack(MarkStack &stack);
+
+    // Scan the fields on the mark stack until it is empty or the deadline
+    // (from now()) passes.  Returns true if the stack is empty.
+    bool drain_mark_stack(MarkStack &stack, double deadline);
+
+    // Add the block occupancy and number of marked cells to these
+    // statistics.  Called after marking, before sweeping.
+    void record_mark_stats(CollectionStats &stats) const;
+
+    // Add the fit chunks' free space and fragmentation, as their sweeps
+    // found it.  Called after sweeping, a chunk left for the background
+    // sweeper still has the figures from its previous sweep.
+    void record_sweep_stats(CollectionStats &stats) const;
+
+    // Count a new cell, or run of cells, towards the usage.
+    void count_alloc(size_t size_bytes) {
+        m_usage += size_bytes;
+        m_allocated += size_bytes;
+    }
+
+    // An allocation reached m_next_sample, take a sample and choose the
+    // next one.
+    void sample_allocation(GCCapability &gc_cap);
+
+    // A random number of bytes until the next sample, the intervals are
+    // exponentially distributed around m_sample_interval so that they
+    // don't fall into step with the program's allocations.
+    size_t next_sample_interval();
+
+    // Monotonic time in seconds.
+    static double now();
 
-    // Specialised for marking specific cell types.  Returns the size of the
-    // cell.
-    static unsigned do_mark(CellPtrBOP &cell);
-    static unsigned do_mark(CellPtrFit &cell);
-    
-    unsigned do_mark_special_field(CellPtrBOP &cell);
-    unsigned do_mark_special_field(CellPtrFit &cell);
+    // Set the threshold for the next collection from the measurements of
+    // this one.  Of the bytes allocated, those allocated while marking
+    // incrementally survive regardless.
+    void update_threshold(double start, size_t allocated,
+            size_t allocated_marking, bool full);
+
+    // True if an allocation of this size would take the heap beyond its
+    // limit.
+    bool exceeds_max_size(size_t size_bytes) const {
+        return m_max_size && m_usage + size_bytes > m_max_size;
+    }
+
+    // Clear the marks left on the cells that survived earlier
+    // collections, before a full collection.
+    void clear_marks();
+
+    // Scan the fields of the old cells that pointers were stored into, for
+    // a minor collection.
+    void mark_remembered();
+    void mark_remembered(void *obj);
+    void clear_remembered();
+    void forget(void *obj);
+
+    // If the mark stack overflowed during marking then some marked cells
+    // were never scanned, find and scan them.
+    void recover_mark_stack_overflow();
+    void rescan_marked_cells();
+
+    // Slide together the live cells in sparse fit chunks, after marking
+    // and before sweeping.
+    void compact();
 
     void sweep();
 
-    void * try_allocate(size_t size_in_words);
-    void * try_small_allocate(size_t size_in_words);
-    void * try_medium_allocate(size_t size_in_words);
+    // Before marking, release the memory that has been free for a while
+    // and unmap empty chunks.
+    void release_free_memory();
+
+    // Rebuild m_chunks_bop_free.
+    void find_free_chunks_bop();
+
+    void * try_allocate(size_t size_in_words, AllocOpts opts,
+        AllocBuffer *buffer);
+    void * try_small_allocate(size_t size_in_words, bool precise,
+        AllocBuffer *buffer);
+    void * try_small_allocate_run(Block *block, bool precise,
+        AllocBuffer *buffer);
+    void * try_medium_allocate(size_t size_in_words, bool meta);
+    void * try_large_allocate(size_t size_in_words);
 
     Block * get_block_for_allocation(size_t size_in_words);
 
     Block * allocate_block(size_t size_in_words);
+    Block * take_free_block();
+
+    /*
+     * Map a new chunk suitable for this allocation.  Returns false if
+     * that's not possible.
+     */
+    bool grow(size_t size_in_words, AllocOpts opts);
+    ChunkBOP * new_chunk_bop();
+    ChunkFit * new_chunk_fit();
+
+    // With gc_huge_pages, say which pages chunks are mapped with whenever
+    // that changes.
+    void report_backing(const Chunk *chunk);
 
     /*
      * Although these two methods are marked as inline they are defined in
@@ -126,8 +389,13 @@ class Heap {
     CellPtrBOP ptr_to_bop_cell_interior(void *ptr) const;
     CellPtrFit ptr_to_fit_cell(void *ptr) const;
     CellPtrFit ptr_to_fit_cell_interior(void *ptr) const;
+    CellPtrLarge ptr_to_large_cell(void *ptr) const;
+    CellPtrLarge ptr_to_large_cell_interior(void *ptr) const;
 
     friend class HeapMarkState;
+    friend class ParallelMarker;
+    friend class Chunk;
+    friend class ChunkLarge;
 
   public:
     void * interior_ptr_to_ptr(void *ptr) const;
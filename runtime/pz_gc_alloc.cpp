@@ -8,24 +8,39 @@
 
 #include "pz_common.h"
 
+#include <math.h>
 #include <string.h>
 
+#include <algorithm>
+
 #include "pz_util.h"
 
 #include "pz_gc.h"
 #include "pz_gc_util.h"
 
 #include "pz_gc.impl.h"
+#include "pz_gc_immortal.h"
 #include "pz_gc_layout.h"
 #include "pz_gc_layout.impl.h"
+#include "pz_gc_sweep.h"
 
 namespace pz {
 
 void *
-Heap::alloc(size_t size_in_words, GCCapability &gc_cap, AllocOpts opts)
+Heap::alloc(size_t size_in_words, GCCapability &gc_cap, AllocOpts opts,
+        AllocBuffer *buffer)
 {
     assert(size_in_words > 0);
 
+    // Immortal objects never cause a collection.
+    if (gc_cap.immortal()) {
+        void *obj = m_immortal->alloc(size_in_words);
+        if (!obj) {
+            gc_cap.oom(size_in_words * WORDSIZE_BYTES);
+        }
+        return obj;
+    }
+
     bool should_collect = false;
 
 #ifdef PZ_DEV
@@ -34,48 +49,80 @@ Heap::alloc(size_t size_in_words, GCCapability &gc_cap, AllocOpts opts)
         gc_cap.can_gc() &&
         !is_empty())
     {
-        // Force a collect before each allocation in this mode.
-        should_collect = true;
+        // Force a collect before each allocation in this mode.  While
+        // marking incrementally take a slice instead, so that the mutator
+        // runs between slices, the collection finishes once there's
+        // nothing left to mark.
+        should_collect = !m_marking || !mark_slice();
+        // And don't fill allocation buffers, so that every allocation
+        // reaches here.
+        buffer = nullptr;
     }
 #endif
 
-    if (gc_cap.can_gc() &&
-        m_usage + size_in_words * WORDSIZE_BYTES > m_threshold)
-    {
-        should_collect = true;
+    size_t size_bytes = size_in_words * WORDSIZE_BYTES;
+    if (gc_cap.can_gc()) {
+        if (m_marking) {
+            // Incremental marking is underway, it finishes when there's
+            // nothing left to mark or the heap has grown too far.
+            if (m_usage + size_bytes > m_mark_limit ||
+                    (m_allocated >= m_next_slice && !mark_slice()))
+            {
+                should_collect = true;
+            }
+        } else if (m_usage + size_bytes > m_threshold) {
+            should_collect = true;
+        }
     }
 
     if (should_collect) {
-        collect(&gc_cap.tracer());
+        if (m_options.gc_max_pause() && !m_marking) {
+            start_marking(&gc_cap.tracer());
+            // Nothing has been freed yet, going beyond the heap's limit
+            // below finishes the collection straight away.
+            should_collect = false;
+        } else {
+            collect(&gc_cap.tracer());
+        }
     }
 
-    void *cell;
-    switch (opts) {
-        case NORMAL:
-            cell = try_allocate(size_in_words);
-            break;
-        case META:
-            cell = try_medium_allocate(size_in_words);
-            break;
-        default:
-            fprintf(stderr, "Unexpected cell opts\n");
-            abort();
+    // Memory beyond the heap's limit is never used, even if it's free.
+    if (exceeds_max_size(size_bytes)) {
+        if (gc_cap.can_gc() && !should_collect) {
+            collect(&gc_cap.tracer());
+            should_collect = true;
+        }
+        if (exceeds_max_size(size_bytes)) {
+            gc_cap.oom(size_bytes);
+            return nullptr;
+        }
     }
 
+    void *cell = try_allocate(size_in_words, opts, buffer);
+
+    // When marking incrementally the heap grows while it marks, up to
+    // m_mark_limit.
     if (cell == NULL && gc_cap.can_gc() && !should_collect) {
-        collect(&gc_cap.tracer());
-        switch (opts) {
-            case NORMAL:
-                cell = try_allocate(size_in_words);
-                break;
-            case META:
-                cell = try_medium_allocate(size_in_words);
-                break;
+        if (!m_options.gc_max_pause()) {
+            collect(&gc_cap.tracer());
+            cell = try_allocate(size_in_words, opts, buffer);
+        } else if (!m_marking) {
+            start_marking(&gc_cap.tracer());
         }
     }
 
+    /*
+     * If collecting didn't free enough memory (or we may not collect) then
+     * grow the heap.
+     */
+    if (cell == NULL && grow(size_in_words, opts)) {
+        cell = try_allocate(size_in_words, opts, buffer);
+    }
+
     if (cell == NULL) {
         gc_cap.oom(size_in_words * WORDSIZE_BYTES);
+    } else if (m_sample_interval && m_allocated >= m_next_sample) {
+        sample_allocation(gc_cap);
     }
 
     return cell;
@@ -91,26 +138,195 @@ Heap::alloc_bytes(size_t size_in_bytes, GCCapability &gc_cap,
     return alloc(size_in_words, gc_cap, opts);
 }
 
+static_assert(GC_Max_Precise_Words < GC_Small_Alloc_Threshold,
+        "Objects with pointer maps must fit in small cells");
+
 void *
-Heap::try_allocate(size_t size_in_words)
+Heap::alloc_precise(size_t size_in_words, PtrMap ptr_map,
+        GCCapability &gc_cap, AllocBuffer *buffer)
 {
-    if (size_in_words <= GC_Small_Alloc_Threshold) {
-        return try_small_allocate(size_in_words);
-    } else {
-        return try_medium_allocate(size_in_words);
+    assert(size_in_words <= GC_Max_Precise_Words);
+    assert(!(ptr_map >> size_in_words));
+
+    // The immortal region is scanned conservatively.
+    if (gc_cap.immortal()) {
+        return alloc(size_in_words, gc_cap, NORMAL);
+    }
+
+    void **cell = reinterpret_cast<void**>(
+            alloc(size_in_words + 1, gc_cap, PRECISE, buffer));
+    if (!cell) return nullptr;
+
+    cell[round_small_size(size_in_words + 1) - 1] =
+        reinterpret_cast<void*>(ptr_map);
+    return cell;
+}
+
+void
+Heap::add_alloc_buffer(AllocBuffer *buffer)
+{
+    buffer->m_remember_stores = m_options.gc_generational() || m_marking;
+    buffer->m_immortal = m_immortal;
+    m_alloc_buffers.push_back(buffer);
+}
+
+void
+Heap::remove_alloc_buffer(AllocBuffer *buffer)
+{
+    for (auto i = m_alloc_buffers.begin(); i != m_alloc_buffers.end(); i++) {
+        if (*i == buffer) {
+            // The cells it remembered still have their remembered bits
+            // set, so the heap takes over remembering them.
+            m_remembered.insert(m_remembered.end(),
+                    buffer->m_remembered.begin(),
+                    buffer->m_remembered.end());
+            m_alloc_buffers.erase(i);
+            return;
+        }
+    }
+    assert(!"Allocation buffer not found");
+}
+
+void
+Heap::sample_allocation(GCCapability &gc_cap)
+{
+    /*
+     * Allocations that fill an AllocBuffer's run stand for the whole run,
+     * so the allocations made from buffers are sampled without any cost
+     * to their fast path.  An allocation may cross several sample points,
+     * it stands for all of them.
+     */
+    size_t weight = 0;
+    while (m_next_sample <= m_allocated) {
+        m_next_sample += next_sample_interval();
+        weight += m_sample_interval;
+    }
+
+    // Allocations in a NoGCScope have no tracer and aren't recorded.
+    if (gc_cap.can_gc()) {
+        gc_cap.tracer().sample_allocation(weight);
     }
 }
 
+size_t
+Heap::next_sample_interval()
+{
+    // xorshift64*
+    m_sample_random ^= m_sample_random >> 12;
+    m_sample_random ^= m_sample_random << 25;
+    m_sample_random ^= m_sample_random >> 27;
+    uint64_t bits = m_sample_random * 0x2545f4914f6cdd1dull;
+
+    // uniform is in [0, 1).
+    double uniform = (bits >> 11) * (1.0 / (uint64_t(1) << 53));
+    double interval = -log(1.0 - uniform) * m_sample_interval;
+    return std::max(size_t(1), std::min(size_t(interval),
+                m_sample_interval * 64));
+}
+
+void
+Heap::write_barrier(void *obj)
+{
+    m_immortal->write_barrier(obj);
+
+    if ((m_options.gc_generational() || m_marking) &&
+            obj != m_last_remembered && remember(obj))
+    {
+        m_remembered.push_back(obj);
+        m_last_remembered = obj;
+    }
+}
+
+bool
+Heap::remember(void *obj)
+{
+    Chunk *chunk = m_chunk_map->lookup(obj);
+    if (!chunk) return false;
+
+    // Cells that aren't marked are scanned if they're reachable, either
+    // by the next minor collection or when marking reaches them.
+    switch (chunk->type()) {
+        case CT_BOP: {
+            CellPtrBOP cell =
+                static_cast<ChunkBOP*>(chunk)->ptr_to_cell_interior(obj);
+            return cell.is_valid() && cell.is_marked() && cell.remember();
+        }
+        case CT_FIT: {
+            // The background sweeper may be updating the cell headers.
+            ChunkFit *chunk_fit = static_cast<ChunkFit*>(chunk);
+            chunk_fit->ensure_swept(m_options);
+            CellPtrFit cell = chunk_fit->ptr_to_cell_interior(obj);
+            return cell.is_valid() && cell.is_marked() && cell.remember();
+        }
+        case CT_LARGE: {
+            CellPtrLarge cell =
+                static_cast<ChunkLarge*>(chunk)->ptr_to_cell_interior(obj);
+            return cell.is_valid() && cell.is_marked() && cell.remember();
+        }
+        default:
+            return false;
+    }
+}
+
+static_assert(AllocBuffer::Num_Size_Classes == GC_Num_Size_Classes,
+        "AllocBuffer must have a run for each size class");
+static_assert(AllocBuffer::Max_Cell_Size == GC_Small_Alloc_Threshold,
+        "AllocBuffer must cover all small allocations");
+
+const uint8_t AllocBuffer::s_size_classes[] = {
+    0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7,
+    8, 8, 8, 8, 9, 9, 9, 9, 10, 10, 10, 10, 11, 11, 11, 11,
+    12, 12, 12, 12, 13, 13, 13, 13, 14, 14, 14, 14, 15, 15, 15, 15,
+    16, 16, 16, 16, 17, 17, 17, 17, 18, 18, 18, 18, 19, 19, 19, 19
+};
+
 void *
-Heap::try_small_allocate(size_t size_in_words)
+Heap::try_allocate(size_t size_in_words, AllocOpts opts,
+        AllocBuffer *buffer)
 {
-    if (size_in_words < GC_Min_Cell_Size) {
-        size_in_words = GC_Min_Cell_Size;
-    } else if (size_in_words <= 16) {
-        size_in_words = RoundUp(size_in_words, size_t(2));
+    if (size_in_words > GC_Large_Alloc_Threshold) {
+        return try_large_allocate(size_in_words);
+    }
+
+    switch (opts) {
+        case NORMAL:
+            if (size_in_words <= GC_Small_Alloc_Threshold) {
+                return try_small_allocate(size_in_words, false, buffer);
+            } else {
+                return try_medium_allocate(size_in_words, false);
+            }
+        case META:
+            return try_medium_allocate(size_in_words, true);
+        case PRECISE:
+            assert(size_in_words <= GC_Small_Alloc_Threshold);
+            return try_small_allocate(size_in_words, true, buffer);
+        default:
+            fprintf(stderr, "Unexpected cell opts\n");
+            abort();
+    }
+}
+
+bool
+Heap::grow(size_t size_in_words, AllocOpts opts)
+{
+    if (size_in_words > GC_Large_Alloc_Threshold) {
+        // try_large_allocate always maps a new chunk, so there's nothing to
+        // do here.
+        return false;
+    } else if (opts != META && size_in_words <= GC_Small_Alloc_Threshold) {
+        return new_chunk_bop() != nullptr;
     } else {
-        size_in_words = RoundUp(size_in_words, size_t(4));
+        return new_chunk_fit() != nullptr;
     }
+}
+
+void *
+Heap::try_small_allocate(size_t size_in_words, bool precise,
+        AllocBuffer *buffer)
+{
+    assert(AllocBuffer::s_size_classes[size_in_words] ==
+            size_class_of(round_small_size(size_in_words)));
+    size_in_words = round_small_size(size_in_words);
 
     /*
      * Try the free list
@@ -129,10 +345,19 @@ Heap::try_small_allocate(size_t size_in_words)
         }
     }
 
-    CellPtrBOP cell = block->allocate_cell();
+    if (buffer) {
+        return try_small_allocate_run(block, precise, buffer);
+    }
+
+    CellPtrBOP cell = block->allocate_cell(precise);
+    assert(cell.is_valid());
+    if (block->is_full()) {
+        m_block_index->remove_first(size_in_words);
+    }
+    if (m_marking) {
+        cell.mark();
+    }
 
-    if (!cell.is_valid()) return nullptr;
-    
     #ifdef PZ_DEV
     if (m_options.gc_poison()) {
         memset(cell.pointer(), Poison_Byte, block->size() * WORDSIZE_BYTES);
@@ -143,39 +368,77 @@ Heap::try_small_allocate(size_t size_in_words)
     }
     #endif
 
-    m_usage += block->size() * WORDSIZE_BYTES;
+    count_alloc(block->size() * WORDSIZE_BYTES);
 
     return cell.pointer();
 }
 
-Block *
-Heap::get_block_for_allocation(size_t size_in_words)
+void *
+Heap::try_small_allocate_run(Block *block, bool precise,
+        AllocBuffer *buffer)
 {
-    return m_chunk_bop->get_block_for_allocation(size_in_words);
+    size_t size_in_words = block->size();
+    void **start;
+    unsigned num_cells = block->allocate_run(precise, m_marking, &start);
+    if (block->is_full()) {
+        m_block_index->remove_first(size_in_words);
+    }
+
+    size_t run_bytes = num_cells * size_in_words * WORDSIZE_BYTES;
+
+    #ifdef PZ_DEV
+    if (m_options.gc_poison()) {
+        memset(start, Poison_Byte, run_bytes);
+    }
+
+    if (m_options.gc_trace2()) {
+        fprintf(stderr, "Allocated %p and buffered %u more cells\n",
+                start, num_cells - 1);
+    }
+    #endif
+
+    // The whole run is counted as used until the buffer is emptied.
+    count_alloc(run_bytes);
+
+    buffer->set_run(size_class_of(size_in_words), precise,
+            start + size_in_words, start + num_cells * size_in_words,
+            size_in_words);
+
+    return start;
 }
 
 Block *
-ChunkBOP::get_block_for_allocation(size_t size_in_words)
+Heap::get_block_for_allocation(size_t size_in_words)
 {
-    for (unsigned i = 0; i < m_wilderness; i++) {
-        Block *block = &(m_blocks[i]);
+    Block *block = m_block_index->get(size_in_words);
+
+    if (block && block->needs_sweep()) {
+        block->ensure_swept(m_options);
+        // Blocks are only indexed if they had unmarked cells.
+        assert(!block->is_full());
 
-        if (block->is_in_use() && block->size() == size_in_words &&
-                !block->is_full())
-        {
-            return block;
+        #ifdef PZ_DEV
+        if (m_options.gc_trace2()) {
+            fprintf(stderr, "Lazily swept block for %ld-word cells\n",
+                    size_in_words);
         }
+        #endif
     }
 
-    return nullptr;
+    return block;
 }
 
 Block *
 Heap::allocate_block(size_t size_in_words)
 {
-    Block *block;
-
-    block = m_chunk_bop->allocate_block();
+    Block *block = take_free_block();
+    if (!block && m_sweeper) {
+        // The background sweeper may be freeing blocks, wait for it rather
+        // than growing the heap.
+        m_sweeper->wait();
+        find_free_chunks_bop();
+        block = take_free_block();
+    }
     if (!block) return nullptr;
 
     #ifdef PZ_DEV
@@ -185,21 +448,40 @@ Heap::allocate_block(size_t size_in_words)
     #endif
 
     new(block) Block(m_options, size_in_words);
+    m_block_index->add(block);
 
     return block;
 }
 
+Block *
+Heap::take_free_block()
+{
+    while (!m_chunks_bop_free.empty()) {
+        Block *block = m_chunks_bop_free.back()->allocate_block();
+        if (block) return block;
+        // This chunk is full, don't look at it again until after the next
+        // sweep.
+        m_chunks_bop_free.pop_back();
+    }
+    return nullptr;
+}
+
 Block*
 ChunkBOP::allocate_block()
 {
-    for (unsigned i = 0; i < m_wilderness; i++) {
-        if (!m_blocks[i].is_in_use()) {
-#ifdef PZ_DEV
-            fprintf(stderr,
-                "Running previously-unused code path, "
-                "see https://github.com/PlasmaLang/plasma/issues/191\n");
-#endif
-            return &m_blocks[i];
+    for (unsigned i = 0; i < Free_Bitmap_Words; i++) {
+        uintptr_t free =
+            __atomic_load_n(&m_free_blocks[i], __ATOMIC_ACQUIRE);
+        if (free) {
+            // Only the allocator clears bits, so this one stays set until
+            // we clear it.
+            unsigned bit = __builtin_ctzl(free);
+            __atomic_fetch_and(&m_free_blocks[i], ~(uintptr_t(1) << bit),
+                __ATOMIC_RELAXED);
+            unsigned index = i * WORDSIZE_BITS + bit;
+            assert(index < m_wilderness);
+            assert(!m_blocks[index].is_in_use());
+            return &m_blocks[index];
         }
     }
 
@@ -209,65 +491,230 @@ ChunkBOP::allocate_block()
     return &m_blocks[m_wilderness++];
 }
 
+bool
+ChunkBOP::has_free_block() const
+{
+    if (m_wilderness < GC_Block_Per_Chunk) return true;
+
+    for (unsigned i = 0; i < Free_Bitmap_Words; i++) {
+        if (__atomic_load_n(&m_free_blocks[i], __ATOMIC_RELAXED)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+unsigned
+Block::allocate_run(bool precise, bool marked, void ***start)
+{
+    assert(is_in_use());
+    assert(!is_full());
+
+    unsigned first = first_free_cell();
+
+    // The run ends at the next allocated cell or the end of the block.
+    unsigned limit = num_cells();
+    unsigned end = first + 1;
+    while (end < limit) {
+        uintptr_t used = m_header.alloc_bits[bit_word(end)] >>
+            (end % WORDSIZE_BITS);
+        if (used) {
+            end += __builtin_ctzl(used);
+            break;
+        }
+        end = (bit_word(end) + 1) * WORDSIZE_BITS;
+    }
+    if (end > limit) end = limit;
+
+    for (unsigned i = first; i < end; ) {
+        unsigned shift = i % WORDSIZE_BITS;
+        unsigned num = end - i;
+        if (num > WORDSIZE_BITS - shift) num = WORDSIZE_BITS - shift;
+        uintptr_t mask = num == WORDSIZE_BITS ? ~uintptr_t(0) :
+            ((uintptr_t(1) << num) - 1) << shift;
+        assert(!(m_header.alloc_bits[bit_word(i)] & mask));
+        m_header.alloc_bits[bit_word(i)] |= mask;
+        if (precise) {
+            m_header.precise_bits[bit_word(i)] |= mask;
+        }
+        if (marked) {
+            m_header.mark_bits[bit_word(i)] |= mask;
+        }
+        i += num;
+    }
+
+    unsigned num = end - first;
+    m_header.num_free -= num;
+    if (marked) {
+        m_header.num_marked += num;
+    }
+
+    *start = index_to_pointer(first);
+    return num;
+}
+
+unsigned
+Block::first_free_cell() const
+{
+    // Since the block isn't full and the bits past the last cell are
+    // clear, the first clear bit is a free cell.
+    for (unsigned i = 0; i < Bitmap_Words; i++) {
+        uintptr_t free = ~m_header.alloc_bits[i];
+        if (free) {
+            return i * WORDSIZE_BITS + __builtin_ctzl(free);
+        }
+    }
+    abort();
+}
+
 CellPtrBOP
-Block::allocate_cell()
+Block::allocate_cell(bool precise)
 {
     assert(is_in_use());
 
-    if (m_header.free_list < 0)
+    if (is_full())
         return CellPtrBOP::Invalid();
 
-    CellPtrBOP cell(this, m_header.free_list);
-    assert(!cell.is_allocated());
-    m_header.free_list = cell.next_in_list();
-    assert(m_header.free_list == Header::Empty_Free_List ||
-            (m_header.free_list < static_cast<int>(num_cells()) &&
-            m_header.free_list >= 0));
-    cell.allocate();
-    return cell;
+    unsigned index = first_free_cell();
+    m_header.alloc_bits[bit_word(index)] |= bit_mask(index);
+    if (precise) {
+        m_header.precise_bits[bit_word(index)] |= bit_mask(index);
+    }
+    m_header.num_free--;
+    return CellPtrBOP(this, index);
 }
 
 void *
-Heap::try_medium_allocate(size_t size_in_words)
+Heap::try_medium_allocate(size_t size_in_words, bool meta)
 {
-    CellPtrFit cell = m_chunk_fit->allocate_cell(size_in_words);
+    // The meta information is stored in an extra word at the end of the
+    // cell.
+    if (meta) {
+        size_in_words++;
+    }
+
+    CellPtrFit cell = CellPtrFit::Invalid();
+    for (ChunkFit *chunk : m_chunks_fit) {
+        chunk->ensure_swept(m_options);
+        cell = chunk->allocate_cell(size_in_words, meta);
+        if (cell.is_valid()) break;
+    }
+    if (!cell.is_valid()) return nullptr;
 
 #ifdef PZ_DEV
-    if (cell.is_valid() && m_options.gc_poison()) {
+    if (m_options.gc_poison()) {
         memset(cell.pointer(), Poison_Byte, cell.size() * WORDSIZE_BYTES);
     }
 #endif
-    *cell.meta() = nullptr;
+    if (meta) {
+        *cell.meta() = nullptr;
+    }
+    if (m_marking) {
+        cell.mark();
+    }
 
-    m_usage += cell.size()*WORDSIZE_BYTES + CellPtrFit::CellInfoOffset;
+    count_alloc(cell.size()*WORDSIZE_BYTES + CellPtrFit::CellInfoOffset);
 
     return cell.pointer();
 }
 
+void *
+Heap::try_large_allocate(size_t size_in_words)
+{
+    ChunkLarge *chunk = ChunkLarge::new_chunk(size_in_words);
+    if (!chunk) return nullptr;
+
+    if (!m_chunk_map->insert(chunk, chunk->mapped_bytes())) {
+        chunk->destroy();
+        return nullptr;
+    }
+    m_chunks_large.push_back(chunk);
+
+#ifdef PZ_DEV
+    if (m_options.gc_poison()) {
+        memset(chunk->payload(), Poison_Byte, size_in_words * WORDSIZE_BYTES);
+    }
+
+    if (m_options.gc_trace()) {
+        fprintf(stderr, "Mapped large chunk %p for %ld words\n",
+                chunk, size_in_words);
+    }
+#endif
+
+    if (m_marking) {
+        chunk->cell().mark();
+    }
+
+    count_alloc(chunk->mapped_bytes());
+
+    return chunk->payload();
+}
+
 constexpr size_t CellSplitThreshold = Block::Max_Cell_Size +
     CellPtrFit::CellInfoOffset;
 
 CellPtrFit
-ChunkFit::allocate_cell(size_t size_in_words)
+ChunkFit::allocate_cell(size_t size_in_words, bool meta)
 {
-    CellPtrFit cell = m_header.free_list;
+    CellPtrFit cell = take_free_cell(size_in_words);
+    if (!cell.is_valid()) return cell;
 
-    while (cell.is_valid()) {
-        if (cell.size() >= size_in_words) {
-            m_header.free_list = cell.next_in_list();
+    // Should we split the cell?
+    if (cell.size() >= size_in_words + CellSplitThreshold) {
+        CellPtrFit new_cell = cell.split(size_in_words);
+        add_free_cell(new_cell);
+    }
 
-            // Should we split the cell?
-            if (cell.size() >= size_in_words + CellSplitThreshold) {
-                CellPtrFit new_cell = cell.split(size_in_words);
-                new_cell.set_next_in_list(m_header.free_list);
-                m_header.free_list = new_cell;
-            }
+    cell.set_allocated(meta);
+    return cell;
+}
 
-            cell.set_allocated();
-            return cell;
+void
+ChunkFit::add_free_cell(CellPtrFit &cell)
+{
+    assert(!cell.is_allocated());
+    unsigned list = free_list_of(cell.size());
+
+    *cell.pointer() = m_header.free_lists[list];
+    m_header.free_lists[list] = cell.pointer();
+    m_header.free_lists_nonempty |= uintptr_t(1) << list;
+}
+
+CellPtrFit
+ChunkFit::take_free_cell(size_t size_in_words)
+{
+    // Every cell on the lists from fit_list upwards is big enough, take the
+    // first one.
+    unsigned fit_list = size_in_words > 1 ?
+        floor_log2(size_in_words - 1) + 1 : 0;
+    uintptr_t lists = fit_list < Num_Free_Lists ?
+        m_header.free_lists_nonempty & (~uintptr_t(0) << fit_list) : 0;
+    if (lists) {
+        unsigned list = __builtin_ctzl(lists);
+        CellPtrFit cell(this, m_header.free_lists[list]);
+        m_header.free_lists[list] = *cell.pointer();
+        if (!m_header.free_lists[list]) {
+            m_header.free_lists_nonempty &= ~(uintptr_t(1) << list);
         }
+        return cell;
+    }
 
-        cell = cell.next_in_list();
+    // Otherwise search the list below it, whose cells may or may not be big
+    // enough.
+    unsigned list = free_list_of(size_in_words);
+    if (list == fit_list) return CellPtrFit::Invalid();
+
+    void **prev = &m_header.free_lists[list];
+    while (*prev) {
+        CellPtrFit cell(this, *prev);
+        if (cell.size() >= size_in_words) {
+            *prev = *cell.pointer();
+            if (!m_header.free_lists[list]) {
+                m_header.free_lists_nonempty &= ~(uintptr_t(1) << list);
+            }
+            return cell;
+        }
+        prev = cell.pointer();
     }
 
     return CellPtrFit::Invalid();
@@ -276,15 +723,18 @@ ChunkFit::allocate_cell(size_t size_in_words)
 ChunkFit::ChunkFit() : Chunk(CT_FIT)
 {
     CellPtrFit singleCell = first_cell();
-    singleCell.init((Payload_Bytes - CellPtrFit::CellInfoOffset)
-        / WORDSIZE_BYTES);
-    m_header.free_list = singleCell;
+    singleCell.init(Max_Cell_Size);
+    set_cell_start(singleCell);
+    add_free_cell(singleCell);
+    m_header.free_bytes = Payload_Bytes;
+    m_header.largest_free_bytes = Payload_Bytes;
 }
 
 CellPtrFit
 CellPtrFit::split(size_t new_size)
 {
-    assert(size() >= 1 + CellPtrFit::CellInfoOffset + new_size);
+    assert(size() >= 1 + CellPtrFit::CellInfoOffset/WORDSIZE_BYTES +
+            new_size);
 #ifdef PZ_DEV
     void *end_of_cell = next_by_size(size());
 #endif
@@ -294,6 +744,7 @@ CellPtrFit::split(size_t new_size)
         CellPtrFit::CellInfoOffset/WORDSIZE_BYTES;
     set_size(new_size);
     new_cell.init(rem_size);
+    m_chunk->set_cell_start(new_cell);
 
 #ifdef PZ_DEV
     assert(new_cell.pointer() == next_in_chunk().pointer());
@@ -10,14 +10,20 @@
 
 #include <string.h>
 
+#include <algorithm>
+
 #include "pz_util.h"
 
 #include "pz_gc.h"
 #include "pz_gc_util.h"
 
 #include "pz_gc.impl.h"
+#include "pz_gc_immortal.h"
 #include "pz_gc_layout.h"
 #include "pz_gc_layout.impl.h"
+#include "pz_gc_mark.h"
+#include "pz_gc_stats.h"
+#include "pz_gc_sweep.h"
 
 namespace pz {
 
@@ -40,25 +46,69 @@ Heap::collect(const AbstractGCTracer *trace_thread_roots)
 {
     HeapMarkState state(this);
 
+    // If this finishes an incremental collection then marking has
+    // already started and the sweeping and releasing of memory was done
+    // then.
+    bool incremental = m_marking;
+
+    // The unused cells in allocation buffers will be freed by this
+    // collection.
+    if (incremental) {
+        unmark_unused_runs();
+    }
+    for (AllocBuffer *buffer : m_alloc_buffers) {
+        buffer->reset();
+    }
+
     // There's nothing to collect, the heap is empty.
-    if (is_empty()) return;
+    if (is_empty() && !incremental) return;
+
+    double start = now();
+    size_t allocated = m_usage > m_live ? m_usage - m_live : 0;
+
+    if (!incremental) {
+        // Blocks left over from the last collection must be swept so that
+        // their mark bits are clear.
+        if (m_sweeper) {
+            m_sweeper->wait();
+        }
+        for (ChunkBOP *chunk : m_chunks_bop) {
+            chunk->finish_sweep(m_options);
+        }
+
+        if (m_options.gc_release_after()) {
+            release_free_memory();
+        }
+    }
+
+    bool minor = m_options.gc_generational() && !m_next_full;
+    if (m_options.gc_generational() && !minor) {
+        clear_marks();
+    }
+    double mark_start = now();
 
 #ifdef PZ_DEV
     size_t initial_usage = usage();
 
     assert(!m_in_no_gc_scope);
 
-    if (m_options.gc_slow_asserts()) {
+    // During incremental marking the heap has marks that check_heap()
+    // doesn't expect, it was checked when marking started.
+    if (m_options.gc_slow_asserts() && !incremental) {
         check_heap();
     }
 #endif
 
 #ifdef PZ_DEV
+    if (m_options.gc_trace() && m_options.gc_generational()) {
+        fprintf(stderr, "%s collection\n", minor ? "Minor" : "Full");
+    }
     if (m_options.gc_trace()) {
         fprintf(stderr, "Tracing from global roots\n");
     }
 #endif
     m_trace_global_roots.do_trace(&state);
+    mark_immortal(state);
 #ifdef PZ_DEV
     if (m_options.gc_trace()) {
         fprintf(stderr, "Done tracing from global roots\n");
@@ -78,16 +128,86 @@ Heap::collect(const AbstractGCTracer *trace_thread_roots)
     }
 #endif
 
+    // Incremental marking scans the marked cells that were stored into
+    // again, since they may now point to unmarked cells.  The roots have
+    // been scanned again above.
+    if (minor || incremental) {
+        mark_remembered();
+    }
+    clear_remembered();
+    if (incremental) {
+        m_marking = false;
+        set_remember_stores(m_options.gc_generational());
+    }
+
+    if (m_options.gc_mark_threads() > 1) {
+        ParallelMarker marker(*this, m_options.gc_mark_threads());
+        marker.run(*m_mark_stack);
+    }
+
+    // This is done once after all the roots have been traced so that
+    // multiple overflows can share a rescan.
+    recover_mark_stack_overflow();
+    double mark_end = now();
+
 #ifdef PZ_DEV
     if (m_options.gc_trace()) {
         state.print_stats(stderr);
     }
 #endif
 
+    CollectionStats stats;
+    memset(&stats, 0, sizeof(stats));
+    stats.full = !minor;
+    stats.allocated_bytes = allocated;
+    if (incremental) {
+        stats.incremental = true;
+        stats.slices = m_mark_slices;
+        stats.slices_us = m_mark_slices_seconds * 1e6;
+    }
+    record_mark_stats(stats);
+
+    m_mark_stack->shrink();
+    // Cells allocated during incremental marking were never scanned, so
+    // they may point to cells that compacting would move.
+    if (m_options.gc_compact() && !minor && !incremental) {
+        compact();
+    }
     sweep();
+    record_sweep_stats(stats);
     m_collections++;
 
+    double end = now();
+    stats.mark_us = (mark_end - mark_start) * 1e6;
+    stats.sweep_us = (mark_start - start + end - mark_end) * 1e6;
+    stats.survived_bytes = m_usage;
+    m_stats->record(stats);
+    if (GCStats::take_dump_request() && !m_options.gc_stats().empty()) {
+        m_stats->dump_json(m_options.gc_stats().c_str());
+    }
+
+    // The slices of an incremental collection count as collecting time
+    // rather than mutator time.
+    size_t allocated_marking = 0;
+    if (incremental) {
+        start -= m_mark_slices_seconds;
+        allocated_marking = std::min(allocated,
+                m_allocated - m_mark_start_allocated);
+    }
+    update_threshold(start, allocated, allocated_marking, !minor);
+
+    if (!minor) {
+        m_full_threshold = std::max(GC_Initial_Threshold,
+                size_t(m_usage * GC_Full_Threshold_Factor));
+    }
+    m_next_full = m_usage > m_full_threshold;
+
 #ifdef PZ_DEV
+    if (m_sweeper &&
+            (m_options.gc_slow_asserts() || m_options.gc_usage_stats()))
+    {
+        m_sweeper->wait();
+    }
     if (m_options.gc_slow_asserts()) {
         check_heap();
     }
@@ -95,102 +215,582 @@ Heap::collect(const AbstractGCTracer *trace_thread_roots)
         print_usage_stats(initial_usage);
     }
 #endif
+
+    m_last_collect_end = now();
+}
+
+void
+Heap::mark_immortal(HeapMarkState &state)
+{
+    const std::vector<void**> &slots = m_immortal->slots(*m_chunk_map);
+
+#ifdef PZ_DEV
+    if (m_options.gc_trace()) {
+        fprintf(stderr,
+                "Tracing from %ld pointers in the immortal region (%ldKB)\n",
+                slots.size(), m_immortal->size_bytes() / 1024);
+    }
+#endif
+
+    for (void **slot : slots) {
+        state.mark_root(REMOVE_TAG(*slot));
+    }
 }
 
 template<typename Cell>
 unsigned
 Heap::mark(Cell &cell)
 {
-    unsigned num_marked = 0;
-    size_t cell_size;
-
     assert(cell.is_valid());
-    cell_size = do_mark(cell);
-    num_marked++;
+    cell.mark();
+    push_fields(*m_mark_stack, cell);
 
-    num_marked += do_mark_special_field(cell);
-    void **ptr = cell.pointer();
-    for (unsigned i = 0; i < cell_size; i++) {
-        num_marked += mark_field(REMOVE_TAG(ptr[i]));
-    }
+    // When marking in parallel or incrementally the roots are only greyed
+    // here, and their fields are scanned once all the roots have been
+    // found, or a slice at a time.
+    if (m_options.gc_mark_threads() > 1 || m_marking) return 1;
 
-    return num_marked;
+    return 1 + drain_mark_stack(*m_mark_stack);
 }
 
+template<bool Parallel, typename Cell>
+static bool
+try_mark(Cell &cell)
+{
+    if (Parallel) {
+        return cell.try_mark();
+    } else if (cell.is_allocated() && !cell.is_marked()) {
+        cell.mark();
+        return true;
+    } else {
+        return false;
+    }
+}
+
+template<bool Parallel>
 unsigned
-Heap::mark_field(void *cur)
-{
-    CellPtrBOP field_bop = ptr_to_bop_cell(cur);
-    if (field_bop.is_valid()) {
-        /*
-         * Note that because we use conservative we may find values that
-         * exactly match valid but unallocated cells.  Therefore we also
-         * test is_allocated().
-         */
-        if (field_bop.is_allocated() &&
-                !field_bop.is_marked()) {
-            return mark(field_bop);
+Heap::mark_field(MarkStack &stack, void *cur, bool precise)
+{
+    Chunk *chunk = m_chunk_map->lookup(cur);
+    if (!chunk) return 0;
+
+    /*
+     * Note that because we use conservative we may find values that
+     * exactly match valid but unallocated cells.  Therefore try_mark
+     * also tests is_allocated().
+     */
+    switch (chunk->type()) {
+        case CT_BOP: {
+            CellPtrBOP field = static_cast<ChunkBOP*>(chunk)->ptr_to_cell(cur);
+            if (field.is_valid() && try_mark<Parallel>(field)) {
+                push_fields(stack, field);
+                return 1;
+            }
+            break;
         }
-    } else {
-        CellPtrFit field_fit = ptr_to_fit_cell(cur);
-        if (field_fit.is_valid()) {
-            /*
-             * We also test is_allocated() here, see the above comment.
-             */
-            if (field_fit.is_allocated() &&
-                    !field_fit.is_marked()) {
-                return mark(field_fit);
+        case CT_FIT: {
+            CellPtrFit field = static_cast<ChunkFit*>(chunk)->ptr_to_cell(cur);
+            if (!field.is_valid()) break;
+            // Free cells may be referenced by stale pointers, sweeping
+            // wouldn't unpin them.
+            if (!precise && field.is_allocated()) {
+                field.pin();
+            }
+            if (try_mark<Parallel>(field)) {
+                push_fields(stack, field);
+                return 1;
             }
+            break;
         }
+        case CT_LARGE: {
+            CellPtrLarge field =
+                static_cast<ChunkLarge*>(chunk)->ptr_to_cell(cur);
+            if (field.is_valid() && try_mark<Parallel>(field)) {
+                push_fields(stack, field);
+                return 1;
+            }
+            break;
+        }
+        default:
+            break;
     }
 
     return 0;
 }
 
-unsigned
-Heap::do_mark_special_field(CellPtrBOP &cell)
+void
+Heap::push_fields(MarkStack &stack, CellPtrBOP &cell)
 {
-    return 0;
+    size_t size = cell.block()->size();
+
+    if (cell.is_precise()) {
+        PtrMap ptr_map = cell_ptr_map(cell);
+        if (ptr_map) {
+            stack.push_ptr_map(cell.pointer(), ptr_map);
+        }
+    } else {
+        stack.push(cell.pointer(), size);
+    }
 }
 
-unsigned
-Heap::do_mark_special_field(CellPtrFit &cell)
+// The meta information is always a pointer, so it is scanned precisely.
+void
+Heap::push_fields(MarkStack &stack, CellPtrFit &cell)
+{
+    if (cell.has_meta()) {
+        stack.push_ptr_map(cell.meta(), 1);
+        stack.push(cell.pointer(), cell.size() - 1);
+    } else {
+        stack.push(cell.pointer(), cell.size());
+    }
+}
+
+void
+Heap::push_fields(MarkStack &stack, CellPtrLarge &cell)
+{
+    stack.push_ptr_map(cell.meta(), 1);
+    stack.push(cell.pointer(), cell.size());
+}
+
+PtrMap
+Heap::cell_ptr_map(CellPtrBOP &cell)
+{
+    size_t size = cell.block()->size();
+
+    // Mask the map so that a cell that was never initialised can't make us
+    // scan beyond it.
+    return reinterpret_cast<PtrMap>(cell.pointer()[size - 1]) &
+        ((PtrMap(1) << (size - 1)) - 1);
+}
+
+void
+Heap::recover_mark_stack_overflow()
+{
+    while (m_mark_stack->overflowed()) {
+#ifdef PZ_DEV
+        if (m_options.gc_trace()) {
+            fprintf(stderr, "Mark stack overflowed, rescanning heap\n");
+        }
+#endif
+        m_mark_stack->clear_overflowed();
+        rescan_marked_cells();
+    }
+}
+
+void
+Heap::clear_marks()
+{
+    for (ChunkBOP *chunk : m_chunks_bop) {
+        chunk->clear_marks();
+    }
+    for (ChunkFit *chunk : m_chunks_fit) {
+        chunk->clear_marks();
+    }
+    for (ChunkLarge *chunk : m_chunks_large) {
+        CellPtrLarge cell = chunk->cell();
+        if (cell.is_marked()) {
+            cell.unmark();
+        }
+    }
+}
+
+void
+Heap::mark_remembered()
+{
+    for (void *obj : m_remembered) {
+        mark_remembered(obj);
+    }
+    for (AllocBuffer *buffer : m_alloc_buffers) {
+        for (void *obj : buffer->m_remembered) {
+            mark_remembered(obj);
+        }
+    }
+
+    // As with the roots, when marking in parallel the fields are scanned
+    // later.
+    if (m_options.gc_mark_threads() <= 1) {
+        drain_mark_stack(*m_mark_stack);
+    }
+}
+
+void
+Heap::mark_remembered(void *obj)
+{
+    Chunk *chunk = m_chunk_map->lookup(obj);
+    if (!chunk) return;
+
+    // Young cells are traced if they're reachable, so only the fields of
+    // old (marked) cells need scanning.
+    switch (chunk->type()) {
+        case CT_BOP: {
+            CellPtrBOP cell =
+                static_cast<ChunkBOP*>(chunk)->ptr_to_cell_interior(obj);
+            if (cell.is_valid() && cell.is_marked()) {
+                push_fields(*m_mark_stack, cell);
+            }
+            break;
+        }
+        case CT_FIT: {
+            CellPtrFit cell =
+                static_cast<ChunkFit*>(chunk)->ptr_to_cell_interior(obj);
+            if (cell.is_valid() && cell.is_marked()) {
+                push_fields(*m_mark_stack, cell);
+            }
+            break;
+        }
+        case CT_LARGE: {
+            CellPtrLarge cell =
+                static_cast<ChunkLarge*>(chunk)->ptr_to_cell_interior(obj);
+            if (cell.is_valid() && cell.is_marked()) {
+                push_fields(*m_mark_stack, cell);
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+void
+Heap::clear_remembered()
+{
+    for (void *obj : m_remembered) {
+        forget(obj);
+    }
+    m_remembered.clear();
+    m_last_remembered = nullptr;
+    for (AllocBuffer *buffer : m_alloc_buffers) {
+        for (void *obj : buffer->m_remembered) {
+            forget(obj);
+        }
+        buffer->clear_remembered();
+    }
+}
+
+void
+Heap::forget(void *obj)
 {
-    return mark_field(*cell.meta());
+    // remember() only remembers valid cells, and they can't have been
+    // freed or moved since.
+    Chunk *chunk = m_chunk_map->lookup(obj);
+    assert(chunk);
+
+    switch (chunk->type()) {
+        case CT_BOP:
+            static_cast<ChunkBOP*>(chunk)->ptr_to_cell_interior(obj)
+                .forget();
+            break;
+        case CT_FIT:
+            static_cast<ChunkFit*>(chunk)->ptr_to_cell_interior(obj)
+                .forget();
+            break;
+        case CT_LARGE:
+            static_cast<ChunkLarge*>(chunk)->ptr_to_cell_interior(obj)
+                .forget();
+            break;
+        default:
+            assert(!"Remembered object isn't in a chunk");
+    }
 }
 
+template<bool Parallel>
 unsigned
-Heap::do_mark(CellPtrBOP &cell)
+Heap::scan_fields(MarkStack &stack, void **fields, size_t num_fields)
 {
-    cell.mark();
-    return cell.block()->size();
+    unsigned num_marked = 0;
+
+    if (MarkStack::is_ptr_map_entry(num_fields)) {
+        PtrMap ptr_map = MarkStack::entry_ptr_map(num_fields);
+        while (ptr_map) {
+            unsigned i = __builtin_ctzl(ptr_map);
+            num_marked += mark_field<Parallel>(stack, REMOVE_TAG(fields[i]),
+                    true);
+            ptr_map &= ptr_map - 1;
+        }
+        return num_marked;
+    }
+
+    for (size_t i = 0; i < num_fields; i++) {
+        num_marked += mark_field<Parallel>(stack, REMOVE_TAG(fields[i]),
+                false);
+    }
+
+    return num_marked;
 }
 
+template unsigned
+Heap::scan_fields<true>(MarkStack &stack, void **fields, size_t num_fields);
+template unsigned
+Heap::scan_fields<false>(MarkStack &stack, void **fields, size_t num_fields);
+
 unsigned
-Heap::do_mark(CellPtrFit &cell)
+Heap::drain_mark_stack(MarkStack &stack)
 {
-    cell.mark();
-    return cell.size();
+    unsigned num_marked = 0;
+    void **fields;
+    size_t num_fields;
+
+    while (stack.pop(&fields, &num_fields)) {
+        num_marked += scan_fields<false>(stack, fields, num_fields);
+    }
+
+    return num_marked;
+}
+
+/*
+ * When the mark stack overflows some marked cells' fields were never
+ * scanned.  We don't know which, so scan the fields of every marked cell.
+ * Draining the stack after each one means that the cell's own fields are
+ * always pushed, so a pass that overflows again has always marked
+ * something new, and this terminates.
+ */
+void
+Heap::rescan_marked_cells()
+{
+    for (ChunkBOP *chunk : m_chunks_bop) {
+        for (unsigned i = 0; i < chunk->num_blocks(); i++) {
+            Block *block = chunk->block(i);
+            if (!block->is_in_use()) continue;
+
+            for (unsigned j = 0; j < block->num_cells(); j++) {
+                CellPtrBOP cell(block, j);
+                if (cell.is_marked()) {
+                    push_fields(*m_mark_stack, cell);
+                    drain_mark_stack(*m_mark_stack);
+                }
+            }
+        }
+    }
+
+    for (ChunkFit *chunk : m_chunks_fit) {
+        for (CellPtrFit cell = chunk->first_cell(); cell.is_valid();
+                cell = cell.next_in_chunk())
+        {
+            if (cell.is_marked()) {
+                push_fields(*m_mark_stack, cell);
+                drain_mark_stack(*m_mark_stack);
+            }
+        }
+    }
+
+    for (ChunkLarge *chunk : m_chunks_large) {
+        CellPtrLarge cell = chunk->cell();
+        if (cell.is_marked()) {
+            push_fields(*m_mark_stack, cell);
+            drain_mark_stack(*m_mark_stack);
+        }
+    }
+
 }
 
 void
 Heap::sweep()
 {
-    m_chunk_bop->sweep(m_options);
-    m_chunk_fit->sweep(m_options);
+    m_usage = 0;
+    m_block_index->clear();
+    for (ChunkBOP *chunk : m_chunks_bop) {
+        m_usage += chunk->sweep(m_options, *m_block_index,
+                m_sweeper != nullptr);
+    }
+    find_free_chunks_bop();
+    for (ChunkFit *chunk : m_chunks_fit) {
+        m_usage += chunk->marked_bytes();
+        if (m_sweeper) {
+            chunk->set_needs_sweep();
+        } else {
+            chunk->sweep(m_options);
+        }
+    }
+
+    // Large objects are freed by unmapping their chunks.
+    unsigned num_live_large = 0;
+    for (ChunkLarge *chunk : m_chunks_large) {
+        CellPtrLarge cell = chunk->cell();
+        if (cell.is_marked()) {
+            if (!m_options.gc_generational()) {
+                cell.unmark();
+            }
+            m_usage += chunk->mapped_bytes();
+            m_chunks_large[num_live_large++] = chunk;
+        } else {
+            m_chunk_map->remove(chunk, chunk->mapped_bytes());
+            chunk->destroy();
+        }
+    }
+    m_chunks_large.resize(num_live_large);
+
+    if (m_sweeper) {
+        m_sweeper->start(m_chunks_bop, m_chunks_fit);
+    }
+}
+
+void
+Heap::release_free_memory()
+{
+    unsigned after = m_options.gc_release_after();
+    size_t released = 0;
+    unsigned num_unmapped = 0;
+
+    for (ChunkBOP *chunk : m_chunks_bop) {
+        released += chunk->release_free_blocks(after);
+    }
+    for (ChunkFit *chunk : m_chunks_fit) {
+        chunk->ensure_swept(m_options);
+        released += chunk->release_free_cells(after);
+    }
+
+    // Keep one chunk of each kind so that we don't map a new one for the
+    // next allocation.
+    for (unsigned i = 0; i < m_chunks_bop.size() && m_chunks_bop.size() > 1;)
+    {
+        ChunkBOP *chunk = m_chunks_bop[i];
+        if (chunk->is_idle(after)) {
+            m_chunks_bop.erase(m_chunks_bop.begin() + i);
+            m_chunk_map->remove(chunk, GC_Chunk_Size);
+            chunk->destroy();
+            num_unmapped++;
+        } else {
+            i++;
+        }
+    }
+    for (unsigned i = 0; i < m_chunks_fit.size() && m_chunks_fit.size() > 1;)
+    {
+        ChunkFit *chunk = m_chunks_fit[i];
+        if (chunk->is_idle(after)) {
+            m_chunks_fit.erase(m_chunks_fit.begin() + i);
+            m_chunk_map->remove(chunk, GC_Chunk_Size);
+            chunk->destroy();
+            num_unmapped++;
+        } else {
+            i++;
+        }
+    }
+    if (num_unmapped) {
+        find_free_chunks_bop();
+    }
+
+#ifdef PZ_DEV
+    if (m_options.gc_trace() && (released || num_unmapped)) {
+        fprintf(stderr, "Released %ldKB of free memory, unmapped %u chunks\n",
+                released / 1024, num_unmapped);
+    }
+#else
+    (void)released;
+#endif
+}
+
+void
+Heap::find_free_chunks_bop()
+{
+    m_chunks_bop_free.clear();
+    for (ChunkBOP *chunk : m_chunks_bop) {
+        if (chunk->has_free_block()) {
+            m_chunks_bop_free.push_back(chunk);
+        }
+    }
+}
+
+size_t
+ChunkBOP::sweep(const Options &options, BlockIndex &index, bool defer_free)
+{
+    size_t usage = 0;
+
+    m_sweep_limit = m_wilderness;
+    for (unsigned i = 0; i < m_wilderness; i++) {
+        Block &block = m_blocks[i];
+        if (!block.is_in_use()) continue;
+        assert(!block.needs_sweep());
+
+        unsigned num_marked = block.num_marked();
+        if (num_marked == 0) {
+            if (defer_free) {
+                block.set_needs_sweep();
+            } else {
+                block.make_unused(options);
+                set_block_free(i);
+            }
+            continue;
+        }
+
+        // The cells are swept when the allocator first uses this block, or
+        // before the next collection.
+        block.set_needs_sweep();
+        usage += num_marked * block.size() * WORDSIZE_BYTES;
+        if (num_marked < block.num_cells()) {
+            index.add(&block);
+        }
+    }
+
+    return usage;
+}
+
+void
+ChunkBOP::finish_sweep(const Options &options)
+{
+    // Blocks that aren't in use are never flagged, so they fail the claim.
+    // This doesn't check is_in_use() since the allocator may be
+    // initialising them, SweepState's constructor stores atomically so
+    // that the claim can race with it.
+    for (unsigned i = 0; i < m_sweep_limit; i++) {
+        if (m_blocks[i].claim_sweep()) {
+            sweep_block(options, i);
+        }
+    }
+}
 
-    m_usage = m_chunk_bop->usage() + m_chunk_fit->usage();
-    m_threshold = size_t(m_usage * GC_Threshold_Factor);
+void
+ChunkBOP::clear_marks()
+{
+    for (unsigned i = 0; i < m_wilderness; i++) {
+        if (m_blocks[i].is_in_use()) {
+            m_blocks[i].clear_marks();
+        }
+    }
 }
 
 void
-ChunkBOP::sweep(const Options &options)
+ChunkBOP::sweep_block(const Options &options, unsigned index)
+{
+    if (m_blocks[index].sweep(options)) {
+        m_blocks[index].make_unused(options);
+        set_block_free(index);
+    }
+}
+
+size_t
+ChunkBOP::release_free_blocks(unsigned after)
+{
+    size_t released = 0;
+
+    for (unsigned i = 0; i < m_wilderness; i++) {
+        if (m_blocks[i].is_in_use() || m_idle_blocks[i] >= after) continue;
+
+        if (++m_idle_blocks[i] == after) {
+            released += release_memory(&m_blocks[i], &m_blocks[i + 1]);
+        }
+    }
+
+    return released;
+}
+
+bool
+ChunkBOP::is_idle(unsigned after) const
 {
     for (unsigned i = 0; i < m_wilderness; i++) {
-        if (m_blocks[i].sweep(options)) {
-            m_blocks[i].make_unused();
+        if (m_blocks[i].is_in_use() || m_idle_blocks[i] < after) {
+            return false;
         }
     }
+    return true;
+}
+
+void
+ChunkBOP::set_block_free(unsigned index)
+{
+    assert(index < m_sweep_limit);
+    m_idle_blocks[index] = 0;
+    __atomic_fetch_or(&m_free_blocks[index / WORDSIZE_BITS],
+        uintptr_t(1) << (index % WORDSIZE_BITS), __ATOMIC_RELEASE);
 }
 
 bool
@@ -198,84 +798,282 @@ Block::sweep(const Options &options)
 {
     if (!is_in_use()) return true;
 
-    int free_list = Header::Empty_Free_List;
     unsigned num_used = 0;
 
-    for (unsigned i = 0; i < num_cells(); i++) {
-        CellPtrBOP cell(this, i);
-        if (cell.is_marked()) {
-            // Cell is marked, clear the mark bit, keep the allocated bit.
-            cell.unmark();
-            num_used++;
-        } else {
-            // Free the cell.
-            cell.unallocate();
+    // A word of cells at a time, the marked cells stay allocated and the
+    // rest are freed.
+    for (unsigned i = 0; i < Bitmap_Words; i++) {
+        uintptr_t marked = m_header.mark_bits[i];
 #if PZ_DEV
-            if (options.gc_poison()) {
-                memset(cell.pointer(), Poison_Byte, size() * WORDSIZE_BYTES);
+        if (options.gc_poison()) {
+            uintptr_t dead = m_header.alloc_bits[i] & ~marked;
+            while (dead) {
+                unsigned index = i * WORDSIZE_BITS + __builtin_ctzl(dead);
+                memset(index_to_pointer(index), Poison_Byte,
+                    size() * WORDSIZE_BYTES);
+                dead &= dead - 1;
             }
+        }
 #endif
-            cell.set_next_in_list(free_list);
-            free_list = cell.index();
+        m_header.alloc_bits[i] = marked;
+        m_header.precise_bits[i] &= marked;
+        if (!options.gc_generational()) {
+            m_header.mark_bits[i] = 0;
         }
+        num_used += __builtin_popcountl(marked);
     }
 
-    m_header.free_list = free_list;
+    assert(!needs_sweep() || num_used == m_header.num_marked);
+    m_header.num_free = num_cells() - num_used;
+    // When generational the survivors stay marked, they're old.
+    m_header.num_marked = options.gc_generational() ? num_used : 0;
+    m_header.sweep_state.set_swept();
 
     return num_used == 0;
 }
 
 void
-Block::make_unused()
+Block::ensure_swept(const Options &options)
+{
+    if (!needs_sweep()) return;
+
+    if (claim_sweep()) {
+        sweep(options);
+    } else {
+        m_header.sweep_state.wait();
+    }
+}
+
+void
+Block::clear_marks()
+{
+    assert(!needs_sweep());
+    for (unsigned i = 0; i < Bitmap_Words; i++) {
+        m_header.mark_bits[i] = 0;
+    }
+    m_header.num_marked = 0;
+}
+
+void
+Block::make_unused(const Options &options)
 {
     m_header.block_type_or_size = Header::Block_Empty;
+
+#if PZ_DEV
+    if (options.gc_poison()) {
+        memset(m_bytes, Poison_Byte, Payload_Bytes);
+    }
+#endif
 }
 
 void
 ChunkFit::sweep(const Options &options)
 {
-    for (CellPtrFit cell = first_cell();
-            cell.is_valid();
+    for (unsigned i = 0; i < Num_Free_Lists; i++) {
+        m_header.free_lists[i] = nullptr;
+    }
+    m_header.free_lists_nonempty = 0;
+
+    // The free cell that we're merging dead cells into, if any.
+    CellPtrFit free_cell = CellPtrFit::Invalid();
+
+    // Count the free space for the statistics as each free cell is
+    // finished.
+    size_t free_bytes = 0;
+    size_t largest_free_bytes = 0;
+    auto finish_free_cell = [&]() {
+        size_t bytes = free_cell.size() * WORDSIZE_BYTES +
+            CellPtrFit::CellInfoOffset;
+        free_bytes += bytes;
+        largest_free_bytes = std::max(largest_free_bytes, bytes);
+        sweep_free_cell(options, free_cell);
+    };
+
+    CellPtrFit cell = first_cell();
+    while (cell.is_valid()) {
+        CellPtrFit next = cell.next_in_chunk();
+
+        if (cell.is_marked()) {
+            if (!options.gc_generational()) {
+                cell.unmark();
+            }
+            cell.unpin();
+            if (free_cell.is_valid()) {
+                finish_free_cell();
+                free_cell = CellPtrFit::Invalid();
+            }
+        } else {
+            if (cell.is_allocated()) {
+                cell.set_free();
+            }
+            if (free_cell.is_valid()) {
+                free_cell.merge_next(cell);
+                clear_cell_start(cell);
+            } else {
+                free_cell = cell;
+            }
+        }
+
+        cell = next;
+    }
+
+    if (free_cell.is_valid()) {
+        finish_free_cell();
+    }
+    __atomic_store_n(&m_header.free_bytes, free_bytes, __ATOMIC_RELAXED);
+    __atomic_store_n(&m_header.largest_free_bytes, largest_free_bytes,
+            __ATOMIC_RELAXED);
+
+    if (!options.gc_generational()) {
+        m_header.marked_cells = 0;
+        m_header.marked_bytes = 0;
+    }
+    m_header.sweep_state.set_swept();
+}
+
+void
+ChunkFit::clear_marks()
+{
+    assert(!m_header.sweep_state.needs_sweep());
+    for (CellPtrFit cell = first_cell(); cell.is_valid();
             cell = cell.next_in_chunk())
     {
         if (cell.is_marked()) {
             cell.unmark();
-        } else {
-#ifdef PZ_DEV
-            static int seldom_used_path = 0;
-            seldom_used_path++;
-            if (seldom_used_path > 100) {
-                fprintf(stderr,
-                        "Running previously-unused code path, "
-                        "see https://github.com/PlasmaLang/plasma/issues/196\n");
-            }
-            if (options.gc_poison()) {
-                memset(cell.meta(), Poison_Byte, sizeof(*cell.meta()));
-                // We cannot poison the first word of the cell since that
-                // contains the next pointer.
-                memset(reinterpret_cast<uint8_t*>(cell.pointer()) + 
-                        WORDSIZE_BYTES,
-                    Poison_Byte, (cell.size() - 1) * WORDSIZE_BYTES);
+        }
+    }
+    m_header.marked_cells = 0;
+    m_header.marked_bytes = 0;
+}
+
+void
+ChunkFit::ensure_swept(const Options &options)
+{
+    if (!m_header.sweep_state.needs_sweep()) return;
+
+    if (claim_sweep()) {
+        sweep(options);
+    } else {
+        m_header.sweep_state.wait();
+    }
+}
+
+size_t
+ChunkFit::release_free_cells(unsigned after)
+{
+    assert(!m_header.sweep_state.needs_sweep());
+    size_t released = 0;
+
+    for (unsigned i = 0; i < Num_Free_Lists; i++) {
+        void *cur = m_header.free_lists[i];
+        while (cur) {
+            CellPtrFit cell(this, cur);
+            if (cell.idle() < after) {
+                cell.set_idle(cell.idle() + 1);
+                if (cell.idle() == after) {
+                    // Keep the first word, it links the free list.
+                    released += release_memory(cell.pointer() + 1,
+                            cell.pointer() + cell.size());
+                }
             }
-            cell.check();
-#endif
-            // TODO: Free the cell
+            cur = *cell.pointer();
         }
     }
+
+    return released;
+}
+
+bool
+ChunkFit::is_idle(unsigned after)
+{
+    return is_empty() && first_cell().idle() >= after;
+}
+
+void
+ChunkFit::sweep_free_cell(const Options &options, CellPtrFit &cell)
+{
+#ifdef PZ_DEV
+    // Poisoning a released cell would make it resident again.
+    if (options.gc_poison() &&
+            (!options.gc_release_after() ||
+                cell.idle() < options.gc_release_after()))
+    {
+        // We cannot poison the first word of the cell since that
+        // contains the next pointer.
+        memset(reinterpret_cast<uint8_t*>(cell.pointer()) +
+                WORDSIZE_BYTES,
+            Poison_Byte, (cell.size() - 1) * WORDSIZE_BYTES);
+    }
+    cell.check();
+#endif
+    add_free_cell(cell);
 }
 
 /****************************************************************************/
 
 CellPtrBOP
-Heap::ptr_to_bop_cell(void *ptr) const
+ChunkBOP::ptr_to_cell(void *ptr)
 {
-    if (m_chunk_bop->contains_pointer(ptr)) {
-        Block *block = m_chunk_bop->ptr_to_block(ptr);
-        if (block && block->is_in_use() && block->is_valid_address(ptr)) {
-            return CellPtrBOP(block, block->index_of(ptr), ptr);
-        } else {
+    Block *block = ptr_to_block(ptr);
+    if (block && block->is_in_use() && block->is_valid_address(ptr)) {
+        return CellPtrBOP(block, block->index_of(ptr), ptr);
+    } else {
+        return CellPtrBOP::Invalid();
+    }
+}
+
+CellPtrBOP
+ChunkBOP::ptr_to_cell_interior(void *ptr)
+{
+    Block *block = ptr_to_block(ptr);
+    if (block && block->is_in_use() && block->is_in_payload(ptr)) {
+        // Compute index then re-compute pointer to find the true
+        // beginning of the cell.
+        unsigned index = block->index_of(ptr);
+        if (index >= block->num_cells()) {
+            // The pointer is in the slack space at the end of the block.
             return CellPtrBOP::Invalid();
         }
+        ptr = block->index_to_pointer(index);
+        return CellPtrBOP(block, index, ptr);
+    } else {
+        return CellPtrBOP::Invalid();
+    }
+}
+
+CellPtrFit
+ChunkFit::ptr_to_cell(void *ptr)
+{
+    if (is_in_payload(ptr) &&
+            (reinterpret_cast<uintptr_t>(ptr) % WORDSIZE_BYTES) == 0 &&
+            m_header.cell_starts.test(word_index(ptr)))
+    {
+        return CellPtrFit(this, ptr);
+    } else {
+        return CellPtrFit::Invalid();
+    }
+}
+
+CellPtrFit
+ChunkFit::ptr_to_cell_interior(void *ptr)
+{
+    if (!is_in_payload(ptr)) return CellPtrFit::Invalid();
+
+    size_t index = m_header.cell_starts.find_prev(word_index(ptr));
+    if (index == CellStartMap::Not_Found) return CellPtrFit::Invalid();
+
+    // Pointers into the info of the next cell are treated as pointing
+    // into the end of this cell.
+    return CellPtrFit(this,
+            reinterpret_cast<uint8_t*>(this) + index * WORDSIZE_BYTES);
+}
+
+CellPtrBOP
+Heap::ptr_to_bop_cell(void *ptr) const
+{
+    Chunk *chunk = m_chunk_map->lookup(ptr);
+    if (chunk && chunk->type() == CT_BOP) {
+        return static_cast<ChunkBOP*>(chunk)->ptr_to_cell(ptr);
     } else {
         return CellPtrBOP::Invalid();
     }
@@ -284,17 +1082,9 @@ Heap::ptr_to_bop_cell(void *ptr) const
 CellPtrBOP
 Heap::ptr_to_bop_cell_interior(void *ptr) const
 {
-    if (m_chunk_bop->contains_pointer(ptr)) {
-        Block *block = m_chunk_bop->ptr_to_block(ptr);
-        if (block && block->is_in_use()) {
-            // Compute index then re-compute pointer to find the true
-            // beginning of the cell.
-            unsigned index = block->index_of(ptr);
-            ptr = block->index_to_pointer(index);
-            return CellPtrBOP(block, index, ptr);
-        } else {
-            return CellPtrBOP::Invalid();
-        }
+    Chunk *chunk = m_chunk_map->lookup(ptr);
+    if (chunk && chunk->type() == CT_BOP) {
+        return static_cast<ChunkBOP*>(chunk)->ptr_to_cell_interior(ptr);
     } else {
         return CellPtrBOP::Invalid();
     }
@@ -303,19 +1093,11 @@ Heap::ptr_to_bop_cell_interior(void *ptr) const
 CellPtrFit
 Heap::ptr_to_fit_cell(void *ptr) const
 {
-    if (m_chunk_fit->contains_pointer(ptr)) {
-        // TODO Speed up this search with a crossing-map.
-        for (CellPtrFit cell = m_chunk_fit->first_cell(); cell.is_valid();
-                cell = cell.next_in_chunk())
-        {
-            if (cell.pointer() == ptr) {
-                return cell;
-            } else if (cell.pointer() > ptr) {
-                // The pointer points into the middle of a cell.
-                return CellPtrFit::Invalid();
-            }
-        }
-        return CellPtrFit::Invalid();
+    Chunk *chunk = m_chunk_map->lookup(ptr);
+    if (chunk && chunk->type() == CT_FIT) {
+        ChunkFit *chunk_fit = static_cast<ChunkFit*>(chunk);
+        chunk_fit->ensure_swept(m_options);
+        return chunk_fit->ptr_to_cell(ptr);
     } else {
         return CellPtrFit::Invalid();
     }
@@ -324,30 +1106,38 @@ Heap::ptr_to_fit_cell(void *ptr) const
 CellPtrFit
 Heap::ptr_to_fit_cell_interior(void *ptr) const
 {
-    if (m_chunk_fit->contains_pointer(ptr)) {
-        // TODO Speed up this search with a crossing-map.
-        CellPtrFit prev = CellPtrFit::Invalid();
-        for (CellPtrFit cell = m_chunk_fit->first_cell(); cell.is_valid();
-                cell = cell.next_in_chunk())
-        {
-            if (cell.pointer() == ptr) {
-                return cell;
-            } else if (cell.pointer() > ptr) {
-                if (prev.is_valid()) {
-                    return prev;
-                } else {
-                    return CellPtrFit::Invalid();
-                }
-            }
-
-            prev = cell;
-        }
-        return CellPtrFit::Invalid();
+    Chunk *chunk = m_chunk_map->lookup(ptr);
+    if (chunk && chunk->type() == CT_FIT) {
+        ChunkFit *chunk_fit = static_cast<ChunkFit*>(chunk);
+        chunk_fit->ensure_swept(m_options);
+        return chunk_fit->ptr_to_cell_interior(ptr);
     } else {
         return CellPtrFit::Invalid();
     }
 }
 
+CellPtrLarge
+Heap::ptr_to_large_cell(void *ptr) const
+{
+    Chunk *chunk = m_chunk_map->lookup(ptr);
+    if (chunk && chunk->type() == CT_LARGE) {
+        return static_cast<ChunkLarge*>(chunk)->ptr_to_cell(ptr);
+    } else {
+        return CellPtrLarge::Invalid();
+    }
+}
+
+CellPtrLarge
+Heap::ptr_to_large_cell_interior(void *ptr) const
+{
+    Chunk *chunk = m_chunk_map->lookup(ptr);
+    if (chunk && chunk->type() == CT_LARGE) {
+        return static_cast<ChunkLarge*>(chunk)->ptr_to_cell_interior(ptr);
+    } else {
+        return CellPtrLarge::Invalid();
+    }
+}
+
 /***************************************************************************/
 
 void
@@ -365,26 +1155,54 @@ void
 HeapMarkState::mark_root(CellPtrFit &cell_fit)
 {
     assert(cell_fit.is_valid());
+    if (!cell_fit.is_allocated()) return;
 
-    if (cell_fit.is_allocated() && !cell_fit.is_marked()) {
+    // Roots are always conservative.
+    cell_fit.pin();
+    if (!cell_fit.is_marked()) {
         num_marked += heap->mark(cell_fit);
         num_roots_marked++;
     }
 }
 
 void
-HeapMarkState::mark_root(void *heap_ptr)
+HeapMarkState::mark_root(CellPtrLarge &cell_large)
 {
-    CellPtrBOP cell_bop = heap->ptr_to_bop_cell(heap_ptr);
-    if (cell_bop.is_valid()) {
-        mark_root(cell_bop);
-        return;
+    assert(cell_large.is_valid());
+
+    if (!cell_large.is_marked()) {
+        num_marked += heap->mark(cell_large);
+        num_roots_marked++;
     }
+}
 
-    CellPtrFit cell_fit = heap->ptr_to_fit_cell(heap_ptr);
-    if (cell_fit.is_valid()) {
-        mark_root(cell_fit);
-        return;
+void
+HeapMarkState::mark_root(void *heap_ptr)
+{
+    Chunk *chunk = heap->m_chunk_map->lookup(heap_ptr);
+    if (!chunk) return;
+
+    switch (chunk->type()) {
+        case CT_BOP: {
+            CellPtrBOP cell =
+                static_cast<ChunkBOP*>(chunk)->ptr_to_cell(heap_ptr);
+            if (cell.is_valid()) mark_root(cell);
+            break;
+        }
+        case CT_FIT: {
+            CellPtrFit cell =
+                static_cast<ChunkFit*>(chunk)->ptr_to_cell(heap_ptr);
+            if (cell.is_valid()) mark_root(cell);
+            break;
+        }
+        case CT_LARGE: {
+            CellPtrLarge cell =
+                static_cast<ChunkLarge*>(chunk)->ptr_to_cell(heap_ptr);
+            if (cell.is_valid()) mark_root(cell);
+            break;
+        }
+        default:
+            break;
     }
 }
 
@@ -395,40 +1213,65 @@ HeapMarkState::mark_root_interior(void *heap_ptr)
     // should have a different macro for this particular use. (issue #154)
     heap_ptr = REMOVE_TAG(heap_ptr);
 
-    CellPtrBOP cell_bop = heap->ptr_to_bop_cell_interior(heap_ptr);
-    if (cell_bop.is_valid()) {
-        mark_root(cell_bop);
-        return;
-    }
+    Chunk *chunk = heap->m_chunk_map->lookup(heap_ptr);
+    if (!chunk) return;
 
-    CellPtrFit cell_fit = heap->ptr_to_fit_cell_interior(heap_ptr);
-    if (cell_fit.is_valid()) {
-        mark_root(cell_fit);
-        return;
+    switch (chunk->type()) {
+        case CT_BOP: {
+            CellPtrBOP cell =
+                static_cast<ChunkBOP*>(chunk)->ptr_to_cell_interior(heap_ptr);
+            if (cell.is_valid()) mark_root(cell);
+            break;
+        }
+        case CT_FIT: {
+            CellPtrFit cell =
+                static_cast<ChunkFit*>(chunk)->ptr_to_cell_interior(heap_ptr);
+            if (cell.is_valid()) mark_root(cell);
+            break;
+        }
+        case CT_LARGE: {
+            CellPtrLarge cell = static_cast<ChunkLarge*>(chunk)->
+                ptr_to_cell_interior(heap_ptr);
+            if (cell.is_valid()) mark_root(cell);
+            break;
+        }
+        default:
+            break;
     }
 }
 
 void
 HeapMarkState::mark_root_conservative(void *root, size_t len_bytes)
 {
-    // Mark from the root objects.
+    const ChunkMap *chunk_map = heap->m_chunk_map;
+
+    // Mark from the root objects.  Most words on a stack are small
+    // integers or pointers outside the heap, so filter by the heap's
+    // address range before calling mark_root().
     for (void **p_cur = (void**)root;
          p_cur < (void**)((uint8_t*)root + len_bytes);
          p_cur++)
     {
-        mark_root(REMOVE_TAG(*p_cur));
+        void *ptr = REMOVE_TAG(*p_cur);
+        if (chunk_map->in_range(ptr)) {
+            mark_root(ptr);
+        }
     }
 }
 
 void
 HeapMarkState::mark_root_conservative_interior(void *root, size_t len_bytes)
 {
-    // Mark from the root objects.
+    const ChunkMap *chunk_map = heap->m_chunk_map;
+
+    // Mark from the root objects, filtering as above.
     for (void **p_cur = (void**)root;
          p_cur < (void**)((uint8_t*)root + len_bytes);
          p_cur++)
     {
-        mark_root_interior(*p_cur);
+        if (chunk_map->in_range(REMOVE_TAG(*p_cur))) {
+            mark_root_interior(*p_cur);
+        }
     }
 }
 
@@ -0,0 +1,258 @@
+/*
+ * Plasma garbage collector - compaction
+ * vim: ts=4 sw=4 et
+ *
+ * Copyright (C) 2019 Plasma Team
+ * Distributed under the terms of the MIT license, see ../LICENSE.code
+ */
+
+#include "pz_common.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "pz_util.h"
+
+#include "pz_gc.h"
+#include "pz_gc_util.h"
+
+#include "pz_gc.impl.h"
+#include "pz_gc_layout.h"
+#include "pz_gc_layout.impl.h"
+
+namespace pz {
+
+/*
+ * Only fit cells move.  Every field is scanned conservatively except the
+ * pointer map fields of precise cells and the meta information of fit and
+ * large cells, so marking pins any fit cell that is reached another way.
+ * The remaining marked cells are referenced only by those precise fields,
+ * which are rewritten before the cells move.
+ */
+
+struct FitCompaction {
+    ChunkFit                           *chunk;
+    std::vector<ChunkFit::Placement>    placements;
+};
+
+static bool
+placement_before(const ChunkFit::Placement &placement, void *ptr)
+{
+    return placement.from < ptr;
+}
+
+void
+Heap::compact()
+{
+    std::vector<FitCompaction> compactions;
+
+    for (ChunkFit *chunk : m_chunks_fit) {
+        if (chunk->marked_bytes() >
+                size_t(ChunkFit::Payload_Bytes * GC_Compact_Occupancy))
+        {
+            continue;
+        }
+
+        FitCompaction compaction;
+        compaction.chunk = chunk;
+        if (chunk->plan_compact(compaction.placements)) {
+            compactions.push_back(std::move(compaction));
+        }
+    }
+    if (compactions.empty()) return;
+
+    // Point a precise field at its cell's new location.
+    auto forward = [&](void **field) {
+        uintptr_t tag = reinterpret_cast<uintptr_t>(*field) &
+            (WORDSIZE_BYTES - 1);
+        void *ptr = reinterpret_cast<uint8_t*>(*field) - tag;
+
+        Chunk *chunk = m_chunk_map->lookup(ptr);
+        if (!chunk || chunk->type() != CT_FIT) return;
+
+        for (FitCompaction &compaction : compactions) {
+            if (compaction.chunk != chunk) continue;
+
+            auto &placements = compaction.placements;
+            auto i = std::lower_bound(placements.begin(), placements.end(),
+                    ptr, placement_before);
+            if (i != placements.end() && i->from == ptr) {
+                *field = reinterpret_cast<uint8_t*>(i->to) + tag;
+            }
+            return;
+        }
+    };
+
+    for (ChunkBOP *chunk : m_chunks_bop) {
+        for (unsigned i = 0; i < chunk->num_blocks(); i++) {
+            Block *block = chunk->block(i);
+            if (!block->is_in_use()) continue;
+
+            for (unsigned j = 0; j < block->num_cells(); j++) {
+                CellPtrBOP cell(block, j);
+                if (!cell.is_marked() || !cell.is_precise()) continue;
+
+                PtrMap ptr_map = cell_ptr_map(cell);
+                while (ptr_map) {
+                    forward(&cell.pointer()[__builtin_ctzl(ptr_map)]);
+                    ptr_map &= ptr_map - 1;
+                }
+            }
+        }
+    }
+    for (ChunkFit *chunk : m_chunks_fit) {
+        for (CellPtrFit cell = chunk->first_cell(); cell.is_valid();
+                cell = cell.next_in_chunk())
+        {
+            if (cell.is_marked() && cell.has_meta()) {
+                forward(cell.meta());
+            }
+        }
+    }
+    for (ChunkLarge *chunk : m_chunks_large) {
+        CellPtrLarge cell = chunk->cell();
+        if (cell.is_marked()) {
+            forward(cell.meta());
+        }
+    }
+
+    for (FitCompaction &compaction : compactions) {
+        compaction.chunk->compact(compaction.placements);
+    }
+
+#ifdef PZ_DEV
+    if (m_options.gc_trace()) {
+        unsigned num_moved = 0;
+        for (FitCompaction &compaction : compactions) {
+            for (ChunkFit::Placement &placement : compaction.placements) {
+                if (placement.from != placement.to) num_moved++;
+            }
+        }
+        fprintf(stderr, "Compacted %ld fit chunks, moving %u cells\n",
+                compactions.size(), num_moved);
+    }
+#endif
+}
+
+/***************************************************************************/
+
+bool
+ChunkFit::plan_compact(std::vector<Placement> &placements)
+{
+    const size_t min_cell_bytes = CellPtrFit::CellInfoOffset +
+        WORDSIZE_BYTES;
+    bool moves = false;
+
+    // Where the header of the next cell would go.
+    uint8_t *dest = reinterpret_cast<uint8_t*>(m_bytes);
+
+    // A free cell will be made between dest and limit, if that space is
+    // too small for one then the last cell that moved grows to fill it.
+    // That cell exists because otherwise the space is made of whole cells.
+    auto fill_gap = [&](uint8_t *limit) {
+        size_t gap = limit - dest;
+        if (gap > 0 && gap < min_cell_bytes) {
+            assert(!placements.empty() &&
+                    placements.back().from != placements.back().to);
+            placements.back().size += gap / WORDSIZE_BYTES;
+        }
+    };
+
+    for (CellPtrFit cell = first_cell(); cell.is_valid();
+            cell = cell.next_in_chunk())
+    {
+        if (!cell.is_marked()) continue;
+
+        uint8_t *header = reinterpret_cast<uint8_t*>(cell.pointer()) -
+            CellPtrFit::CellInfoOffset;
+        Placement placement;
+        placement.from = cell.pointer();
+        placement.size = cell.size();
+        if (!cell.is_pinned() && header > dest) {
+            placement.to = dest + CellPtrFit::CellInfoOffset;
+            moves = true;
+        } else {
+            fill_gap(header);
+            placement.to = cell.pointer();
+        }
+        placements.push_back(placement);
+        dest = reinterpret_cast<uint8_t*>(placement.to) +
+            placement.size * WORDSIZE_BYTES;
+    }
+    fill_gap(reinterpret_cast<uint8_t*>(&m_bytes[Payload_Bytes]));
+
+    return moves;
+}
+
+void
+ChunkFit::compact(const std::vector<Placement> &placements)
+{
+    // Forget the old layout, every cell start is set again below.
+    for (CellPtrFit cell = first_cell(); cell.is_valid();
+            cell = cell.next_in_chunk())
+    {
+        clear_cell_start(cell);
+    }
+
+    /*
+     * Cells only move down, and in address order, so a cell never
+     * overwrites one that hasn't moved yet.  The free cells are made in
+     * space that every cell has already left.
+     */
+    uint8_t *dest = reinterpret_cast<uint8_t*>(m_bytes);
+    for (const Placement &placement : placements) {
+        uint8_t *header = reinterpret_cast<uint8_t*>(placement.to) -
+            CellPtrFit::CellInfoOffset;
+        if (header > dest) {
+            make_free_cell(dest, header);
+        }
+
+        CellPtrFit cell(this, placement.from);
+        if (placement.to != placement.from) {
+            cell = cell.move_to(placement.to, placement.size);
+        }
+        set_cell_start(cell);
+        dest = reinterpret_cast<uint8_t*>(placement.to) +
+            placement.size * WORDSIZE_BYTES;
+    }
+    if (dest < reinterpret_cast<uint8_t*>(&m_bytes[Payload_Bytes])) {
+        make_free_cell(dest, &m_bytes[Payload_Bytes]);
+    }
+}
+
+void
+ChunkFit::make_free_cell(void *start, void *end)
+{
+    CellPtrFit cell(this,
+            reinterpret_cast<uint8_t*>(start) + CellPtrFit::CellInfoOffset);
+    cell.init((reinterpret_cast<uint8_t*>(end) -
+                reinterpret_cast<uint8_t*>(cell.pointer())) / WORDSIZE_BYTES);
+    set_cell_start(cell);
+}
+
+CellPtrFit
+CellPtrFit::move_to(void *ptr, size_t new_size)
+{
+    size_t old_size = size();
+    assert(ptr < pointer());
+    assert(new_size >= old_size);
+
+    memmove(reinterpret_cast<uint8_t*>(ptr) - CellInfoOffset, info_ptr(),
+            CellInfoOffset + old_size * WORDSIZE_BYTES);
+
+    CellPtrFit cell(m_chunk, ptr);
+    cell.set_size(new_size);
+    // Clear any space it grew into so that it holds no stale pointers.
+    memset(cell.pointer() + old_size, 0,
+            (new_size - old_size) * WORDSIZE_BYTES);
+    // The meta information stays in the last word.
+    if (cell.has_meta() && new_size > old_size) {
+        *cell.meta() = cell.pointer()[old_size - 1];
+        cell.pointer()[old_size - 1] = nullptr;
+    }
+    return cell;
+}
+
+} // namespace pz
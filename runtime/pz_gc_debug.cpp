@@ -8,10 +8,12 @@
 
 #include "pz_common.h"
 
+#include <stddef.h>
 #include <stdio.h>
 
 #include "pz_gc.h"
 #include "pz_gc.impl.h"
+#include "pz_gc_immortal.h"
 #include "pz_gc_layout.h"
 #include "pz_gc_layout.impl.h"
 
@@ -21,24 +23,56 @@ void
 Heap::check_heap() const
 {
     assert(s_page_size != 0);
-    assert(m_chunk_bop != NULL);
+    assert(m_chunk_map != nullptr);
+    assert(!m_chunks_bop.empty());
+    assert(!m_chunks_fit.empty());
 
-    m_chunk_bop->check();
-    m_chunk_fit->check();
+    for (ChunkBOP *chunk : m_chunks_bop) {
+        assert(m_chunk_map->lookup(chunk) == chunk);
+        chunk->check(m_options);
+    }
+    m_block_index->check();
+    for (ChunkLarge *chunk : m_chunks_large) {
+        assert(m_chunk_map->lookup(chunk) == chunk);
+        assert(m_chunk_map->lookup(reinterpret_cast<uint8_t*>(chunk) +
+                    chunk->mapped_bytes() - 1) == chunk);
+        // Old cells stay marked between collections if generational.
+        assert(m_options.gc_generational() || !chunk->cell().is_marked());
+    }
+    for (ChunkFit *chunk : m_chunks_fit) {
+        assert(m_chunk_map->lookup(chunk) == chunk);
+        chunk->check();
+    }
 }
 
 void
-ChunkBOP::check()
+ChunkBOP::check(const Options &options)
 {
-    assert(m_wilderness < GC_Block_Per_Chunk);
+    assert(m_wilderness <= GC_Block_Per_Chunk);
 
     for (unsigned i = 0; i < m_wilderness; i++) {
-        m_blocks[i].check();
+        m_blocks[i].check(options);
+
+        bool is_free = m_free_blocks[i / WORDSIZE_BITS] &
+            (uintptr_t(1) << (i % WORDSIZE_BITS));
+        assert(is_free == !m_blocks[i].is_in_use());
     }
 }
 
 void
-Block::check()
+BlockIndex::check() const
+{
+    for (unsigned i = 0; i < GC_Num_Size_Classes; i++) {
+        for (Block *block = m_lists[i]; block; block = block->next_block()) {
+            assert(block->is_in_use());
+            assert(size_class_of(block->size()) == i);
+            assert(block->needs_sweep() || !block->is_full());
+        }
+    }
+}
+
+void
+Block::check(const Options &options)
 {
     if (!is_in_use()) return;
 
@@ -47,93 +81,115 @@ Block::check()
     assert(num_cells() <= GC_Cells_Per_Block);
 
     unsigned num_free_ = 0;
+    unsigned num_marked_ = 0;
     for (unsigned i = 0; i < num_cells(); i++) {
         CellPtrBOP cell(this, i);
 
-        if (!cell.is_allocated()) {
-            assert(!cell.is_marked());
-
-            // This is quadratic and should be replaced with an extra bit in the
-            // cell header and using that to pass over the cells and the
-            // free list once each.
-            // https://github.com/PlasmaLang/plasma/issues/202
-            assert(is_in_free_list(cell));
-
-            num_free_++;
-        } else {
-            assert(!is_in_free_list(cell));
+        // Only blocks waiting to be swept may have marked cells, unless
+        // they're old cells.
+        if (cell.is_marked()) {
+            assert(needs_sweep() || options.gc_generational());
+            assert(cell.is_allocated());
+            num_marked_++;
         }
-    }
 
-    assert(num_free() == num_free_);
-    assert(num_cells() == num_free_ + num_allocated());
-}
-
-bool
-Block::is_in_free_list(CellPtrBOP &search)
-{
-    int cur = m_header.free_list;
-
-    while (cur != Header::Empty_Free_List) {
-        assert(cur >= 0);
-        CellPtrBOP cell(this, unsigned(cur));
-        if (search.index() == cell.index()) {
-            return true;
+        if (!cell.is_allocated()) {
+            assert(!cell.is_precise());
+            num_free_++;
         }
-        cur = cell.next_in_list();
+        // Only old cells are remembered, a full collection may have
+        // cleared their marks since.
+        assert(!cell.is_remembered() || cell.is_allocated() ||
+                needs_sweep());
     }
 
-    return false;
-}
-
-unsigned
-Block::num_free()
-{
-    int cur = m_header.free_list;
-    unsigned num = 0;
-
-    while (cur != Header::Empty_Free_List) {
-        num++;
-        assert(cur >= 0);
-        CellPtrBOP cell(this, unsigned(cur));
-        cur = cell.next_in_list();
+    for (unsigned i = num_cells(); i < Bitmap_Words * WORDSIZE_BITS; i++) {
+        assert(!(m_header.alloc_bits[bit_word(i)] & bit_mask(i)));
+        assert(!(m_header.mark_bits[bit_word(i)] & bit_mask(i)));
+        assert(!(m_header.precise_bits[bit_word(i)] & bit_mask(i)));
+        assert(!(m_header.remembered_bits[bit_word(i)] & bit_mask(i)));
     }
 
-    return num;
+    assert(m_header.num_free == num_free_);
+    assert(num_marked() == num_marked_);
 }
 
 void
 ChunkFit::check()
 {
-    // Check the free list.
-    bool free_list_valid = m_header.free_list.is_valid();
-    if (free_list_valid) {
-
-        // Right now the free list isn't really a list.
-        assert(!m_header.free_list.next_in_list().is_valid());
+    assert(!m_header.sweep_state.needs_sweep());
+
+    // Check the free lists.
+    size_t num_free_listed = 0;
+    for (unsigned i = 0; i < Num_Free_Lists; i++) {
+        bool nonempty = m_header.free_lists_nonempty & (uintptr_t(1) << i);
+        assert(nonempty == (m_header.free_lists[i] != nullptr));
+
+        void *cur = m_header.free_lists[i];
+        while (cur) {
+            CellPtrFit cell(this, cur);
+            assert(!cell.is_allocated());
+            assert(free_list_of(cell.size()) == i);
+            num_free_listed++;
+            cur = *cell.pointer();
+        }
     }
 
     CellPtrFit cell = first_cell();
+    size_t num_cells = 0;
+    size_t num_free = 0;
+    bool prev_free = false;
     while (cell.is_valid()) {
         assert(contains_pointer(cell.pointer()));
         cell.check();
         if (!cell.is_allocated()) {
-            assert(free_list_valid);
+            // Free cells are always merged with their neighbours.
+            assert(!prev_free);
+            num_free++;
         }
+        prev_free = !cell.is_allocated();
+        assert(m_header.cell_starts.test(word_index(cell.pointer())));
+        num_cells++;
 
         cell = cell.next_in_chunk();
     }
+    assert(num_free == num_free_listed);
+
+    // Check that there are no extra cell starts.
+    size_t num_starts = 0;
+    size_t index = word_index(&m_bytes[Payload_Bytes - 1]);
+    while (true) {
+        index = m_header.cell_starts.find_prev(index);
+        if (index == CellStartMap::Not_Found) break;
+        num_starts++;
+        if (index == 0) break;
+        index--;
+    }
+    assert(num_starts == num_cells);
 }
 
 void
 CellPtrFit::check()
 {
-    assert(size() < ChunkFit::Payload_Bytes);
+    assert(size() <= ChunkFit::Max_Cell_Size);
 
-    switch (info_ptr()->state) {
+    switch (state()) {
         case CS_FREE:
+            if (has_meta() || is_pinned() || is_remembered()) {
+                fprintf(stderr, "Free cell has flags set\n");
+                abort();
+            }
+            break;
         case CS_ALLOCATED:
         case CS_MARKED:
+            if (idle()) {
+                fprintf(stderr, "Allocated cell is idle\n");
+                abort();
+            }
+            if (has_meta() && size() < 2) {
+                fprintf(stderr, "Cell too small for meta information\n");
+                abort();
+            }
             break;
         default:
             fprintf(stderr, "Invalid cell state\n");
@@ -148,8 +204,18 @@ Heap::print_usage_stats(size_t initial_usage) const
 {
     printf("\nHeap usage report\n=================\n");
     printf("Usage: %ldKB -> %ldKB\n", initial_usage/1024, usage()/1024);
-    m_chunk_bop->print_usage_stats();
-    m_chunk_fit->print_usage_stats();
+    printf("Immortal: %ldKB\n", m_immortal->size_bytes()/1024);
+    for (ChunkBOP *chunk : m_chunks_bop) {
+        chunk->print_usage_stats();
+    }
+    for (ChunkFit *chunk : m_chunks_fit) {
+        chunk->print_usage_stats();
+    }
+    printf("\nLarge objects\n-------------\n");
+    for (ChunkLarge *chunk : m_chunks_large) {
+        printf("Large object %ld words, %ldKB mapped\n",
+                chunk->size(), chunk->mapped_bytes() / 1024);
+    }
     printf("\n");
 }
 
@@ -172,12 +238,14 @@ Block::print_usage_stats() const
         unsigned cells_used = 0;
         for (unsigned i = 0; i < num_cells(); i++) {
             CellPtrBOP cell(const_cast<Block*>(this), i);
-            if (cell.is_allocated()) {
+            // The unmarked cells in an unswept block are free.
+            if (needs_sweep() ? cell.is_marked() : cell.is_allocated()) {
                 cells_used++;
             }
         }
-        printf("Block for %ld-word objects: %d/%d cells\n",
-            size(), cells_used, num_cells());
+        printf("Block for %ld-word objects: %d/%d cells%s\n",
+            size(), cells_used, num_cells(),
+            needs_sweep() ? " (not yet swept)" : "");
     } else {
         printf("Block out of use\n");
     }
@@ -238,9 +306,10 @@ Heap::print_addr_info(void *addr) const
         fprintf(stderr, "Debug: Cell is index %d in block %p, for size %ld\n",
                 cell_bop.index(), cell_bop.block(), cell_bop.block()->size());
         fprintf(stderr,
-                "Debug: Allocated: %s, Marked: %s\n",
+                "Debug: Allocated: %s, Marked: %s, Precise: %s\n",
                 bool_string(cell_bop.is_allocated()),
-                bool_string(cell_bop.is_marked()));
+                bool_string(cell_bop.is_marked()),
+                bool_string(cell_bop.is_precise()));
         return;
     }
 
@@ -263,12 +332,27 @@ Heap::print_addr_info(void *addr) const
                 cell_fit.size(),
                 bool_string(cell_fit.is_allocated()),
                 bool_string(cell_fit.is_marked()));
-        if (*cell_fit.meta()) {
+        if (cell_fit.has_meta() && *cell_fit.meta()) {
             fprintf(stderr, "Debug: Has meta info at %p\n", *cell_fit.meta());
         }
         return;
     }
 
+    CellPtrLarge cell_large = ptr_to_large_cell_interior(addr);
+    if (cell_large.is_valid()) {
+        ptrdiff_t diff = (uint8_t*)addr - (uint8_t*)cell_large.pointer();
+        fprintf(stderr,
+                "Debug: %p is 0x%lx bytes into a large cell at %p\n",
+                addr, diff, cell_large.pointer());
+        fprintf(stderr, "Debug: Size %ld, Marked: %s\n",
+                cell_large.size(), bool_string(cell_large.is_marked()));
+        if (*cell_large.meta()) {
+            fprintf(stderr, "Debug: Has meta info at %p\n",
+                    *cell_large.meta());
+        }
+        return;
+    }
+
     fprintf(stderr, "Debug: %p is not a current GC cell\n", addr);
 }
 
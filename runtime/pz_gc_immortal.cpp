@@ -0,0 +1,166 @@
+/*
+ * Plasma garbage collector - immortal region
+ * vim: ts=4 sw=4 et
+ *
+ * Copyright (C) 2019 Plasma Team
+ * Distributed under the terms of the MIT license, see ../LICENSE.code
+ */
+
+#include "pz_common.h"
+
+#include <stdio.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+
+#include "pz_util.h"
+
+#include "pz_gc.h"
+#include "pz_gc_immortal.h"
+#include "pz_gc_layout.h"
+#include "pz_gc_layout.impl.h"
+
+namespace pz {
+
+ImmortalRegion::ImmortalRegion() :
+        m_low(nullptr),
+        m_high(nullptr),
+        m_current(nullptr),
+        m_dirty(false),
+        m_size_bytes(0) { }
+
+ImmortalRegion::~ImmortalRegion()
+{
+    for (Block *block : m_blocks) {
+        if (-1 == munmap(block->start, block->end - block->start)) {
+            perror("munmap");
+        }
+        delete block;
+    }
+}
+
+ImmortalRegion::Block *
+ImmortalRegion::new_block(size_t size_bytes)
+{
+    size_bytes = AlignUp(size_bytes, Block_Size);
+    void *mem = mmap(NULL, size_bytes, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == mem) {
+        perror("mmap");
+        return nullptr;
+    }
+
+    Block *block = new Block();
+    block->start = static_cast<uint8_t*>(mem);
+    block->top = block->start;
+    block->end = block->start + size_bytes;
+    block->dirty = false;
+    if (m_blocks.empty() || block->start < m_low) {
+        m_low = block->start;
+    }
+    if (m_blocks.empty() || block->end > m_high) {
+        m_high = block->end;
+    }
+    m_blocks.push_back(block);
+    return block;
+}
+
+void *
+ImmortalRegion::alloc(size_t size_in_words)
+{
+    size_t size_bytes = (size_in_words + 1) * WORDSIZE_BYTES;
+
+    Block *block = m_current;
+    if (!block || block->top + size_bytes > block->end) {
+        block = new_block(size_bytes);
+        if (!block) return nullptr;
+
+        // Keep bumping the current block unless the new one has more room
+        // left.
+        if (!m_current || block->end - (block->start + size_bytes) >
+                m_current->end - m_current->top)
+        {
+            m_current = block;
+        }
+    }
+
+    void *obj = block->top + WORDSIZE_BYTES;
+    block->top += size_bytes;
+    block->objects.push_back(obj);
+    block->dirty = true;
+    m_dirty = true;
+    m_size_bytes += size_bytes;
+
+    return obj;
+}
+
+ImmortalRegion::Block *
+ImmortalRegion::find_block(const void *ptr) const
+{
+    const uint8_t *ptr_ = static_cast<const uint8_t*>(ptr);
+    for (Block *block : m_blocks) {
+        if (ptr_ >= block->start && ptr_ < block->top) return block;
+    }
+    return nullptr;
+}
+
+void *
+ImmortalRegion::interior_ptr_to_ptr(const void *ptr) const
+{
+    Block *block = find_block(ptr);
+    if (!block) return nullptr;
+
+    // The last object starting at or before ptr, unless ptr is in the meta
+    // information of the object after it.
+    auto next = std::upper_bound(block->objects.begin(),
+            block->objects.end(), ptr);
+    if (next == block->objects.begin()) return nullptr;
+    if (next != block->objects.end() && meta(*next) <= ptr) return nullptr;
+    return *(next - 1);
+}
+
+void
+ImmortalRegion::write_barrier(const void *ptr)
+{
+    if (!may_contain(ptr)) return;
+
+    Block *block = find_block(ptr);
+    if (block) {
+        block->dirty = true;
+        m_dirty = true;
+    }
+}
+
+void
+ImmortalRegion::scan_block(Block *block, const ChunkMap &chunk_map)
+{
+    block->slots.clear();
+    for (void **cur = reinterpret_cast<void**>(block->start);
+            cur < reinterpret_cast<void**>(block->top); cur++)
+    {
+        if (chunk_map.lookup(*cur)) {
+            block->slots.push_back(cur);
+        }
+    }
+    block->dirty = false;
+}
+
+const std::vector<void**> &
+ImmortalRegion::slots(const ChunkMap &chunk_map)
+{
+    if (m_dirty) {
+        m_slots.clear();
+        for (Block *block : m_blocks) {
+            if (block->dirty) {
+                scan_block(block, chunk_map);
+            }
+            m_slots.insert(m_slots.end(), block->slots.begin(),
+                    block->slots.end());
+        }
+        m_dirty = false;
+    }
+
+    return m_slots;
+}
+
+} // namespace pz
@@ -0,0 +1,124 @@
+/*
+ * Plasma garbage collector - immortal region
+ * vim: ts=4 sw=4 et
+ *
+ * Copyright (C) 2019 Plasma Team
+ * Distributed under the terms of the MIT license, see ../LICENSE.code
+ */
+
+#ifndef PZ_GC_IMMORTAL_H
+#define PZ_GC_IMMORTAL_H
+
+#include <vector>
+
+namespace pz {
+
+class ChunkMap;
+
+/*
+ * The immortal region holds the objects that live until the program
+ * exits, such as the code, data and closures of modules loaded at startup.
+ * It's a bump allocator over blocks mapped from the OS that are never
+ * swept, and the collector never marks or scans its objects.  Each object
+ * is preceded by a word of meta information.
+ *
+ * Instead the region tracks the pointers it holds into the collected heap,
+ * and the collector marks those as roots.  A block is scanned for them
+ * again, before the next collection, after it is allocated from or an
+ * object in it is passed to write_barrier().  Once loading is finished
+ * stores into the region are rare, so its pointers are found once and
+ * each collection only marks them.
+ *
+ * The blocks are scanned conservatively, every word that points into a
+ * chunk is a slot.  The loader fills in code and data through raw
+ * pointers rather than with struct layouts, and a block is only scanned
+ * after it changes, so slots that are exact would save little.  An
+ * integer in module data that looks like a pointer retains a cell, as it
+ * would in any other conservatively scanned object.
+ */
+class ImmortalRegion {
+  public:
+    static const size_t Block_Size = 256*1024;
+
+  private:
+    struct Block {
+        uint8_t                *start;
+        uint8_t                *top;
+        uint8_t                *end;
+
+        // The objects in the block, in address order.
+        std::vector<void*>      objects;
+
+        // The words that pointed into the collected heap when the block
+        // was last scanned, and whether it may have changed since.
+        std::vector<void**>     slots;
+        bool                    dirty;
+    };
+
+    std::vector<Block*>     m_blocks;
+    // Every block is between these addresses.
+    uint8_t                *m_low;
+    uint8_t                *m_high;
+    // The block allocations are bumped from, objects too large for it
+    // get their own block.
+    Block                  *m_current;
+
+    // The slots of all the blocks, and whether any block is dirty.
+    std::vector<void**>     m_slots;
+    bool                    m_dirty;
+
+    size_t                  m_size_bytes;
+
+    Block * new_block(size_t size_bytes);
+    Block * find_block(const void *ptr) const;
+    static void scan_block(Block *block, const ChunkMap &chunk_map);
+
+  public:
+    ImmortalRegion();
+    ~ImmortalRegion();
+
+    ImmortalRegion(const ImmortalRegion&) = delete;
+    void operator=(const ImmortalRegion&) = delete;
+
+    /*
+     * Returns nullptr if a block can't be mapped.  The memory is zeroed.
+     */
+    void * alloc(size_t size_in_words);
+
+    bool contains(const void *ptr) const { return find_block(ptr); }
+
+    /*
+     * A quick test that's true for every pointer into the region, and
+     * for some others.
+     */
+    bool may_contain(const void *ptr) const {
+        return ptr >= m_low && ptr < m_high;
+    }
+
+    void * interior_ptr_to_ptr(const void *ptr) const;
+
+    static void ** meta(void *obj) {
+        return reinterpret_cast<void**>(obj) - 1;
+    }
+
+    /*
+     * A pointer was stored into the object at ptr (or an interior
+     * pointer), if it's in the region then its block is scanned again.
+     * Every store into the region must call this, AllocBuffer's and
+     * GCCapability's write barriers do.
+     */
+    void write_barrier(const void *ptr);
+
+    /*
+     * Scan the dirty blocks and return the words of the region that point
+     * into the chunks in this map.
+     */
+    const std::vector<void**> & slots(const ChunkMap &chunk_map);
+
+    // The bytes allocated, including meta information.
+    size_t size_bytes() const { return m_size_bytes; }
+};
+
+} // namespace pz
+
+#endif // ! PZ_GC_IMMORTAL_H
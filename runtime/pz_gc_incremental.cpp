@@ -0,0 +1,240 @@
+/*
+ * Plasma garbage collector - incremental marking
+ * vim: ts=4 sw=4 et
+ *
+ * Copyright (C) 2019 Plasma Team
+ * Distributed under the terms of the MIT license, see ../LICENSE.code
+ */
+
+#include "pz_common.h"
+
+#include <stdio.h>
+
+#include <algorithm>
+
+#include "pz_util.h"
+
+#include "pz_gc.h"
+#include "pz_gc_util.h"
+
+#include "pz_gc.impl.h"
+#include "pz_gc_layout.h"
+#include "pz_gc_layout.impl.h"
+#include "pz_gc_mark.h"
+#include "pz_gc_stats.h"
+#include "pz_gc_sweep.h"
+
+namespace pz {
+
+/*
+ * With a gc_max_pause a collection marks in slices between allocations,
+ * rather than all at once:
+ *
+ *  + When the threshold is reached start_marking() finishes sweeping and
+ *    pushes the roots onto the mark stack.
+ *  + Every so many bytes of allocation mark_slice() scans fields from the
+ *    mark stack until gc_max_pause has passed.  The slices are paced so
+ *    that marking all of the current usage at the last collection's mark
+ *    rate would take half of the headroom up to m_mark_limit.
+ *  + Once the mark stack is empty collect() finishes the collection.  It
+ *    scans the roots again, since the stacks aren't covered by the write
+ *    barrier, and the cells remembered since the last slice, then sweeps
+ *    as usual.
+ *
+ * Meanwhile the mutator may store a pointer to an unmarked cell into a
+ * cell whose fields have already been scanned.  The write barrier
+ * remembers the marked cells stored into while marking, once each, and
+ * the next slice scans their fields again.  Unmarked cells are scanned
+ * when marking reaches them, after the store.  New cells are
+ * allocated marked, they're reachable or about to be, so they never need
+ * scanning, only the stores into them do.  That includes initialising
+ * stores of pointers to older cells, which must also use the write
+ * barrier.
+ *
+ * Compacting moves cells that are only referenced precisely, which it
+ * can't know for cells that were never scanned, so incremental
+ * collections don't compact.
+ */
+
+void
+Heap::start_marking(const AbstractGCTracer *thread_tracer)
+{
+    HeapMarkState state(this);
+
+    for (AllocBuffer *buffer : m_alloc_buffers) {
+        buffer->reset();
+    }
+
+    if (is_empty()) return;
+
+    double start = now();
+
+    if (m_sweeper) {
+        m_sweeper->wait();
+    }
+    for (ChunkBOP *chunk : m_chunks_bop) {
+        chunk->finish_sweep(m_options);
+    }
+
+    if (m_options.gc_release_after()) {
+        release_free_memory();
+    }
+
+#ifdef PZ_DEV
+    if (m_options.gc_slow_asserts()) {
+        check_heap();
+    }
+    if (m_options.gc_trace()) {
+        fprintf(stderr, "Starting incremental marking\n");
+    }
+#endif
+
+    m_marking = true;
+    set_remember_stores(true);
+    m_mark_slices = 0;
+    m_mark_slices_seconds = 0.0;
+    m_mark_start_allocated = m_allocated;
+    m_mark_limit = size_t(std::max(m_threshold, m_usage) *
+            GC_Mark_Limit_Factor);
+    if (m_max_size) {
+        m_mark_limit = std::min(m_mark_limit, m_max_size);
+    }
+
+    m_slice_bytes = GC_Min_Mark_Slice_Bytes;
+    if (m_mark_rate > 0.0) {
+        double slice_seconds = m_options.gc_max_pause() / 1e6;
+        double num_slices = 2.0 * m_usage / (m_mark_rate * slice_seconds);
+        double headroom = m_mark_limit > m_usage ?
+            m_mark_limit - m_usage : 0;
+        m_slice_bytes = std::max(double(GC_Min_Mark_Slice_Bytes),
+                std::min(double(GC_Max_Mark_Slice_Bytes),
+                    headroom / num_slices));
+    }
+    m_next_slice = m_allocated + m_slice_bytes;
+
+    // Because m_marking is set the roots are only pushed onto the mark
+    // stack.
+    m_trace_global_roots.do_trace(&state);
+    mark_immortal(state);
+    assert(thread_tracer);
+    thread_tracer->do_trace(&state);
+
+    record_mark_slice(start);
+}
+
+bool
+Heap::mark_slice()
+{
+    double start = now();
+
+    for (void *obj : m_remembered) {
+        mark_remembered(obj);
+    }
+    for (AllocBuffer *buffer : m_alloc_buffers) {
+        for (void *obj : buffer->m_remembered) {
+            mark_remembered(obj);
+        }
+    }
+    clear_remembered();
+
+    // If there's nothing to mark then the collection can finish,
+    // otherwise it finishes at the next slice.  This keeps finishing,
+    // which takes its own pause, out of this one.
+    bool more = !m_mark_stack->is_empty();
+    if (more) {
+        drain_mark_stack(*m_mark_stack,
+                start + m_options.gc_max_pause() / 1e6);
+        record_mark_slice(start);
+    }
+
+    // A large allocation may have passed several slices, the next
+    // allocations catch up with them one slice at a time.
+    m_next_slice += m_slice_bytes;
+    return more;
+}
+
+void
+Heap::record_mark_slice(double start)
+{
+    double seconds = now() - start;
+
+    m_mark_slices++;
+    m_mark_slices_seconds += seconds;
+    m_stats->record_pause(seconds * 1e6);
+
+#ifdef PZ_DEV
+    if (m_options.gc_trace()) {
+        fprintf(stderr, "Mark slice %u took %.0fus\n", m_mark_slices,
+                seconds * 1e6);
+    }
+#endif
+}
+
+bool
+Heap::drain_mark_stack(MarkStack &stack, double deadline)
+{
+    void **fields;
+    size_t num_fields;
+
+    // Reading the clock costs about as much as scanning a few dozen
+    // fields, so check it every so often, and stop if the deadline would
+    // pass before the next check.  Large cells are scanned a part at a
+    // time so that they can't overrun it by much.
+    const size_t check_every = 1024;
+    size_t count = 0;
+    double last_check = now();
+
+    while (stack.pop(&fields, &num_fields)) {
+        if (MarkStack::is_ptr_map_entry(num_fields)) {
+            count++;
+        } else {
+            if (num_fields > check_every) {
+                stack.push(fields + check_every, num_fields - check_every);
+                num_fields = check_every;
+            }
+            count += num_fields;
+        }
+        scan_fields<false>(stack, fields, num_fields);
+
+        if (count >= check_every) {
+            double time = now();
+            if (2 * time - last_check >= deadline) {
+                return stack.is_empty();
+            }
+            last_check = time;
+            count = 0;
+        }
+    }
+
+    return true;
+}
+
+void
+Heap::unmark_unused_runs()
+{
+    for (AllocBuffer *buffer : m_alloc_buffers) {
+        for (unsigned i = 0; i < AllocBuffer::Num_Size_Classes; i++) {
+            for (const AllocBuffer::Run *run :
+                    {&buffer->m_runs[i], &buffer->m_precise_runs[i]})
+            {
+                for (void **cur = run->next; cur < run->end;
+                        cur += run->cell_size)
+                {
+                    CellPtrBOP cell = ptr_to_bop_cell(cur);
+                    assert(cell.is_valid());
+                    cell.unmark();
+                }
+            }
+        }
+    }
+}
+
+void
+Heap::set_remember_stores(bool remember)
+{
+    for (AllocBuffer *buffer : m_alloc_buffers) {
+        buffer->m_remember_stores = remember;
+    }
+}
+
+} // namespace pz
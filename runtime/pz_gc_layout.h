@@ -33,6 +33,7 @@ static const unsigned GC_Cells_Per_Block = GC_Block_Size /
  */
 static const unsigned GC_Chunk_Log = 23;
 static const size_t GC_Chunk_Size = 1 << (GC_Chunk_Log - 1);
+static const size_t GC_Chunk_Mask = ~(GC_Chunk_Size - 1);
 static const size_t GC_Block_Per_Chunk =
         (GC_Chunk_Size / GC_Block_Size) - 1;
 
@@ -44,13 +45,43 @@ static const size_t GC_Initial_Threshold = 64 * GC_Block_Size;
 #endif
 static const float GC_Threshold_Factor = 1.5f;
 
+// With a gc_cpu_target the heap may grow by between these factors
+// between collections.
+static const float GC_Min_Threshold_Factor = 1.25f;
+static const float GC_Max_Threshold_Factor = 4.0f;
+
+// When generational, a full collection is made once the heap has grown by
+// this factor since the last one.
+static const float GC_Full_Threshold_Factor = 2.0f;
+
+// With gc_compact, fit chunks whose live cells fill no more than this
+// fraction of the chunk are compacted.
+static const float GC_Compact_Occupancy = 0.75f;
+
+// With a gc_max_pause, marking takes a slice each time between these many
+// bytes are allocated, chosen so that it should finish well before the
+// heap grows beyond this factor of its size when marking started.  If it
+// doesn't it finishes in one pause.
+static const size_t GC_Min_Mark_Slice_Bytes = 16 * 1024;
+static const size_t GC_Max_Mark_Slice_Bytes = 1024 * 1024;
+static const float GC_Mark_Limit_Factor = 1.5f;
+
 // The threshold for small allocations in words.  Allocations of less than
 // this many words are small allocations.
 static const size_t GC_Small_Alloc_Threshold = 64;
 
+// Allocations of more than this many words (64KB on 64-bit systems) are
+// large allocations and get a chunk of their own.
+static const size_t GC_Large_Alloc_Threshold = 8192;
+
 static_assert(GC_Chunk_Size > GC_Block_Size,
         "Chunks must be larger than blocks");
 
+// Chunks are aligned to their size, so they're also aligned to huge pages.
+static const size_t GC_Huge_Page_Size = 2 * 1024 * 1024;
+static_assert(GC_Chunk_Size % GC_Huge_Page_Size == 0,
+        "Chunks must be made of whole huge pages");
+
 /*
  * The heap is made out of blocks and chunks.  A chunk contains multiple
  * blocks, which each contain multiple cells.
@@ -61,7 +92,8 @@ enum CellType {
     CT_INVALID,
 
     CT_BOP,
-    CT_FIT
+    CT_FIT,
+    CT_LARGE
 };
 
 /*
@@ -83,8 +115,67 @@ class CellPtr {
     bool is_valid() const { return m_ptr != nullptr; }
     bool is_bop_cell() const { return m_type == CT_BOP; }
     bool is_fit_cell() const { return m_type == CT_FIT; }
+    bool is_large_cell() const { return m_type == CT_LARGE; }
+};
+
+/*
+ * Blocks and chunks that have live cells are swept after marking, either
+ * by the allocator when it first needs them or by the background sweeper.
+ * Whoever claims the sweep does it, anyone else who needs it swept waits.
+ */
+class SweepState {
+  private:
+    enum State : uint8_t {
+        SS_SWEPT,
+        SS_NEEDS_SWEEP,
+        SS_SWEEPING
+    };
+
+    State m_state;
+
+  public:
+    // The allocator constructs blocks in place while the background
+    // sweeper may be trying to claim them, so even this store is atomic.
+    SweepState() {
+        __atomic_store_n(&m_state, SS_SWEPT, __ATOMIC_RELAXED);
+    }
+
+    bool needs_sweep() const {
+        return __atomic_load_n(&m_state, __ATOMIC_ACQUIRE) != SS_SWEPT;
+    }
+
+    // Only the collector may call this, the world is stopped.
+    void set_needs_sweep() { m_state = SS_NEEDS_SWEEP; }
+
+    // Returns true if the caller should do the sweep.
+    bool claim() {
+        State expected = SS_NEEDS_SWEEP;
+        return __atomic_compare_exchange_n(&m_state, &expected,
+                SS_SWEEPING, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+    }
+
+    void set_swept() {
+        __atomic_store_n(&m_state, SS_SWEPT, __ATOMIC_RELEASE);
+    }
+
+    // Wait for another thread to finish the sweep.
+    void wait() const;
+};
+
+/*
+ * The pages a chunk is mapped with.
+ */
+enum PageBacking : uint8_t {
+    PB_NORMAL,
+    // Transparent huge pages were requested with madvise(), the kernel
+    // uses them where it can.
+    PB_TRANSPARENT_HUGE,
+    // Huge pages reserved with MAP_HUGETLB.
+    PB_HUGETLB
 };
 
+const char * page_backing_name(PageBacking backing);
+
 /*
  * Chunks
  */
@@ -93,17 +184,40 @@ class Chunk {
     Chunk(const Chunk&) = delete;
     void operator=(const Chunk&) = delete;
 
-    Chunk() : m_type(CT_INVALID) { }
+    Chunk() : m_type(CT_INVALID), m_backing(PB_NORMAL) { }
 
   protected:
-    // Currently unused, so make it protected to avoid a compiler warning.
-    CellType m_type;
-    Chunk(CellType type) : m_type(type) { }
+    CellType    m_type;
+    PageBacking m_backing;
+    Chunk(CellType type) : m_type(type), m_backing(PB_NORMAL) { }
 
   public:
-    static Chunk* new_chunk();
+    /*
+     * Map a new chunk from the OS, it will be aligned to GC_Chunk_Size so
+     * that ChunkMap can find it from any address within it.  If huge_pages
+     * then try MAP_HUGETLB, then transparent huge pages, then normal pages.
+     */
+    static Chunk* new_chunk(bool huge_pages);
     bool destroy();
 
+    /*
+     * Map memory aligned to GC_Chunk_Size, size_bytes must be a multiple
+     * of the page size, or of GC_Huge_Page_Size if hugetlb.  Failing to
+     * map huge pages isn't reported as an error.
+     */
+    static void* map_aligned(size_t size_bytes, bool hugetlb = false);
+
+    /*
+     * Give the whole pages between start and end back to the OS, they
+     * read as zeros when next touched.  Chunks with huge pages only give
+     * back whole huge pages, so that the rest aren't split.  Returns the
+     * number of bytes released.
+     */
+    size_t release_memory(void *start, void *end);
+
+    CellType type() const { return m_type; }
+    PageBacking backing() const { return m_backing; }
+
     ChunkBOP* initalise_as_bop();
     ChunkFit* initalise_as_fit();
 
@@ -116,15 +230,76 @@ class Chunk {
     };
 };
 
+/*
+ * The chunk map finds the chunk (if any) containing an address in constant
+ * time.  Chunks are aligned to their size, so the high bits of an address
+ * identify its chunk.  We use these bits to index a two-level table, the
+ * second level is only allocated for parts of the address space where
+ * we've actually mapped chunks.
+ */
+class ChunkMap {
+  private:
+    // Only the low 48 bits of an address are used on 64-bit systems.
+    static constexpr unsigned Address_Bits =
+        WORDSIZE_BITS < 48 ? WORDSIZE_BITS : 48;
+    static constexpr unsigned Index_Bits = Address_Bits - (GC_Chunk_Log - 1);
+    static constexpr unsigned Leaf_Bits = Index_Bits / 2;
+    static constexpr size_t Num_Leaves = size_t(1) << (Index_Bits - Leaf_Bits);
+    static constexpr size_t Leaf_Entries = size_t(1) << Leaf_Bits;
+
+    Chunk**     m_leaves[Num_Leaves];
+
+    // The lowest and highest addresses of the chunks inserted so far.
+    // They aren't narrowed when chunks are removed.
+    uintptr_t   m_low;
+    uintptr_t   m_high;
+
+    static uintptr_t index_of(const void *ptr) {
+        return reinterpret_cast<uintptr_t>(ptr) >> (GC_Chunk_Log - 1);
+    }
+
+  public:
+    ChunkMap();
+    ~ChunkMap();
+
+    ChunkMap(const ChunkMap&) = delete;
+    void operator=(const ChunkMap&) = delete;
+
+    /*
+     * Add a chunk of size_bytes bytes (it may cover more than one entry).
+     * Returns false if the chunk lies outside the range of addresses the
+     * map can cover.
+     */
+    bool insert(Chunk *chunk, size_t size_bytes);
+    void remove(Chunk *chunk, size_t size_bytes);
+
+    /*
+     * False if this address can't be in any chunk.  It's a single
+     * comparison, so callers scanning many words that are mostly not
+     * pointers can use it to skip lookup().
+     */
+    bool in_range(const void *ptr) const {
+        return reinterpret_cast<uintptr_t>(ptr) - m_low < m_high - m_low;
+    }
+
+    /*
+     * Find the chunk containing this address, or nullptr.
+     */
+    inline Chunk * lookup(const void *ptr) const;
+};
+
 } // namespace pz
 
 #include "pz_gc_layout_bop.h"
 #include "pz_gc_layout_fit.h"
+#include "pz_gc_layout_large.h"
 
 namespace pz {
 
 static_assert(GC_Small_Alloc_Threshold <= Block::Max_Cell_Size,
         "The small alloc threshold must be less than the maximum cell size");
+static_assert(GC_Large_Alloc_Threshold <= ChunkFit::Max_Cell_Size,
+        "Medium allocations must fit within a ChunkFit");
 
 } // namespace pz
 
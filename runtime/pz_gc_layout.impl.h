@@ -25,18 +25,40 @@ ptr_to_block(void *ptr)
         reinterpret_cast<uintptr_t>(ptr) & GC_Block_Mask);
 }
 
+Chunk *
+ChunkMap::lookup(const void *ptr) const
+{
+    // Any address in range is also within the table, insert() checks
+    // that.
+    if (!in_range(ptr)) return nullptr;
+
+    uintptr_t index = index_of(ptr);
+
+    Chunk **leaf = m_leaves[index >> Leaf_Bits];
+    if (!leaf) return nullptr;
+
+    return leaf[index & (Leaf_Entries - 1)];
+}
+
 bool
 Heap::is_heap_address(void *ptr) const
 {
-    if (m_chunk_bop->contains_pointer(ptr)) {
-        Block *block = m_chunk_bop->ptr_to_block(ptr);
-        if (!block) return false;
-        if (!block->is_in_use()) return false;
-        return block->is_in_payload(ptr);
-    } else if (m_chunk_fit->contains_pointer(ptr)) {
-        return true;
-    } else {
-        return false;
+    Chunk *chunk = m_chunk_map->lookup(ptr);
+    if (!chunk) return false;
+
+    switch (chunk->type()) {
+        case CT_BOP: {
+            Block *block = static_cast<ChunkBOP*>(chunk)->ptr_to_block(ptr);
+            if (!block) return false;
+            if (!block->is_in_use()) return false;
+            return block->is_in_payload(ptr);
+        }
+        case CT_FIT:
+            return true;
+        case CT_LARGE:
+            return static_cast<ChunkLarge*>(chunk)->is_in_payload(ptr);
+        default:
+            return false;
     }
 }
 
@@ -53,41 +75,84 @@ CellPtrBOP::CellPtrBOP(Block *block, unsigned index) :
 bool
 CellPtrBOP::is_allocated() const
 {
-    return *block()->cell_bits(index()) & Bits_Allocated;
+    assert(index() < block()->num_cells());
+    return block()->m_header.alloc_bits[Block::bit_word(index())] &
+        Block::bit_mask(index());
+}
+
+bool
+CellPtrBOP::is_precise() const
+{
+    assert(index() < block()->num_cells());
+    return block()->m_header.precise_bits[Block::bit_word(index())] &
+        Block::bit_mask(index());
 }
 
 bool
 CellPtrBOP::is_marked() const
 {
-    return *block()->cell_bits(index()) & Bits_Marked;
+    assert(index() < block()->num_cells());
+    return block()->m_header.mark_bits[Block::bit_word(index())] &
+        Block::bit_mask(index());
 }
 
 void
-CellPtrBOP::allocate()
+CellPtrBOP::mark()
 {
-    assert(*block()->cell_bits(index()) == 0);
-    *block()->cell_bits(index()) = Bits_Allocated;
+    assert(is_allocated());
+    block()->m_header.mark_bits[Block::bit_word(index())] |=
+        Block::bit_mask(index());
+    block()->m_header.num_marked++;
 }
 
 void
-CellPtrBOP::unallocate()
+CellPtrBOP::unmark()
 {
-    assert(!is_marked());
-    *block()->cell_bits(index()) = 0;
+    assert(is_marked());
+    block()->m_header.mark_bits[Block::bit_word(index())] &=
+        ~Block::bit_mask(index());
+    block()->m_header.num_marked--;
 }
 
-void
-CellPtrBOP::mark()
+bool
+CellPtrBOP::is_remembered() const
 {
-    assert(is_allocated());
-    *block()->cell_bits(index()) = Bits_Allocated | Bits_Marked;
+    assert(index() < block()->num_cells());
+    return block()->m_header.remembered_bits[Block::bit_word(index())] &
+        Block::bit_mask(index());
+}
+
+bool
+CellPtrBOP::remember()
+{
+    if (is_remembered()) return false;
+    block()->m_header.remembered_bits[Block::bit_word(index())] |=
+        Block::bit_mask(index());
+    return true;
 }
 
 void
-CellPtrBOP::unmark()
+CellPtrBOP::forget()
 {
-    assert(is_allocated());
-    *block()->cell_bits(index()) = Bits_Allocated;
+    assert(index() < block()->num_cells());
+    block()->m_header.remembered_bits[Block::bit_word(index())] &=
+        ~Block::bit_mask(index());
+}
+
+bool
+CellPtrBOP::try_mark()
+{
+    // The allocation bits don't change during marking.
+    if (!is_allocated()) return false;
+
+    uintptr_t mask = Block::bit_mask(index());
+    uintptr_t old_bits = __atomic_fetch_or(
+            &block()->m_header.mark_bits[Block::bit_word(index())], mask,
+            __ATOMIC_RELAXED);
+    if (old_bits & mask) return false;
+
+    __atomic_fetch_add(&block()->m_header.num_marked, 1, __ATOMIC_RELAXED);
+    return true;
 }
 
 bool
@@ -132,6 +197,39 @@ ChunkBOP::ptr_to_block(void *ptr)
 
 /**************************************************************************/
 
+size_t
+CellStartMap::find_prev(size_t index) const
+{
+    size_t w0 = index / Bits;
+    uintptr_t word = m_l0[w0] & bits_upto(index);
+    if (word) return w0 * Bits + last_bit(word);
+    if (w0 == 0) return Not_Found;
+
+    // Find the last non-zero word before w0 using the first summary
+    // level.
+    size_t i1 = w0 - 1;
+    size_t w1 = i1 / Bits;
+    word = m_l1[w1] & bits_upto(i1);
+    if (!word) {
+        // And if necessary the second summary level.
+        if (w1 == 0) return Not_Found;
+        size_t i2 = w1 - 1;
+        size_t w2 = i2 / Bits;
+        word = m_l2[w2] & bits_upto(i2);
+        while (!word) {
+            if (w2 == 0) return Not_Found;
+            w2--;
+            word = m_l2[w2];
+        }
+        w1 = w2 * Bits + last_bit(word);
+        word = m_l1[w1];
+    }
+
+    w0 = w1 * Bits + last_bit(word);
+    word = m_l0[w0];
+    return w0 * Bits + last_bit(word);
+}
+
 CellPtrFit::CellPtrFit(ChunkFit *chunk, void *ptr) :
     CellPtr(reinterpret_cast<void**>(ptr), CT_FIT),
     m_chunk(chunk)
@@ -158,13 +256,40 @@ CellPtrFit::next_in_chunk()
     }
 }
 
+void
+CellPtrFit::mark()
+{
+    assert(state() != CS_FREE);
+    set_state(CS_MARKED);
+    m_chunk->m_header.marked_cells++;
+    m_chunk->m_header.marked_bytes += size()*WORDSIZE_BYTES + CellInfoOffset;
+}
+
+bool
+CellPtrFit::try_mark()
+{
+    // Other threads may pin the cell meanwhile, which changes the word
+    // but not its state.
+    CellInfo info = __atomic_load_n(info_ptr(), __ATOMIC_RELAXED);
+    do {
+        if ((info & State_Mask) != CS_ALLOCATED) return false;
+    } while (!__atomic_compare_exchange_n(info_ptr(), &info,
+            (info & ~State_Mask) | CS_MARKED, true, __ATOMIC_RELAXED,
+            __ATOMIC_RELAXED));
+    __atomic_fetch_add(&m_chunk->m_header.marked_cells, 1,
+            __ATOMIC_RELAXED);
+    __atomic_fetch_add(&m_chunk->m_header.marked_bytes,
+            size()*WORDSIZE_BYTES + CellInfoOffset, __ATOMIC_RELAXED);
+    return true;
+}
+
 bool
 CellPtrFit::is_valid()
 {
     bool res = CellPtr::is_valid();
     if (res) {
         assert(size() > 0);
-        // TODO also check flags.
+        assert(state() <= CS_MARKED);
     }
     return res;
 }
@@ -179,6 +304,63 @@ CellPtrFit::next_in_list()
     }
 }
 
+/**************************************************************************/
+
+CellPtrLarge::CellPtrLarge(ChunkLarge *chunk) :
+    CellPtr(chunk->payload(), CT_LARGE),
+    m_chunk(chunk) { }
+
+size_t
+CellPtrLarge::size() const
+{
+    return m_chunk->m_size;
+}
+
+bool
+CellPtrLarge::is_marked() const
+{
+    return m_chunk->m_marked;
+}
+
+void
+CellPtrLarge::mark()
+{
+    m_chunk->m_marked = true;
+}
+
+void
+CellPtrLarge::unmark()
+{
+    assert(is_marked());
+    m_chunk->m_marked = false;
+}
+
+bool
+CellPtrLarge::remember()
+{
+    if (m_chunk->m_remembered) return false;
+    m_chunk->m_remembered = true;
+    return true;
+}
+
+void
+CellPtrLarge::forget()
+{
+    m_chunk->m_remembered = false;
+}
+
+bool
+CellPtrLarge::try_mark()
+{
+    return !__atomic_exchange_n(&m_chunk->m_marked, true, __ATOMIC_RELAXED);
+}
+
+void **
+CellPtrLarge::meta()
+{
+    return &m_chunk->m_meta;
+}
+
 } // namespace pz
 
 #endif // ! PZ_GC_LAYOUT_IMPL_H
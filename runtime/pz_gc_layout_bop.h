@@ -21,10 +21,6 @@ class CellPtrBOP : public CellPtr {
 
     constexpr CellPtrBOP() : m_block(nullptr), m_index(0) { }
 
-    int* free_list_data() {
-        return reinterpret_cast<int*>(m_ptr);
-    }
-
   public:
     inline explicit CellPtrBOP(Block* block, unsigned index, void* ptr);
     inline explicit CellPtrBOP(Block* block, unsigned index);
@@ -32,24 +28,27 @@ class CellPtrBOP : public CellPtr {
     Block* block() const { return m_block; }
     unsigned index() const { return m_index; }
 
-    void set_next_in_list(int next) {
-        *free_list_data() = next;
-    }
-    int next_in_list() {
-        return *free_list_data();
-    }
-
     static constexpr CellPtrBOP Invalid() { return CellPtrBOP(); }
 
-    constexpr static uintptr_t Bits_Allocated = 0x01;
-    constexpr static uintptr_t Bits_Marked    = 0x02;
-
     inline bool is_allocated() const;
     inline bool is_marked() const;
-    inline void allocate();
-    inline void unallocate();
     inline void mark();
     inline void unmark();
+
+    // Whether the write barrier has remembered the cell since the
+    // remembered sets were last cleared.  remember() returns false if it
+    // already had.
+    inline bool is_remembered() const;
+    inline bool remember();
+    inline void forget();
+
+    // The cell's last word holds a pointer map, it's only scanned where
+    // the map says.
+    inline bool is_precise() const;
+
+    // Mark an allocated cell, this is safe to call from multiple marking
+    // threads.  Returns false if the cell is free or already marked.
+    inline bool try_mark();
 };
 
 /*
@@ -57,19 +56,47 @@ class CellPtrBOP : public CellPtr {
  */
 class Block {
   private:
+    static constexpr unsigned Bitmap_Words =
+        (GC_Cells_Per_Block + WORDSIZE_BITS - 1) / WORDSIZE_BITS;
+
     struct Header {
         const static size_t Block_Empty = 0;
         size_t    block_type_or_size;
 
-        const static int Empty_Free_List = -1;
-        int       free_list;
+        // The next block of the same size class with free cells, see
+        // BlockIndex.
+        Block    *next_block;
 
-        // Really a bytemap.
-        uint8_t   bitmap[GC_Cells_Per_Block];
+        // The number of cells that aren't allocated.
+        unsigned  num_free;
+
+        // The number of cells marked since the last sweep.
+        unsigned  num_marked;
+
+        // Set by the collector for blocks that are swept lazily.  Until
+        // then the allocation bits are stale and the mark bits are valid.
+        SweepState sweep_state;
+
+        // A bit for each cell, bits past the last cell are always clear.
+        // Sweeping makes the mark bits the new allocation bits.
+        uintptr_t alloc_bits[Bitmap_Words];
+        uintptr_t mark_bits[Bitmap_Words];
+
+        // Allocated cells with a pointer map in their last word.
+        uintptr_t precise_bits[Bitmap_Words];
+
+        // Cells in a remembered set, see Heap::remember().
+        uintptr_t remembered_bits[Bitmap_Words];
 
         explicit Header(size_t cell_size_) :
             block_type_or_size(cell_size_),
-            free_list(Empty_Free_List)
+            next_block(nullptr),
+            num_free(0),
+            num_marked(0),
+            alloc_bits(),
+            mark_bits(),
+            precise_bits(),
+            remembered_bits()
         {
             assert(cell_size_ >= GC_Min_Cell_Size);
         }
@@ -126,57 +153,162 @@ class Block {
     inline void ** index_to_pointer(unsigned index);
 
   private:
-    /*
-     * TODO: Can the const and non-const versions somehow share an
-     * implementation?  Would that actually save any code lines?
-     */
-    const uint8_t * cell_bits(unsigned index) const {
-        assert(index < num_cells());
-        return &(m_header.bitmap[index]);
+    static unsigned bit_word(unsigned index) {
+        return index / WORDSIZE_BITS;
     }
-
-    uint8_t * cell_bits(unsigned index) {
-        assert(index < num_cells());
-        return &(m_header.bitmap[index]);
+    static uintptr_t bit_mask(unsigned index) {
+        return uintptr_t(1) << (index % WORDSIZE_BITS);
     }
     friend CellPtrBOP;
 
+    // The block must not be full.
+    unsigned first_free_cell() const;
+
   public:
     bool is_full() const {
         assert(is_in_use());
-        return m_header.free_list == Header::Empty_Free_List;
+        return m_header.num_free == 0;
     }
 
     bool is_in_use() const {
         return m_header.block_type_or_size != Header::Block_Empty;
     }
 
-    unsigned num_allocated();
-    size_t usage();
+    unsigned num_allocated() const {
+        return num_cells() - m_header.num_free;
+    }
+
+    unsigned num_marked() const { return m_header.num_marked; }
+
+    bool needs_sweep() const { return m_header.sweep_state.needs_sweep(); }
+    void set_needs_sweep() { m_header.sweep_state.set_needs_sweep(); }
+    bool claim_sweep() { return m_header.sweep_state.claim(); }
 
     // Returns true if the entire block is empty and may be reclaimed.
     bool sweep(const Options &options);
 
-    void make_unused();
+    // Sweep the block if it needs it, if the background sweeper is
+    // already sweeping it then wait.
+    void ensure_swept(const Options &options);
 
-    CellPtrBOP allocate_cell();
+    // Unmark the old cells before a full collection, the block must be
+    // swept.
+    void clear_marks();
 
-#ifdef PZ_DEV
-    void print_usage_stats() const;
+    void make_unused(const Options &options);
 
-    void check();
+    CellPtrBOP allocate_cell(bool precise);
 
-  private:
-    bool is_in_free_list(CellPtrBOP &cell);
+    /*
+     * Allocate the first run of adjacent free cells.  Returns the number
+     * of cells and sets start to the first one.  If marked then the cells
+     * are also marked, as they are while marking incrementally.
+     */
+    unsigned allocate_run(bool precise, bool marked, void ***start);
 
-    // Calculate the number of free cells via the free list length.
-    unsigned num_free();
+    Block * next_block() const { return m_header.next_block; }
+    void set_next_block(Block *block) { m_header.next_block = block; }
+
+#ifdef PZ_DEV
+    void print_usage_stats() const;
+
+    void check(const Options &options);
 #endif
 };
 
 static_assert(sizeof(Block) == GC_Block_Size,
         "sizeof(Block) must match specified block size");
 
+/*
+ * Small allocations are rounded up to one of a fixed number of sizes, each
+ * is a size class.
+ */
+static const unsigned GC_Num_Size_Classes = 20;
+
+inline size_t
+round_small_size(size_t size_in_words)
+{
+    if (size_in_words < GC_Min_Cell_Size) {
+        return GC_Min_Cell_Size;
+    } else if (size_in_words <= 16) {
+        return RoundUp(size_in_words, size_t(2));
+    } else {
+        return RoundUp(size_in_words, size_t(4));
+    }
+}
+
+inline unsigned
+size_class_of(size_t size_in_words)
+{
+    assert(size_in_words >= GC_Min_Cell_Size &&
+            size_in_words <= GC_Small_Alloc_Threshold);
+    if (size_in_words <= 16) {
+        assert(size_in_words % 2 == 0);
+        return size_in_words / 2 - 1;
+    } else {
+        assert(size_in_words % 4 == 0);
+        return 8 + (size_in_words - 20) / 4;
+    }
+}
+
+// The cell size of a size class, the inverse of size_class_of().
+inline size_t
+size_of_class(unsigned size_class)
+{
+    assert(size_class < GC_Num_Size_Classes);
+    if (size_class < 8) {
+        return (size_class + 1) * 2;
+    } else {
+        return 20 + (size_class - 8) * 4;
+    }
+}
+
+/*
+ * For each size class, a list of the blocks that have free cells, so that
+ * small allocation can find a block in constant time.  The lists are
+ * threaded through the block headers and rebuilt after each collection.
+ * Blocks that still need sweeping are included, they always have free
+ * cells once they're swept.
+ */
+class BlockIndex {
+  private:
+    Block      *m_lists[GC_Num_Size_Classes];
+
+  public:
+    BlockIndex() { clear(); }
+
+    BlockIndex(const BlockIndex&) = delete;
+    void operator=(const BlockIndex&) = delete;
+
+    void clear() {
+        for (unsigned i = 0; i < GC_Num_Size_Classes; i++) {
+            m_lists[i] = nullptr;
+        }
+    }
+
+    Block * get(size_t size_in_words) const {
+        return m_lists[size_class_of(size_in_words)];
+    }
+
+    // The block must not already be in the index.
+    void add(Block *block) {
+        Block **list = &m_lists[size_class_of(block->size())];
+        block->set_next_block(*list);
+        *list = block;
+    }
+
+    // Remove the block that get() returned (now that it is full).
+    void remove_first(size_t size_in_words) {
+        Block **list = &m_lists[size_class_of(size_in_words)];
+        assert(*list);
+        *list = (*list)->next_block();
+    }
+
+#ifdef PZ_DEV
+    void check() const;
+#endif
+};
+
 /*
  * ChunkBOP is a chunk containing BIBOP style blocks of cells.
  */
@@ -184,12 +316,32 @@ class ChunkBOP : public Chunk {
   private:
     uint32_t    m_wilderness;
 
+    // Blocks at or above this (the wilderness when the chunk was last
+    // swept) never need sweeping.
+    uint32_t    m_sweep_limit;
+
+    // A bit is set for each block below the wilderness that is not in use.
+    // The background sweeper sets bits while the allocator clears them, so
+    // these are accessed atomically.
+    static constexpr unsigned Free_Bitmap_Words =
+        (GC_Block_Per_Chunk + WORDSIZE_BITS - 1) / WORDSIZE_BITS;
+    uintptr_t   m_free_blocks[Free_Bitmap_Words];
+
+    // The number of collections each free block has been free for, up to
+    // Options::gc_release_after() when its memory is released.
+    uint8_t     m_idle_blocks[GC_Block_Per_Chunk];
+
     alignas(GC_Block_Size)
     Block       m_blocks[GC_Block_Per_Chunk];
 
-    ChunkBOP() : Chunk(CT_BOP), m_wilderness(0) { }
+    ChunkBOP();
     friend ChunkBOP* Chunk::initalise_as_bop();
 
+    void set_block_free(unsigned index);
+
+    // Sweep a block and free it if it's now empty.
+    void sweep_block(const Options &options, unsigned index);
+
   public:
     /*
      * Get an unused block.
@@ -200,12 +352,21 @@ class ChunkBOP : public Chunk {
     Block* allocate_block();
 
     /*
-     * The size of the allocated portion of this Chunk.
+     * True if allocate_block() can succeed.
      */
-    size_t usage();
+    bool has_free_block() const;
 
     bool is_empty() const;
 
+    /*
+     * The blocks below the wilderness, which may or may not be in use.
+     */
+    unsigned num_blocks() const { return m_wilderness; }
+    Block * block(unsigned index) {
+        assert(index < m_wilderness);
+        return &m_blocks[index];
+    }
+
     /*
      * If this pointer lies within the allocated part of this chunk then
      * return its block.
@@ -213,17 +374,45 @@ class ChunkBOP : public Chunk {
     inline Block * ptr_to_block(void *ptr);
 
     /*
-     * Get an block for the given size that is not full (we want to
-     * allocate a cell of this size).
+     * An address can be converted to a cell here, or Invalid() if the
+     * address isn't the first address of a valid cell (or within a cell for
+     * the interior version).
+     */
+    CellPtrBOP ptr_to_cell(void *ptr);
+    CellPtrBOP ptr_to_cell_interior(void *ptr);
+
+    /*
+     * After marking, blocks with no marked cells become free, or if
+     * defer_free they're left for finish_sweep() to free.  The others
+     * are flagged to be swept lazily and those with free cells are added
+     * to the index.  Returns the number of bytes in the marked cells.
+     */
+    size_t sweep(const Options &options, BlockIndex &index,
+        bool defer_free);
+
+    /*
+     * Sweep any blocks that are still flagged, this must be done before
+     * marking.  The background sweeper may call this while the allocator
+     * is running.
+     */
+    void finish_sweep(const Options &options);
+
+    void clear_marks();
+
+    /*
+     * Count another collection for each free block, and release the
+     * memory of those that have been free for after collections.  Returns
+     * the number of bytes released.
      */
-    Block * get_block_for_allocation(size_t size_in_words);
+    size_t release_free_blocks(unsigned after);
 
-    void sweep(const Options &options);
+    // True if every block is free and released.
+    bool is_idle(unsigned after) const;
 
 #ifdef PZ_DEV
     void print_usage_stats() const;
 
-    void check();
+    void check(const Options &options);
 #endif
 };
 
@@ -28,33 +28,52 @@ class CellPtrFit : public CellPtr {
     };
 
     /*
-     * We could pack size and flags into the same value, but that's a later
-     * optimisation because it's tricky to do portably and still keep using
-     * size_t which we use elsewhere (avoid losing data when casting).
+     * The word before a cell holds its size in words and its flags:
+     *
+     *   bits 0-1   CellState
+     *   bit  2     Pinned, set while marking if the cell is referenced
+     *              conservatively, so compaction mustn't move it.
+     *   bit  3     Has_Meta, the cell was allocated with room for meta
+     *              information in its last word.
+     *   bits 4-11  For free cells, the number of collections it has been
+     *              free for, up to Options::gc_release_after() when its
+     *              memory is released.
+     *   bit  12    Remembered, the cell is in a remembered set, see
+     *              Heap::remember().
+     *   bits 13-   The size.
      */
-    struct CellInfo {
-        size_t      size;
-        CellState   state;
-        void       *meta;
-    };
+    typedef uintptr_t CellInfo;
+
+    static constexpr CellInfo State_Mask = 0x3;
+    static constexpr CellInfo Pinned_Bit = 0x4;
+    static constexpr CellInfo Has_Meta_Bit = 0x8;
+    static constexpr unsigned Idle_Shift = 4;
+    static constexpr CellInfo Idle_Mask = CellInfo(0xFF) << Idle_Shift;
+    static constexpr CellInfo Remembered_Bit = 0x1000;
+    static constexpr unsigned Size_Shift = 13;
+    static_assert(GC_Chunk_Size / WORDSIZE_BYTES <=
+            (~CellInfo(0) >> Size_Shift), "Cell sizes must fit");
 
   public:
-    static constexpr size_t CellInfoOffset =
-        AlignUp(sizeof(CellInfo), WORDSIZE_BYTES);
+    static constexpr size_t CellInfoOffset = sizeof(CellInfo);
 
   private:
-    /*
-     * The memory word before a cell contains the size and two flags in the
-     * highest bits.
-     */
     CellInfo* info_ptr() {
         return reinterpret_cast<CellInfo*>(
                 reinterpret_cast<uint8_t*>(pointer())-CellInfoOffset);
     }
 
+    CellState state() {
+        return static_cast<CellState>(*info_ptr() & State_Mask);
+    }
+    void set_state(CellState state) {
+        *info_ptr() = (*info_ptr() & ~State_Mask) | state;
+    }
+
     void set_size(size_t new_size) {
         assert(new_size >= 1 && new_size < GC_Chunk_Size);
-        info_ptr()->size = new_size;
+        *info_ptr() = (*info_ptr() & ((CellInfo(1) << Size_Shift) - 1)) |
+            (CellInfo(new_size) << Size_Shift);
     }
 
   public:
@@ -63,7 +82,7 @@ class CellPtrFit : public CellPtr {
     constexpr static CellPtrFit Invalid() { return CellPtrFit(); }
 
     void init(size_t size) {
-        info_ptr()->state = CS_FREE;
+        *info_ptr() = CS_FREE;
         set_size(size);
         clear_next_in_list();
     }
@@ -72,31 +91,101 @@ class CellPtrFit : public CellPtr {
     // assertion.
     inline bool is_valid();
 
-    size_t size() { return info_ptr()->size; }
+    size_t size() { return *info_ptr() >> Size_Shift; }
 
     bool is_allocated() {
-        return info_ptr()->state != CS_FREE;
+        return state() != CS_FREE;
     }
     bool is_marked() {
-        return info_ptr()->state == CS_MARKED;
-    }
-    void mark() {
-        assert(info_ptr()->state != CS_FREE);
-        info_ptr()->state = CS_MARKED;
+        return state() == CS_MARKED;
     }
+    inline void mark();
+    // As for CellPtrBOP.
+    inline bool try_mark();
     void unmark() {
         // TODO: This state change should be illegal.  But it needs to wait
         // for https://github.com/PlasmaLang/plasma/issues/196
         assert(is_marked());
-        info_ptr()->state = CS_ALLOCATED;
+        set_state(CS_ALLOCATED);
+    }
+    // A cell allocated with meta information must be at least two words,
+    // the meta information is in the last.
+    void set_allocated(bool has_meta) {
+        assert(state() == CS_FREE);
+        assert(!has_meta || size() >= 2);
+        *info_ptr() = (*info_ptr() & ~(State_Mask | Pinned_Bit |
+                    Idle_Mask | Remembered_Bit)) |
+            CS_ALLOCATED | (has_meta ? Has_Meta_Bit : 0);
+    }
+    void set_free() {
+        assert(state() == CS_ALLOCATED);
+        *info_ptr() = (*info_ptr() & ~(State_Mask | Pinned_Bit |
+                    Has_Meta_Bit | Idle_Mask | Remembered_Bit)) | CS_FREE;
     }
-    void set_allocated() {
-        assert(info_ptr()->state == CS_FREE);
-        info_ptr()->state = CS_ALLOCATED;
+
+    unsigned idle() {
+        return (*info_ptr() & Idle_Mask) >> Idle_Shift;
+    }
+    void set_idle(unsigned idle) {
+        assert(idle <= Idle_Mask >> Idle_Shift);
+        *info_ptr() = (*info_ptr() & ~Idle_Mask) |
+            (CellInfo(idle) << Idle_Shift);
+    }
+
+    bool is_pinned() {
+        return *info_ptr() & Pinned_Bit;
+    }
+    void pin() {
+        // Several marking threads may pin or mark the same cell.  Most
+        // cells are pinned by their first reference, so test before
+        // paying for the atomic update.
+        if (!is_pinned()) {
+            __atomic_fetch_or(info_ptr(), Pinned_Bit, __ATOMIC_RELAXED);
+        }
+    }
+    void unpin() {
+        *info_ptr() &= ~Pinned_Bit;
+    }
+
+    // As for CellPtrBOP, the chunk must be swept.
+    bool is_remembered() {
+        return *info_ptr() & Remembered_Bit;
+    }
+    bool remember() {
+        if (is_remembered()) return false;
+        *info_ptr() |= Remembered_Bit;
+        return true;
+    }
+    void forget() {
+        *info_ptr() &= ~Remembered_Bit;
+    }
+
+    /*
+     * Copy the cell and its header down to ptr, which must be in the same
+     * chunk, and grow it to new_size words.  The new cell is returned.
+     */
+    CellPtrFit move_to(void *ptr, size_t new_size);
+
+    /*
+     * Absorb the cell that follows this one in the chunk, both must be
+     * free.  The caller must clear next's cell start.
+     */
+    void merge_next(CellPtrFit &next) {
+        assert(!is_allocated() && !next.is_allocated());
+        assert(next.pointer() == next_by_size(size()));
+        set_size(size() + CellInfoOffset/WORDSIZE_BYTES + next.size());
+        // Only the pages of both cells have been released.
+        if (next.idle() < idle()) {
+            set_idle(next.idle());
+        }
+    }
+
+    bool has_meta() {
+        return *info_ptr() & Has_Meta_Bit;
     }
-    
     void ** meta() {
-        return &(info_ptr()->meta);
+        assert(has_meta());
+        return &pointer()[size() - 1];
     }
 
     inline CellPtrFit next_in_list();
@@ -116,15 +205,115 @@ class CellPtrFit : public CellPtr {
 };
 
 /*
- * ChunkFit is a chunk for allocation of larger cells using best-fit with
- * cell splitting.
+ * A bitmap with a bit for each word in a chunk, the bit is set if a cell
+ * (free or allocated) begins at that word.  This lets us find the cell for
+ * an interior pointer by finding the previous set bit.  To bound the number
+ * of words we read doing so there are two summary levels, each bit in a
+ * summary level is set if the corresponding word in the level below is
+ * non-zero.
+ */
+class CellStartMap {
+  private:
+    static constexpr size_t Bits = WORDSIZE_BITS;
+    static constexpr size_t Num_Bits = GC_Chunk_Size / WORDSIZE_BYTES;
+    static constexpr size_t L0_Words = Num_Bits / Bits;
+    static constexpr size_t L1_Words = (L0_Words + Bits - 1) / Bits;
+    static constexpr size_t L2_Words = (L1_Words + Bits - 1) / Bits;
+
+    uintptr_t   m_l0[L0_Words];
+    uintptr_t   m_l1[L1_Words];
+    uintptr_t   m_l2[L2_Words];
+
+    static uintptr_t bit(size_t index) {
+        return uintptr_t(1) << (index % Bits);
+    }
+
+    // The bits in index's word up to and including index.
+    static uintptr_t bits_upto(size_t index) {
+        return ~uintptr_t(0) >> (Bits - 1 - index % Bits);
+    }
+
+    static unsigned last_bit(uintptr_t word) {
+        assert(word);
+        return Bits - 1 - __builtin_clzl(word);
+    }
+
+  public:
+    static const size_t Not_Found = ~size_t(0);
+
+    CellStartMap();
+
+    CellStartMap(const CellStartMap&) = delete;
+    void operator=(const CellStartMap&) = delete;
+
+    bool test(size_t index) const {
+        assert(index < Num_Bits);
+        return m_l0[index / Bits] & bit(index);
+    }
+
+    void set(size_t index) {
+        assert(index < Num_Bits);
+        m_l0[index / Bits] |= bit(index);
+        m_l1[index / Bits / Bits] |= bit(index / Bits);
+        m_l2[index / Bits / Bits / Bits] |= bit(index / Bits / Bits);
+    }
+
+    void clear(size_t index) {
+        assert(index < Num_Bits);
+        m_l0[index / Bits] &= ~bit(index);
+        if (m_l0[index / Bits]) return;
+        m_l1[index / Bits / Bits] &= ~bit(index / Bits);
+        if (m_l1[index / Bits / Bits]) return;
+        m_l2[index / Bits / Bits / Bits] &= ~bit(index / Bits / Bits);
+    }
+
+    /*
+     * The index of the last set bit at or before index, or Not_Found.
+     */
+    inline size_t find_prev(size_t index) const;
+};
+
+/*
+ * ChunkFit is a chunk for allocation of larger cells using segregated fits
+ * with cell splitting.
+ *
+ * Free cells are kept in power-of-two size classes, a cell of size s words
+ * is on list floor(log2(s)).  Any cell on a list at or above
+ * ceil(log2(size)) is big enough for an allocation, so most allocations
+ * take the head of the first non-empty such list.  Sweeping merges
+ * adjacent free cells and rebuilds the lists, so no two free cells are
+ * ever neighbours.
  */
 class ChunkFit : public Chunk {
   private:
-    struct Header {
-        CellPtrFit free_list;
+    static constexpr unsigned Num_Free_Lists = WORDSIZE_BITS;
 
-        Header() : free_list(CellPtrFit::Invalid()) { }
+    struct Header {
+        // The first free cell of each size class, linked through the
+        // cells' first words.
+        void       *free_lists[Num_Free_Lists];
+        // Bit n is set if free_lists[n] is non-empty.
+        uintptr_t   free_lists_nonempty;
+
+        // Where each cell begins.
+        CellStartMap cell_starts;
+
+        // The cells marked since the last sweep, and their bytes
+        // including their headers.
+        size_t      marked_cells;
+        size_t      marked_bytes;
+
+        // The free space the last sweep left, and the largest free cell,
+        // including their headers.
+        size_t      free_bytes;
+        size_t      largest_free_bytes;
+
+        // The chunk may be swept by the background sweeper, until then
+        // the free lists are empty.
+        SweepState  sweep_state;
+
+        Header() : free_lists(), free_lists_nonempty(0), marked_cells(0),
+            marked_bytes(0), free_bytes(0), largest_free_bytes(0) { }
     };
 
   public:
@@ -132,6 +321,9 @@ class ChunkFit : public Chunk {
         RoundUp<size_t>(sizeof(Chunk) + sizeof(Header), WORDSIZE_BYTES);
     static constexpr size_t Payload_Bytes =
         GC_Chunk_Size - Header_Bytes;
+    // The largest cell (in words) that can be allocated in a chunk.
+    static constexpr size_t Max_Cell_Size =
+        (Payload_Bytes - CellPtrFit::CellInfoOffset) / WORDSIZE_BYTES;
 
   private:
     Header  m_header;
@@ -141,16 +333,74 @@ class ChunkFit : public Chunk {
 
     ChunkFit();
     friend ChunkFit* Chunk::initalise_as_fit();
+    friend CellPtrFit;
+
+    size_t word_index(const void *ptr) const {
+        return (reinterpret_cast<const uint8_t*>(ptr) -
+                reinterpret_cast<const uint8_t*>(this)) / WORDSIZE_BYTES;
+    }
+
+    bool is_in_payload(const void *ptr) const {
+        return ptr >= m_bytes && ptr < &m_bytes[Payload_Bytes];
+    }
+
+    static unsigned floor_log2(size_t size) {
+        assert(size);
+        return WORDSIZE_BITS - 1 - __builtin_clzl(size);
+    }
+
+    static unsigned free_list_of(size_t size) {
+        return floor_log2(size);
+    }
+
+    void add_free_cell(CellPtrFit &cell);
+    CellPtrFit take_free_cell(size_t size_in_words);
+
+    // Poison a free cell found by sweep and put it on its free list.
+    void sweep_free_cell(const Options &options, CellPtrFit &cell);
+
+    // Make a free cell that spans from start to end, including its header.
+    void make_free_cell(void *start, void *end);
 
   public:
     /*
-     * Bytes used in this chunk, including cell headers.
+     * After marking, the bytes used in this chunk including cell headers.
+     */
+    size_t marked_bytes() const { return m_header.marked_bytes; }
+    size_t marked_cells() const { return m_header.marked_cells; }
+
+    /*
+     * The free space left by the last sweep, and the largest free cell,
+     * including cell headers.  The background sweeper may be updating
+     * them.
      */
-    size_t usage();
+    size_t free_bytes() const {
+        return __atomic_load_n(&m_header.free_bytes, __ATOMIC_RELAXED);
+    }
+    size_t largest_free_bytes() const {
+        return __atomic_load_n(&m_header.largest_free_bytes,
+                __ATOMIC_RELAXED);
+    }
 
     bool is_empty();
 
-    CellPtrFit allocate_cell(size_t size_in_words);
+    // With meta, the last word of the cell is for meta information.
+    CellPtrFit allocate_cell(size_t size_in_words, bool meta);
+
+    // As for ChunkBOP.
+    CellPtrFit ptr_to_cell(void *ptr);
+    CellPtrFit ptr_to_cell_interior(void *ptr);
+
+    /*
+     * Maintain the cell start map, these must be called whenever a cell
+     * is created or merged with a neighbour.
+     */
+    void set_cell_start(CellPtrFit &cell) {
+        m_header.cell_starts.set(word_index(cell.pointer()));
+    }
+    void clear_cell_start(CellPtrFit &cell) {
+        m_header.cell_starts.clear(word_index(cell.pointer()));
+    }
 
     CellPtrFit first_cell() {
         return CellPtrFit(this, reinterpret_cast<uint8_t*>(m_bytes) +
@@ -159,6 +409,42 @@ class ChunkFit : public Chunk {
 
     void sweep(const Options &options);
 
+    // Leave the sweep for the background sweeper, allocation must call
+    // ensure_swept() before using the chunk.
+    void set_needs_sweep() { m_header.sweep_state.set_needs_sweep(); }
+    bool claim_sweep() { return m_header.sweep_state.claim(); }
+
+    // As for Block.
+    void ensure_swept(const Options &options);
+    void clear_marks();
+
+    // As for ChunkBOP, for the free cells.  The chunk must be swept.
+    size_t release_free_cells(unsigned after);
+    bool is_idle(unsigned after);
+
+    /*
+     * Where a marked cell will be after compaction, and its size there.
+     */
+    struct Placement {
+        void   *from;
+        void   *to;
+        size_t  size;
+    };
+
+    /*
+     * After marking, plan sliding the marked cells that aren't pinned
+     * towards the start of the chunk.  Placements are made for every
+     * marked cell in address order.  Returns false if no cell would move.
+     */
+    bool plan_compact(std::vector<Placement> &placements);
+
+    /*
+     * Move the cells as planned and make free cells from everything in
+     * between.  Pointers to the moved cells must already have been
+     * updated, and the chunk must be swept afterwards.
+     */
+    void compact(const std::vector<Placement> &placements);
+
 #ifdef PZ_DEV
     void check();
 
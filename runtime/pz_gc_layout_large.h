@@ -0,0 +1,112 @@
+/*
+ * Plasma garbage collector memory layout - large objects.
+ * vim: ts=4 sw=4 et
+ *
+ * Copyright (C) 2019 Plasma Team
+ * Distributed under the terms of the MIT license, see ../LICENSE.code
+ */
+
+#ifndef PZ_GC_LAYOUT_LARGE_H
+#define PZ_GC_LAYOUT_LARGE_H
+
+namespace pz {
+
+/*
+ * A large object cell.  There's exactly one per ChunkLarge.
+ */
+class CellPtrLarge : public CellPtr {
+  private:
+    ChunkLarge *m_chunk;
+
+    constexpr CellPtrLarge() : CellPtr(nullptr, CT_INVALID),
+        m_chunk(nullptr) { }
+
+  public:
+    inline explicit CellPtrLarge(ChunkLarge *chunk);
+
+    constexpr static CellPtrLarge Invalid() { return CellPtrLarge(); }
+
+    ChunkLarge * chunk() const { return m_chunk; }
+
+    inline size_t size() const;
+
+    // A large object is freed by unmapping its chunk, so it is always
+    // allocated while we can see it.
+    bool is_allocated() const { return true; }
+
+    inline bool is_marked() const;
+    inline void mark();
+    inline void unmark();
+    // As for CellPtrBOP.
+    inline bool try_mark();
+    inline bool remember();
+    inline void forget();
+
+    inline void ** meta();
+};
+
+/*
+ * ChunkLarge is a memory region holding a single large object.  Unlike
+ * other chunks its size depends on the object it holds, it is aligned to
+ * GC_Chunk_Size so that the ChunkMap can find it, and is a whole number of
+ * pages.  The object is never moved, and the region is unmapped as soon as
+ * a sweep finds the object unmarked.
+ */
+class ChunkLarge : public Chunk {
+  private:
+    // Size of the object in words.
+    size_t      m_size;
+    bool        m_marked;
+    bool        m_remembered;
+    void       *m_meta;
+
+    explicit ChunkLarge(size_t size_in_words) :
+        Chunk(CT_LARGE),
+        m_size(size_in_words),
+        m_marked(false),
+        m_remembered(false),
+        m_meta(nullptr) { }
+
+    friend CellPtrLarge;
+
+  public:
+    static constexpr size_t Header_Bytes = 4 * WORDSIZE_BYTES;
+
+    /*
+     * Map a new chunk large enough for an object of this size, or return
+     * nullptr.
+     */
+    static ChunkLarge * new_chunk(size_t size_in_words);
+    bool destroy();
+
+    // The number of bytes mapped for this chunk.
+    size_t mapped_bytes() const;
+
+    size_t size() const { return m_size; }
+
+    void ** payload() {
+        return reinterpret_cast<void**>(
+            reinterpret_cast<uint8_t*>(this) + Header_Bytes);
+    }
+
+    bool is_in_payload(const void *ptr) {
+        return ptr >= payload() && ptr < payload() + m_size;
+    }
+
+    CellPtrLarge cell() { return CellPtrLarge(this); }
+
+    CellPtrLarge ptr_to_cell(void *ptr) {
+        return ptr == payload() ? cell() : CellPtrLarge::Invalid();
+    }
+
+    CellPtrLarge ptr_to_cell_interior(void *ptr) {
+        return is_in_payload(ptr) ? cell() : CellPtrLarge::Invalid();
+    }
+};
+
+static_assert(sizeof(ChunkLarge) <= ChunkLarge::Header_Bytes,
+        "ChunkLarge header is too big");
+
+} // namespace pz
+
+#endif // ! PZ_GC_LAYOUT_LARGE_H
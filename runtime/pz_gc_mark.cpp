@@ -0,0 +1,253 @@
+/*
+ * Plasma garbage collector - marking
+ * vim: ts=4 sw=4 et
+ *
+ * Copyright (C) 2019 Plasma Team
+ * Distributed under the terms of the MIT license, see ../LICENSE.code
+ */
+
+#include "pz_common.h"
+
+#include <string.h>
+#include <thread>
+
+#include "pz_util.h"
+
+#include "pz_gc.h"
+#include "pz_gc_util.h"
+
+#include "pz_gc.impl.h"
+#include "pz_gc_mark.h"
+
+namespace pz {
+
+MarkStack::MarkStack() :
+    m_entries(nullptr),
+    m_num_entries(0),
+    m_capacity(0),
+    m_overflowed(false),
+    m_prefetch_first(0),
+    m_prefetch_num(0) { }
+
+MarkStack::~MarkStack()
+{
+    free(m_entries);
+}
+
+bool
+MarkStack::grow()
+{
+    size_t new_capacity = m_capacity ? m_capacity * 2 : Initial_Entries;
+    if (new_capacity > Max_Entries) return false;
+
+    Entry *new_entries = static_cast<Entry*>(
+            realloc(m_entries, new_capacity * sizeof(Entry)));
+    if (!new_entries) return false;
+
+    m_entries = new_entries;
+    m_capacity = new_capacity;
+    return true;
+}
+
+void
+MarkStack::shrink()
+{
+    assert(m_num_entries == 0 && m_prefetch_num == 0);
+    if (m_capacity > Initial_Entries) {
+        free(m_entries);
+        m_entries = nullptr;
+        m_capacity = 0;
+    }
+}
+
+void
+MarkStack::take_oldest(std::vector<Entry> &out, size_t max)
+{
+    size_t num = max < m_num_entries ? max : m_num_entries;
+
+    out.insert(out.end(), m_entries, m_entries + num);
+    memmove(m_entries, m_entries + num,
+            (m_num_entries - num) * sizeof(Entry));
+    m_num_entries -= num;
+}
+
+/***************************************************************************/
+
+struct MarkWorker {
+    unsigned            id;
+    MarkStack           stack;
+    unsigned            num_marked;
+
+    // Work offered to other workers.  num_shared may be read without the
+    // lock to see if there's anything worth stealing.
+    std::mutex          lock;
+    std::vector<MarkStack::Entry> shared;
+    std::atomic<size_t> num_shared;
+
+    explicit MarkWorker(unsigned id_) :
+        id(id_),
+        num_marked(0),
+        num_shared(0) { }
+};
+
+ParallelMarker::ParallelMarker(Heap &heap, unsigned num_workers) :
+    m_heap(heap),
+    m_num_idle(0)
+{
+    assert(num_workers > 0);
+    for (unsigned i = 0; i < num_workers; i++) {
+        m_workers.push_back(new MarkWorker(i));
+    }
+}
+
+ParallelMarker::~ParallelMarker()
+{
+    for (MarkWorker *worker : m_workers) {
+        delete worker;
+    }
+}
+
+void
+ParallelMarker::run(MarkStack &roots)
+{
+    // Deal the roots out to the workers.
+    void **fields;
+    size_t num_fields;
+    unsigned next_worker = 0;
+    while (roots.pop(&fields, &num_fields)) {
+        m_workers[next_worker]->stack.push(fields, num_fields);
+        next_worker = (next_worker + 1) % m_workers.size();
+    }
+
+    // This thread is the first worker.
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < m_workers.size(); i++) {
+        threads.emplace_back(&ParallelMarker::work, this,
+                std::ref(*m_workers[i]));
+    }
+    work(*m_workers[0]);
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+
+    unsigned num_marked = 0;
+    for (MarkWorker *worker : m_workers) {
+        assert(worker->shared.empty());
+        num_marked += worker->num_marked;
+        if (worker->stack.overflowed()) {
+            roots.set_overflowed();
+        }
+    }
+
+#ifdef PZ_DEV
+    if (m_heap.m_options.gc_trace()) {
+        fprintf(stderr, "Marked %u cells with %ld threads\n",
+                num_marked, m_workers.size());
+    }
+#endif
+}
+
+void
+ParallelMarker::work(MarkWorker &worker)
+{
+    unsigned until_share = Share_Interval;
+    void **fields;
+    size_t num_fields;
+
+    while (true) {
+        while (worker.stack.pop(&fields, &num_fields)) {
+            worker.num_marked +=
+                m_heap.scan_fields<true>(worker.stack, fields, num_fields);
+
+            if (--until_share == 0) {
+                until_share = Share_Interval;
+                if (m_num_idle.load(std::memory_order_relaxed)) {
+                    share(worker);
+                }
+            }
+        }
+
+        // Take back anything we offered that wasn't stolen, otherwise look
+        // for work elsewhere.
+        if (take(worker, worker, true) || steal(worker)) continue;
+
+        /*
+         * An idle worker has nothing on its stack and nothing in its
+         * queue, and only a worker that isn't idle can add to its queue.
+         * So once every worker is idle there's no work left.  A thief
+         * stops being idle before it steals so that it doesn't hold work
+         * while counted as idle.
+         */
+        m_num_idle++;
+        while (true) {
+            if (m_num_idle.load() == m_workers.size()) return;
+
+            bool work_offered = false;
+            for (MarkWorker *victim : m_workers) {
+                if (victim->num_shared.load(std::memory_order_relaxed)) {
+                    work_offered = true;
+                    break;
+                }
+            }
+            if (work_offered) {
+                m_num_idle--;
+                if (steal(worker)) break;
+                m_num_idle++;
+            }
+
+            std::this_thread::yield();
+        }
+    }
+}
+
+void
+ParallelMarker::share(MarkWorker &worker)
+{
+    if (worker.num_shared.load(std::memory_order_relaxed)) return;
+    size_t num = worker.stack.num_entries() / 2;
+    if (!num) return;
+
+    std::lock_guard<std::mutex> guard(worker.lock);
+    worker.stack.take_oldest(worker.shared, num);
+    worker.num_shared.store(worker.shared.size());
+}
+
+bool
+ParallelMarker::steal(MarkWorker &thief)
+{
+    for (unsigned i = 1; i < m_workers.size(); i++) {
+        MarkWorker &victim =
+            *m_workers[(thief.id + i) % m_workers.size()];
+        if (victim.num_shared.load(std::memory_order_relaxed) &&
+                take(thief, victim, false))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Move work from the victim's queue to the thief's stack, either all of
+ * it or half.  Returns true if any work was moved.
+ */
+bool
+ParallelMarker::take(MarkWorker &thief, MarkWorker &victim, bool all)
+{
+    std::lock_guard<std::mutex> guard(victim.lock);
+    size_t num_shared = victim.shared.size();
+    if (!num_shared) return false;
+
+    size_t num = all ? num_shared : (num_shared + 1) / 2;
+    for (size_t i = num_shared - num; i < num_shared; i++) {
+        thief.stack.push(victim.shared[i].fields,
+                victim.shared[i].num_fields);
+    }
+    victim.shared.resize(num_shared - num);
+    victim.num_shared.store(victim.shared.size());
+
+    return true;
+}
+
+} // namespace pz
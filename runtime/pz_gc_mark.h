@@ -0,0 +1,170 @@
+/*
+ * Plasma garbage collector - mark stack
+ * vim: ts=4 sw=4 et
+ *
+ * Copyright (C) 2019 Plasma Team
+ * Distributed under the terms of the MIT license, see ../LICENSE.code
+ */
+
+#ifndef PZ_GC_MARK_H
+#define PZ_GC_MARK_H
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+namespace pz {
+
+/*
+ * The mark stack holds ranges of fields that belong to marked cells and
+ * haven't been scanned yet, it replaces recursion so that marking a long
+ * list doesn't overflow the C stack.
+ *
+ * Entries popped from the stack wait in a small FIFO for a few more pops
+ * so that their memory can be prefetched before it is scanned.
+ *
+ * Entries for precisely traced cells hold a pointer map rather than a
+ * number of fields, these are told apart by the top bit which pointer maps
+ * never use.
+ *
+ * The stack grows as needed up to Max_Entries.  If it can't grow it drops
+ * the entry and remembers that it has overflowed, the heap must then
+ * rescan the fields of every marked cell.
+ */
+class MarkStack {
+  public:
+    struct Entry {
+        void      **fields;
+        size_t      num_fields;
+    };
+
+  private:
+    Entry      *m_entries;
+    size_t      m_num_entries;
+    size_t      m_capacity;
+    bool        m_overflowed;
+
+    static constexpr unsigned Prefetch_Distance = 8;
+    Entry       m_prefetch[Prefetch_Distance];
+    unsigned    m_prefetch_first;
+    unsigned    m_prefetch_num;
+
+    bool grow();
+
+    static constexpr size_t Ptr_Map_Entry =
+        size_t(1) << (WORDSIZE_BITS - 1);
+
+  public:
+    static constexpr size_t Initial_Entries = 1024;
+    static constexpr size_t Max_Entries = 1024*1024;
+
+    MarkStack();
+    ~MarkStack();
+
+    MarkStack(const MarkStack&) = delete;
+    void operator=(const MarkStack&) = delete;
+
+    void push(void **fields, size_t num_fields) {
+        if (m_num_entries == m_capacity && !grow()) {
+            m_overflowed = true;
+            return;
+        }
+        m_entries[m_num_entries].fields = fields;
+        m_entries[m_num_entries].num_fields = num_fields;
+        m_num_entries++;
+    }
+
+    void push_ptr_map(void **fields, PtrMap ptr_map) {
+        assert(!is_ptr_map_entry(ptr_map));
+        push(fields, ptr_map | Ptr_Map_Entry);
+    }
+
+    static bool is_ptr_map_entry(size_t num_fields) {
+        return num_fields & Ptr_Map_Entry;
+    }
+    static PtrMap entry_ptr_map(size_t num_fields) {
+        return num_fields & ~Ptr_Map_Entry;
+    }
+
+    bool pop(void ***fields, size_t *num_fields) {
+        while (m_prefetch_num < Prefetch_Distance && m_num_entries) {
+            Entry &entry = m_entries[--m_num_entries];
+            __builtin_prefetch(entry.fields);
+            m_prefetch[(m_prefetch_first + m_prefetch_num) %
+                Prefetch_Distance] = entry;
+            m_prefetch_num++;
+        }
+        if (!m_prefetch_num) return false;
+
+        Entry &entry = m_prefetch[m_prefetch_first];
+        *fields = entry.fields;
+        *num_fields = entry.num_fields;
+        m_prefetch_first = (m_prefetch_first + 1) % Prefetch_Distance;
+        m_prefetch_num--;
+        return true;
+    }
+
+    bool is_empty() const { return !m_num_entries && !m_prefetch_num; }
+
+    bool overflowed() const { return m_overflowed; }
+    void set_overflowed() { m_overflowed = true; }
+    void clear_overflowed() { m_overflowed = false; }
+
+    // The number of entries that take_oldest() could take.
+    size_t num_entries() const { return m_num_entries; }
+
+    /*
+     * Move up to max entries from the bottom of the stack to the end of
+     * out.  The oldest entries often lead to the most work, so they're the
+     * best ones to give to another marking thread.
+     */
+    void take_oldest(std::vector<Entry> &out, size_t max);
+
+    /*
+     * Give back the memory from a deep mark, the stack must be empty.
+     */
+    void shrink();
+};
+
+class Heap;
+struct MarkWorker;
+
+/*
+ * Mark the heap using several threads.  Each worker marks from its own
+ * mark stack, when another worker is idle it offers the oldest entries on
+ * its stack in a queue that the idle workers steal from.  Marking is
+ * finished once every worker is idle.
+ */
+class ParallelMarker {
+  private:
+    Heap                       &m_heap;
+    std::vector<MarkWorker*>    m_workers;
+    std::atomic<unsigned>       m_num_idle;
+
+    // How many fields ranges a worker scans between checking whether it
+    // should share work.
+    static constexpr unsigned Share_Interval = 64;
+
+    void work(MarkWorker &worker);
+    void share(MarkWorker &worker);
+    bool steal(MarkWorker &thief);
+    bool take(MarkWorker &thief, MarkWorker &victim, bool all);
+
+  public:
+    ParallelMarker(Heap &heap, unsigned num_workers);
+    ~ParallelMarker();
+
+    ParallelMarker(const ParallelMarker&) = delete;
+    void operator=(const ParallelMarker&) = delete;
+
+    /*
+     * Scan the entries on the roots stack and everything reachable from
+     * them.  If any worker's stack overflowed then roots is marked as
+     * overflowed.
+     */
+    void run(MarkStack &roots);
+};
+
+} // namespace pz
+
+#endif // ! PZ_GC_MARK_H
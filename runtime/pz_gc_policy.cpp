@@ -0,0 +1,151 @@
+/*
+ * Plasma garbage collector - heap sizing policy
+ * vim: ts=4 sw=4 et
+ *
+ * Copyright (C) 2019 Plasma Team
+ * Distributed under the terms of the MIT license, see ../LICENSE.code
+ */
+
+#include "pz_common.h"
+
+#include <stdio.h>
+#include <time.h>
+
+#include <algorithm>
+
+#include "pz_util.h"
+
+#include "pz_gc.h"
+#include "pz_gc_util.h"
+
+#include "pz_gc.impl.h"
+#include "pz_gc_layout.h"
+#include "pz_gc_layout.impl.h"
+
+namespace pz {
+
+/*
+ * After each collection the threshold for the next is chosen so that the
+ * collector uses about m_cpu_target percent of the time.  Between
+ * collections the mutator allocates the headroom above the live data, so
+ * with an allocation rate A it runs for headroom/A seconds.  Collecting
+ * costs live/M seconds for a mark rate M, and of the headroom the fraction
+ * S (the survival rate) will be live by then.  For a target fraction f:
+ *
+ *   (live + S * headroom) / M = f / (1 - f) * headroom / A
+ *
+ * so with k = A * (1 - f) / (f * M):
+ *
+ *   headroom = k * live / (1 - k * S)
+ *
+ * The rates are smoothed over collections and the headroom is kept between
+ * GC_Min_Threshold_Factor and GC_Max_Threshold_Factor of live, which is
+ * also where it goes when k * S >= 1 and no headroom is enough.  The
+ * threshold is never less than GC_Initial_Threshold, so that small heaps
+ * aren't collected after every few allocations, nor more than the heap's
+ * limit.
+ */
+
+double
+Heap::now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The first measurement is taken as is, later ones are averaged with
+// the history.
+static double
+smooth(double average, double sample)
+{
+    return average > 0.0 ? (average + sample) / 2.0 : sample;
+}
+
+void
+Heap::update_threshold(double start, size_t allocated,
+        size_t allocated_marking, bool full)
+{
+    double end = now();
+    double gc_seconds = end - start;
+    double mutator_seconds = start - m_last_collect_end;
+    size_t survived = m_usage > m_live ? m_usage - m_live : 0;
+
+    if (mutator_seconds > 0.0) {
+        m_alloc_rate = smooth(m_alloc_rate, allocated / mutator_seconds);
+    }
+    // Minor collections don't trace the old cells, so they say nothing
+    // about how long it takes to mark the live data.
+    if (full && gc_seconds > 0.0) {
+        m_mark_rate = smooth(m_mark_rate, m_usage / gc_seconds);
+    }
+    // Cells allocated during incremental marking aren't freed until the
+    // next collection, so they say nothing about the survival rate, and
+    // the heap is sized by the cells that were live when marking started.
+    // The next collection may then start straight away.
+    if (allocated > allocated_marking) {
+        survived = survived > allocated_marking ?
+            survived - allocated_marking : 0;
+        m_survival_rate = smooth(m_survival_rate,
+                std::min(1.0, double(survived) /
+                    (allocated - allocated_marking)));
+    }
+    m_live = m_usage;
+    size_t live = m_usage - std::min(m_usage, allocated_marking);
+
+    double min_threshold = live * GC_Min_Threshold_Factor;
+    double max_threshold = live * GC_Max_Threshold_Factor;
+    double threshold;
+    if (!m_cpu_target || m_mark_rate <= 0.0 || m_alloc_rate <= 0.0) {
+        threshold = live * GC_Threshold_Factor;
+    } else {
+        double f = m_cpu_target / 100.0;
+        double k = m_alloc_rate * (1.0 - f) / (f * m_mark_rate);
+        if (k * m_survival_rate >= 1.0) {
+            threshold = max_threshold;
+        } else {
+            threshold = live + k * live / (1.0 - k * m_survival_rate);
+            threshold = std::max(min_threshold,
+                    std::min(max_threshold, threshold));
+        }
+    }
+
+    m_threshold = std::max(GC_Initial_Threshold, size_t(threshold));
+    if (m_max_size) {
+        m_threshold = std::min(m_threshold, m_max_size);
+    }
+
+#ifdef PZ_DEV
+    if (m_options.gc_trace()) {
+        fprintf(stderr,
+                "Collection took %.3fms, next at %ldKB (mark rate %.0fMB/s, "
+                "allocation rate %.0fMB/s, survival %.0f%%)\n",
+                gc_seconds * 1000, m_threshold / 1024,
+                m_mark_rate / (1024*1024), m_alloc_rate / (1024*1024),
+                m_survival_rate * 100);
+    }
+#endif
+}
+
+bool
+Heap::set_max_size(size_t size_bytes)
+{
+    if (size_bytes && size_bytes < m_usage) return false;
+
+    m_max_size = size_bytes;
+    if (m_max_size) {
+        m_threshold = std::min(m_threshold, m_max_size);
+    }
+    return true;
+}
+
+bool
+Heap::set_cpu_target(unsigned percent)
+{
+    if (percent > Options::Max_GC_CPU_Target) return false;
+
+    m_cpu_target = percent;
+    return true;
+}
+
+} // namespace pz
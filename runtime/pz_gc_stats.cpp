@@ -0,0 +1,299 @@
+/*
+ * Plasma garbage collector - statistics
+ * vim: ts=4 sw=4 et
+ *
+ * Copyright (C) 2019 Plasma Team
+ * Distributed under the terms of the MIT license, see ../LICENSE.code
+ */
+
+#include "pz_common.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "pz_util.h"
+
+#include "pz_gc.h"
+#include "pz_gc_util.h"
+
+#include "pz_gc.impl.h"
+#include "pz_gc_layout.h"
+#include "pz_gc_layout.impl.h"
+#include "pz_gc_stats.h"
+
+namespace pz {
+
+unsigned
+CollectionStats::block_occupancy(unsigned size_class) const
+{
+    if (!cells[size_class]) return 0;
+    return cells_live[size_class] * 100 / cells[size_class];
+}
+
+unsigned
+CollectionStats::fit_fragmentation() const
+{
+    if (!fit_free_bytes) return 0;
+    return (fit_free_bytes - fit_largest_free_bytes) * 100 /
+        fit_free_bytes;
+}
+
+/***************************************************************************/
+
+volatile sig_atomic_t GCStats::s_dump_requested = 0;
+
+GCStats::GCStats(uint64_t pause_budget_us)
+        : m_collections(0)
+        , m_pause_budget_us(pause_budget_us)
+        , m_pauses(0)
+        , m_pauses_over_budget(0)
+        , m_total_pause_us(0)
+        , m_max_pause_us(0)
+{
+    memset(&m_last, 0, sizeof(m_last));
+    memset(m_pause_histogram, 0, sizeof(m_pause_histogram));
+}
+
+void
+GCStats::record(const CollectionStats &collection)
+{
+    m_last = collection;
+    m_collections++;
+    record_pause(collection.pause_us());
+}
+
+void
+GCStats::record_pause(uint64_t pause)
+{
+    m_pauses++;
+    if (m_pause_budget_us && pause > m_pause_budget_us) {
+        m_pauses_over_budget++;
+    }
+    m_total_pause_us += pause;
+    if (pause > m_max_pause_us) {
+        m_max_pause_us = pause;
+    }
+
+    unsigned bucket = 0;
+    while (bucket < Num_Pause_Buckets - 1 &&
+            pause >= (uint64_t(1) << bucket))
+    {
+        bucket++;
+    }
+    m_pause_histogram[bucket]++;
+}
+
+// If name is prefix followed by a number less than max, return the number
+// in index.
+static bool
+indexed_name(const char *name, const char *prefix, unsigned max,
+        unsigned *index)
+{
+    size_t len = strlen(prefix);
+    if (strncmp(name, prefix, len) != 0 || !name[len]) return false;
+
+    char *end;
+    unsigned long value = strtoul(name + len, &end, 10);
+    if (*end || value >= max) return false;
+
+    *index = value;
+    return true;
+}
+
+bool
+GCStats::get(const char *name, int64_t *value) const
+{
+    unsigned index;
+
+    if (0 == strcmp(name, "gc_last_pause_us")) {
+        *value = m_last.pause_us();
+    } else if (0 == strcmp(name, "gc_last_mark_us")) {
+        *value = m_last.mark_us;
+    } else if (0 == strcmp(name, "gc_last_sweep_us")) {
+        *value = m_last.sweep_us;
+    } else if (0 == strcmp(name, "gc_last_allocated")) {
+        *value = m_last.allocated_bytes;
+    } else if (0 == strcmp(name, "gc_last_survived")) {
+        *value = m_last.survived_bytes;
+    } else if (0 == strcmp(name, "gc_last_cells_marked")) {
+        *value = m_last.cells_marked;
+    } else if (0 == strcmp(name, "gc_fit_fragmentation")) {
+        *value = m_last.fit_fragmentation();
+    } else if (0 == strcmp(name, "gc_last_slices")) {
+        *value = m_last.slices;
+    } else if (0 == strcmp(name, "gc_last_slices_us")) {
+        *value = m_last.slices_us;
+    } else if (0 == strcmp(name, "gc_pauses")) {
+        *value = m_pauses;
+    } else if (0 == strcmp(name, "gc_pauses_over_budget")) {
+        *value = m_pauses_over_budget;
+    } else if (0 == strcmp(name, "gc_max_pause_us")) {
+        *value = m_max_pause_us;
+    } else if (0 == strcmp(name, "gc_total_pause_us")) {
+        *value = m_total_pause_us;
+    } else if (indexed_name(name, "gc_pause_histogram_", Num_Pause_Buckets,
+                &index))
+    {
+        *value = m_pause_histogram[index];
+    } else if (indexed_name(name, "gc_block_occupancy_", GC_Num_Size_Classes,
+                &index))
+    {
+        *value = m_last.block_occupancy(index);
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+void
+GCStats::dump_json(FILE *stream) const
+{
+    fprintf(stream, "{\n");
+    fprintf(stream, "  \"collections\": %u,\n", m_collections);
+    fprintf(stream, "  \"pauses\": %" PRIu64 ",\n", m_pauses);
+    if (m_pause_budget_us) {
+        fprintf(stream, "  \"pause_budget_us\": %" PRIu64 ",\n",
+                m_pause_budget_us);
+        fprintf(stream, "  \"pauses_over_budget\": %" PRIu64 ",\n",
+                m_pauses_over_budget);
+    }
+    fprintf(stream, "  \"total_pause_us\": %" PRIu64 ",\n", m_total_pause_us);
+    fprintf(stream, "  \"max_pause_us\": %" PRIu64 ",\n", m_max_pause_us);
+
+    fprintf(stream, "  \"pause_histogram\": [\n");
+    for (unsigned i = 0; i < Num_Pause_Buckets - 1; i++) {
+        fprintf(stream,
+                "    {\"under_us\": %" PRIu64 ", \"count\": %" PRIu64 "},\n",
+                uint64_t(1) << i, m_pause_histogram[i]);
+    }
+    fprintf(stream, "    {\"under_us\": null, \"count\": %" PRIu64 "}\n",
+            m_pause_histogram[Num_Pause_Buckets - 1]);
+    fprintf(stream, "  ],\n");
+
+    fprintf(stream, "  \"last_collection\": {\n");
+    fprintf(stream, "    \"full\": %s,\n", m_last.full ? "true" : "false");
+    fprintf(stream, "    \"mark_us\": %" PRIu64 ",\n", m_last.mark_us);
+    fprintf(stream, "    \"sweep_us\": %" PRIu64 ",\n", m_last.sweep_us);
+    if (m_last.incremental) {
+        fprintf(stream, "    \"slices\": %u,\n", m_last.slices);
+        fprintf(stream, "    \"slices_us\": %" PRIu64 ",\n",
+                m_last.slices_us);
+    }
+    fprintf(stream, "    \"allocated_bytes\": %zu,\n",
+            m_last.allocated_bytes);
+    fprintf(stream, "    \"survived_bytes\": %zu,\n", m_last.survived_bytes);
+    fprintf(stream, "    \"cells_marked\": %zu,\n", m_last.cells_marked);
+
+    fprintf(stream, "    \"block_occupancy\": [\n");
+    bool first = true;
+    for (unsigned i = 0; i < GC_Num_Size_Classes; i++) {
+        if (!m_last.blocks[i]) continue;
+        fprintf(stream,
+                "%s      {\"cell_words\": %zu, \"blocks\": %zu, "
+                "\"cells\": %zu, \"live_cells\": %zu, \"percent\": %u}",
+                first ? "" : ",\n", size_of_class(i), m_last.blocks[i],
+                m_last.cells[i], m_last.cells_live[i],
+                m_last.block_occupancy(i));
+        first = false;
+    }
+    fprintf(stream, "%s    ],\n", first ? "" : "\n");
+
+    fprintf(stream, "    \"fit_free_bytes\": %zu,\n", m_last.fit_free_bytes);
+    fprintf(stream, "    \"fit_largest_free_bytes\": %zu,\n",
+            m_last.fit_largest_free_bytes);
+    fprintf(stream, "    \"fit_fragmentation_percent\": %u\n",
+            m_last.fit_fragmentation());
+    fprintf(stream, "  }\n");
+    fprintf(stream, "}\n");
+}
+
+void
+GCStats::dump_json(const char *path) const
+{
+    if (0 == strcmp(path, "-")) {
+        dump_json(stderr);
+        return;
+    }
+
+    FILE *stream = fopen(path, "w");
+    if (!stream) {
+        perror(path);
+        return;
+    }
+    dump_json(stream);
+    fclose(stream);
+}
+
+void
+GCStats::handle_signal(int signal)
+{
+    s_dump_requested = 1;
+}
+
+bool
+GCStats::install_signal_handler()
+{
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_signal;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    if (sigaction(SIGUSR1, &action, nullptr) != 0) {
+        perror("sigaction");
+        return false;
+    }
+    return true;
+}
+
+bool
+GCStats::take_dump_request()
+{
+    bool requested = s_dump_requested;
+    s_dump_requested = 0;
+    return requested;
+}
+
+/***************************************************************************/
+
+void
+Heap::record_mark_stats(CollectionStats &stats) const
+{
+    for (ChunkBOP *chunk : m_chunks_bop) {
+        for (unsigned i = 0; i < chunk->num_blocks(); i++) {
+            Block *block = chunk->block(i);
+            if (!block->is_in_use()) continue;
+
+            unsigned size_class = size_class_of(block->size());
+            stats.blocks[size_class]++;
+            stats.cells[size_class] += block->num_cells();
+            stats.cells_live[size_class] += block->num_marked();
+            stats.cells_marked += block->num_marked();
+        }
+    }
+
+    for (ChunkFit *chunk : m_chunks_fit) {
+        stats.cells_marked += chunk->marked_cells();
+    }
+
+    for (ChunkLarge *chunk : m_chunks_large) {
+        if (chunk->cell().is_marked()) {
+            stats.cells_marked++;
+        }
+    }
+}
+
+void
+Heap::record_sweep_stats(CollectionStats &stats) const
+{
+    for (ChunkFit *chunk : m_chunks_fit) {
+        stats.fit_free_bytes += chunk->free_bytes();
+        stats.fit_largest_free_bytes = std::max(
+                stats.fit_largest_free_bytes, chunk->largest_free_bytes());
+    }
+}
+
+} // namespace pz
@@ -0,0 +1,121 @@
+/*
+ * Plasma garbage collector - statistics
+ * vim: ts=4 sw=4 et
+ *
+ * Copyright (C) 2019 Plasma Team
+ * Distributed under the terms of the MIT license, see ../LICENSE.code
+ */
+
+#ifndef PZ_GC_STATS_H
+#define PZ_GC_STATS_H
+
+#include <signal.h>
+#include <stdio.h>
+
+#include "pz_gc_layout.h"
+
+namespace pz {
+
+/*
+ * What happened in one collection.  Times are in microseconds, the pause
+ * is the mark and sweep times together.  Sweep time includes finishing
+ * the previous sweep, returning memory to the OS and compacting.  An
+ * incremental collection also had the slices of marking before this
+ * pause, including the one that started it.
+ */
+struct CollectionStats {
+    bool        full;
+    uint64_t    mark_us;
+    uint64_t    sweep_us;
+    bool        incremental;
+    unsigned    slices;
+    uint64_t    slices_us;
+    size_t      allocated_bytes;
+    size_t      survived_bytes;
+    size_t      cells_marked;
+
+    // The blocks in use and their live cells, for each size class.
+    size_t      blocks[GC_Num_Size_Classes];
+    size_t      cells[GC_Num_Size_Classes];
+    size_t      cells_live[GC_Num_Size_Classes];
+
+    // The free space in fit chunks after sweeping and the largest single
+    // free cell there.
+    size_t      fit_free_bytes;
+    size_t      fit_largest_free_bytes;
+
+    uint64_t pause_us() const { return mark_us + sweep_us; }
+
+    // The percentage of the cells in blocks of this size class that are
+    // live.
+    unsigned block_occupancy(unsigned size_class) const;
+
+    // The percentage of free fit space that is outside the largest free
+    // cell.
+    unsigned fit_fragmentation() const;
+};
+
+/*
+ * The statistics are always kept, they cost a walk over the block headers
+ * per collection, and sweeping counts the free space in fit chunks.  Every
+ * pause counts towards the pause statistics, whether it finished a
+ * collection or was a slice of one, and with a pause budget
+ * (gc_max_pause) those that went over it are counted.
+ * They can be read by name with get(), or dumped as JSON when the program
+ * exits, or at the end of the next collection after a SIGUSR1.
+ */
+class GCStats {
+  public:
+    // Bucket i counts pauses shorter than 2^i microseconds (and at least
+    // 2^(i-1)), the last bucket counts all the longer pauses.
+    static const unsigned Num_Pause_Buckets = 24;
+
+  private:
+    CollectionStats     m_last;
+    unsigned            m_collections;
+    uint64_t            m_pause_budget_us;
+    uint64_t            m_pauses;
+    uint64_t            m_pauses_over_budget;
+    uint64_t            m_total_pause_us;
+    uint64_t            m_max_pause_us;
+    uint64_t            m_pause_histogram[Num_Pause_Buckets];
+
+    static volatile sig_atomic_t s_dump_requested;
+    static void handle_signal(int signal);
+
+  public:
+    // A budget of zero is no budget.
+    explicit GCStats(uint64_t pause_budget_us);
+
+    GCStats(const GCStats&) = delete;
+    void operator=(const GCStats&) = delete;
+
+    void record(const CollectionStats &collection);
+    void record_pause(uint64_t pause_us);
+
+    const CollectionStats & last() const { return m_last; }
+
+    /*
+     * Get a statistic by its get_parameter name, returns false if there's
+     * no such statistic.
+     */
+    bool get(const char *name, int64_t *value) const;
+
+    void dump_json(FILE *stream) const;
+
+    /*
+     * Dump the statistics to this path, or stderr for "-".
+     */
+    void dump_json(const char *path) const;
+
+    /*
+     * Request a dump when SIGUSR1 is received.  Only one heap should do
+     * this.
+     */
+    static bool install_signal_handler();
+    static bool take_dump_request();
+};
+
+} // namespace pz
+
+#endif // ! PZ_GC_STATS_H
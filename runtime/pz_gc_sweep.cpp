@@ -0,0 +1,108 @@
+/*
+ * Plasma garbage collector - background sweeping
+ * vim: ts=4 sw=4 et
+ *
+ * Copyright (C) 2019 Plasma Team
+ * Distributed under the terms of the MIT license, see ../LICENSE.code
+ */
+
+#include "pz_common.h"
+
+#include <stdio.h>
+
+#include "pz_util.h"
+
+#include "pz_gc.h"
+#include "pz_gc_util.h"
+
+#include "pz_gc.impl.h"
+#include "pz_gc_layout.h"
+#include "pz_gc_layout.impl.h"
+#include "pz_gc_sweep.h"
+
+namespace pz {
+
+void
+SweepState::wait() const
+{
+    // Sweeping a block or chunk is short, so don't bother sleeping.
+    while (needs_sweep()) {
+        std::this_thread::yield();
+    }
+}
+
+Sweeper::Sweeper(const Options &options) :
+    m_options(options),
+    m_busy(false),
+    m_stop(false),
+    m_thread(&Sweeper::run, this) { }
+
+Sweeper::~Sweeper()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_stop = true;
+    }
+    m_cond.notify_all();
+    m_thread.join();
+}
+
+void
+Sweeper::start(const std::vector<ChunkBOP*> &chunks_bop,
+    const std::vector<ChunkFit*> &chunks_fit)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        assert(!m_busy);
+        m_chunks_bop = chunks_bop;
+        m_chunks_fit = chunks_fit;
+        m_busy = true;
+    }
+    m_cond.notify_all();
+}
+
+void
+Sweeper::wait()
+{
+    std::unique_lock<std::mutex> lock(m_lock);
+    m_cond.wait(lock, [this]{ return !m_busy; });
+}
+
+void
+Sweeper::run()
+{
+    std::unique_lock<std::mutex> lock(m_lock);
+    while (true) {
+        // Finish any work before stopping.
+        m_cond.wait(lock, [this]{ return m_busy || m_stop; });
+        if (!m_busy) break;
+
+        lock.unlock();
+        sweep();
+        lock.lock();
+
+        m_busy = false;
+        m_cond.notify_all();
+    }
+}
+
+void
+Sweeper::sweep()
+{
+    // The fit chunks go first since allocation can't use them until
+    // they're swept.
+    for (ChunkFit *chunk : m_chunks_fit) {
+        chunk->ensure_swept(m_options);
+    }
+    for (ChunkBOP *chunk : m_chunks_bop) {
+        chunk->finish_sweep(m_options);
+    }
+
+#ifdef PZ_DEV
+    if (m_options.gc_trace()) {
+        fprintf(stderr, "Background sweep finished\n");
+    }
+#endif
+}
+
+} // namespace pz
@@ -0,0 +1,67 @@
+/*
+ * Plasma garbage collector - background sweeping
+ * vim: ts=4 sw=4 et
+ *
+ * Copyright (C) 2019 Plasma Team
+ * Distributed under the terms of the MIT license, see ../LICENSE.code
+ */
+
+#ifndef PZ_GC_SWEEP_H
+#define PZ_GC_SWEEP_H
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace pz {
+
+/*
+ * A thread that sweeps the fit chunks and the flagged BOP blocks after
+ * each collection, so that the collector can return as soon as marking is
+ * done.
+ *
+ * The allocator runs at the same time and may claim the same blocks and
+ * chunks, each has a SweepState so that only one of them sweeps it.  The
+ * collector must wait() for the sweeper before marking.
+ */
+class Sweeper {
+  private:
+    const Options              &m_options;
+
+    std::mutex                  m_lock;
+    std::condition_variable     m_cond;
+
+    // The work for the current sweep, protected by m_lock.
+    std::vector<ChunkBOP*>      m_chunks_bop;
+    std::vector<ChunkFit*>      m_chunks_fit;
+    bool                        m_busy;
+    bool                        m_stop;
+
+    std::thread                 m_thread;
+
+    void run();
+    void sweep();
+
+  public:
+    explicit Sweeper(const Options &options);
+    ~Sweeper();
+
+    Sweeper(const Sweeper&) = delete;
+    void operator=(const Sweeper&) = delete;
+
+    /*
+     * Begin sweeping these chunks, the previous sweep must have finished.
+     */
+    void start(const std::vector<ChunkBOP*> &chunks_bop,
+        const std::vector<ChunkFit*> &chunks_fit);
+
+    /*
+     * Wait until the current sweep, if any, is finished.
+     */
+    void wait();
+};
+
+} // namespace pz
+
+#endif // ! PZ_GC_SWEEP_H
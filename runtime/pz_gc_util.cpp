@@ -45,6 +45,75 @@ GCCapability::alloc_bytes_meta(size_t size_in_bytes)
     return m_heap->alloc_bytes(size_in_bytes, *this, Heap::META);
 }
 
+void
+GCCapability::write_barrier(void *obj)
+{
+    assert(m_heap);
+    m_heap->write_barrier(obj);
+}
+
+void *
+GCCapability::alloc_precise(size_t size_in_words, PtrMap ptr_map)
+{
+    assert(m_heap);
+    return m_heap->alloc_precise(size_in_words, ptr_map, *this);
+}
+
+AllocBuffer::AllocBuffer(GCCapability &gc_cap) :
+    m_gc_cap(gc_cap),
+    m_remember_stores(false),
+    m_last_remembered(nullptr),
+    m_immortal(nullptr)
+{
+    assert(gc_cap.can_gc());
+    reset();
+    m_gc_cap.heap()->add_alloc_buffer(this);
+}
+
+AllocBuffer::~AllocBuffer()
+{
+    m_gc_cap.heap()->remove_alloc_buffer(this);
+}
+
+void
+AllocBuffer::reset()
+{
+    for (unsigned i = 0; i < Num_Size_Classes; i++) {
+        set_run(i, false, nullptr, nullptr, 0);
+        set_run(i, true, nullptr, nullptr, 0);
+    }
+}
+
+void
+AllocBuffer::remember(void *obj)
+{
+    if (m_gc_cap.heap()->remember(obj)) {
+        m_remembered.push_back(obj);
+        m_last_remembered = obj;
+    }
+}
+
+void
+AllocBuffer::clear_remembered()
+{
+    m_remembered.clear();
+    m_last_remembered = nullptr;
+}
+
+void *
+AllocBuffer::alloc_slow(size_t size_in_words)
+{
+    return m_gc_cap.heap()->alloc(size_in_words, m_gc_cap, Heap::NORMAL,
+            this);
+}
+
+void *
+AllocBuffer::alloc_precise_slow(size_t size_in_words, PtrMap ptr_map)
+{
+    return m_gc_cap.heap()->alloc_precise(size_in_words, ptr_map, m_gc_cap,
+            this);
+}
+
 const AbstractGCTracer&
 GCCapability::tracer() const
 {
@@ -80,7 +149,7 @@ void GCTracer::remove_root(void *root)
 }
 
 NoGCScope::NoGCScope(const GCCapability *gc_cap)
-    : GCCapability(gc_cap->heap())
+    : GCCapability(gc_cap->heap(), gc_cap->immortal())
 #ifdef PZ_DEV
     , m_needs_check(true)
 #endif
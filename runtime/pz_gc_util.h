@@ -12,6 +12,8 @@
 #include <vector>
 
 #include "pz_gc.h"
+#include "pz_gc_immortal.h"
+#include "pz_util.h"
 
 namespace pz {
 
@@ -25,9 +27,11 @@ class AbstractGCTracer;
 class GCCapability {
   private:
     Heap *m_heap;
+    bool  m_immortal;
 
   public:
-    GCCapability(Heap *heap) : m_heap(heap) {}
+    GCCapability(Heap *heap, bool immortal = false) :
+        m_heap(heap), m_immortal(immortal) {}
 
     void * alloc(size_t size_in_words);
     void * alloc_bytes(size_t size_in_bytes);
@@ -37,8 +41,23 @@ class GCCapability {
     void * alloc_meta(size_t size_in_words);
     void * alloc_bytes_meta(size_t size_in_bytes);
 
+    // Allocate an object that is traced precisely using this pointer map.
+    void * alloc_precise(size_t size_in_words, PtrMap ptr_map);
+
+    // Call this after storing a pointer into an object that may have
+    // survived a collection since it was allocated, or that was allocated
+    // during incremental marking and now points to an older object.
+    void write_barrier(void *obj);
+
     Heap * heap() const { return m_heap; }
 
+    /*
+     * An immortal capability allocates in the heap's immortal region, see
+     * pz_gc_immortal.h.  Its objects are never freed and never cause a
+     * collection.  Modules allocate their code and data this way.
+     */
+    bool immortal() const { return m_immortal; }
+
     virtual bool can_gc() const = 0;
 
     // Called by the GC if we couldn't allocate this much memory.
@@ -61,7 +80,7 @@ class GCCapability {
     const AbstractGCTracer& tracer() const;
 
   protected:
-    GCCapability() : m_heap(nullptr) {};
+    GCCapability() : m_heap(nullptr), m_immortal(false) {};
     void set_heap(Heap *heap) {
         assert(!m_heap);
         m_heap = heap;
@@ -77,12 +96,20 @@ class GCCapability {
  */
 class AbstractGCTracer : public GCCapability {
   public:
-    AbstractGCTracer(Heap *heap) : GCCapability(heap) {}
+    AbstractGCTracer(Heap *heap, bool immortal = false) :
+        GCCapability(heap, immortal) {}
 
     virtual bool can_gc() const { return true; }
     virtual void oom(size_t size);
     virtual void do_trace(HeapMarkState*) const = 0;
 
+    /*
+     * The allocation profiler sampled an allocation made with this
+     * capability, it stands for size_bytes of allocation.  Tracers that
+     * know where the program is, such as the interpreter's, record it.
+     */
+    virtual void sample_allocation(size_t size_bytes) const {}
+
   private:
     /*
      * A work-around for PZ
@@ -208,7 +235,8 @@ class NoGCScope : public GCCapability {
 
   public:
     // The constructor may use the tracer to perform an immediate
-    // collection, or if it is a NoGCScope allow the direct nesting.
+    // collection, or if it is a NoGCScope allow the direct nesting.  The
+    // scope is immortal if gc_cap is.
     NoGCScope(const GCCapability *gc_cap);
     virtual ~NoGCScope();
 
@@ -239,6 +267,117 @@ class NoGCScope : public GCCapability {
     void abort_for_oom_slow(const char * label);
 };
 
+/*
+ * An allocation buffer holds a run of free cells for each small size class
+ * so that the thread that owns it can allocate by bumping a pointer.  The
+ * heap refills a run when it is exhausted and empties the buffer at the
+ * start of each collection.  The buffer allocates on behalf of a
+ * GCCapability that must be able to GC.
+ *
+ * The buffer also remembers the objects its thread stores pointers into,
+ * the generational collector scans the old ones during minor collections
+ * and the incremental collector scans the marked ones again.  Stores into
+ * the immortal region are passed on to it.
+ */
+class AllocBuffer {
+  public:
+    // These must match GC_Num_Size_Classes and GC_Small_Alloc_Threshold, a
+    // static assertion in pz_gc_alloc.cpp checks this.
+    static const unsigned Num_Size_Classes = 20;
+    static const size_t Max_Cell_Size = 64;
+
+  private:
+    struct Run {
+        void      **next;
+        void      **end;
+        size_t      cell_size;
+    };
+
+    GCCapability   &m_gc_cap;
+    Run             m_runs[Num_Size_Classes];
+    // Runs of cells for objects with pointer maps.
+    Run             m_precise_runs[Num_Size_Classes];
+
+    // Set by the heap if it's generational or while it marks
+    // incrementally.  Heap::remember() decides which objects are
+    // remembered, consecutive stores into one that is skip the lookup.
+    bool                m_remember_stores;
+    void               *m_last_remembered;
+    std::vector<void*>  m_remembered;
+
+    // Set by the heap.
+    ImmortalRegion     *m_immortal;
+
+    // Map an allocation size in words to its size class.
+    static const uint8_t s_size_classes[Max_Cell_Size + 1];
+
+    void * alloc_slow(size_t size_in_words);
+    void * alloc_precise_slow(size_t size_in_words, PtrMap ptr_map);
+
+    void set_run(unsigned size_class, bool precise, void **next,
+            void **end, size_t cell_size)
+    {
+        Run &run = precise ? m_precise_runs[size_class] : m_runs[size_class];
+        run.next = next;
+        run.end = end;
+        run.cell_size = cell_size;
+    }
+
+    void reset();
+    void remember(void *obj);
+    void clear_remembered();
+
+    friend class Heap;
+
+  public:
+    explicit AllocBuffer(GCCapability &gc_cap);
+    ~AllocBuffer();
+
+    AllocBuffer(const AllocBuffer&) = delete;
+    void operator=(const AllocBuffer&) = delete;
+
+    void * alloc(size_t size_in_words) {
+        if (size_in_words <= Max_Cell_Size) {
+            Run &run = m_runs[s_size_classes[size_in_words]];
+            if (run.next < run.end) {
+                void **cell = run.next;
+                run.next += run.cell_size;
+                return cell;
+            }
+        }
+        return alloc_slow(size_in_words);
+    }
+
+    void * alloc_bytes(size_t size_in_bytes) {
+        return alloc((size_in_bytes + WORDSIZE_BYTES - 1) / WORDSIZE_BYTES);
+    }
+
+    void write_barrier(void *obj) {
+        if (m_remember_stores && obj != m_last_remembered) {
+            remember(obj);
+        }
+        if (m_immortal->may_contain(obj)) {
+            m_immortal->write_barrier(obj);
+        }
+    }
+
+    /*
+     * The pointer map is stored in the last word of the cell, which is
+     * always past the end of the object.
+     */
+    void * alloc_precise(size_t size_in_words, PtrMap ptr_map) {
+        assert(size_in_words <= GC_Max_Precise_Words);
+        Run &run = m_precise_runs[s_size_classes[size_in_words + 1]];
+        if (run.next < run.end) {
+            void **cell = run.next;
+            run.next += run.cell_size;
+            cell[run.cell_size - 1] = reinterpret_cast<void*>(ptr_map);
+            return cell;
+        }
+        return alloc_precise_slow(size_in_words, ptr_map);
+    }
+};
+
 class GCNew {
   public:
     /*
@@ -246,6 +385,10 @@ class GCNew {
      * GC returns null, which it can only do in a NoGCScope.
      */
     void* operator new(size_t size, GCCapability &gc_cap);
+
+    void* operator new(size_t size, AllocBuffer &buffer) {
+        return buffer.alloc_bytes(size);
+    }
     // We don't need a placement-delete or regular-delete because we use GC.
 };
 
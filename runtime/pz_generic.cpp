@@ -43,6 +43,7 @@ run(PZ &pz, const Options &options)
     assert(PZT_LAST_TOKEN < 256);
 
     Context context(pz.heap());
+    context.alloc_profiler = pz.alloc_profiler();
 
     /*
      * Assemble a special procedure that exits the interpreter and put its
@@ -93,7 +94,9 @@ Context::Context(Heap *heap) :
         ip(nullptr),
         env(nullptr),
         rsp(0),
-        esp(0)
+        esp(0),
+        alloc_buffer(*this),
+        alloc_profiler(nullptr)
 {
     return_stack = new uint8_t*[RETURN_STACK_SIZE];
     expr_stack = new StackValue[EXPR_STACK_SIZE];
@@ -125,4 +128,20 @@ Context::do_trace(HeapMarkState *state) const
     state->mark_root(env);
 }
 
+void
+Context::sample_allocation(size_t size_bytes) const
+{
+    if (!alloc_profiler) return;
+
+    /*
+     * The return stack holds an environment and a return address for each
+     * call, above the wrapper procedure at index 1 that ends the program.
+     */
+    for (unsigned i = 3; i <= rsp; i += 2) {
+        alloc_profiler->add_frame(return_stack[i]);
+    }
+    alloc_profiler->add_frame(ip);
+    alloc_profiler->end_sample(size_bytes);
+}
+
 }
@@ -158,6 +158,8 @@ write_instr(uint8_t       *proc,
 
     PZ_WRITE_INSTR_0(PZI_ALLOC,        PZT_ALLOC);
     PZ_WRITE_INSTR_0(PZI_MAKE_CLOSURE, PZT_MAKE_CLOSURE);
+    PZ_WRITE_INSTR_0(PZI_MAKE_CLOSURE_IN_PLACE,
+            PZT_MAKE_CLOSURE_IN_PLACE);
 
     PZ_WRITE_INSTR_0(PZI_LOAD_NAMED,   PZT_LOAD_PTR);
 
@@ -404,10 +406,18 @@ write_opcode(uint8_t           *proc,
              unsigned           offset,
              InstructionToken   token)
 {
+#ifdef PZ_THREADED_DISPATCH
+    offset = AlignUp(offset, WORDSIZE_BYTES);
+    if (proc != nullptr) {
+        *((void **)(&proc[offset])) = generic_handler(token);
+    }
+    offset += WORDSIZE_BYTES;
+#else
     if (proc != nullptr) {
         *((uint8_t *)(&proc[offset])) = token;
     }
     offset += 1;
+#endif
     return offset;
 }
 
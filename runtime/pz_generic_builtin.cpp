@@ -126,24 +126,46 @@ pz_builtin_die_func(void *void_stack, unsigned sp)
     exit(1);
 }
 
+/*
+ * Parameters are 32 bit signed values, so values that don't fit, like a
+ * heap_max_size of 2GB or more, read as the nearest value that does.
+ * heap_max_size_kb sets and reads the same limit in kilobytes, for heaps
+ * that large.
+ */
+static int32_t
+saturate_s32(int64_t value)
+{
+    if (value > INT32_MAX) return INT32_MAX;
+    if (value < INT32_MIN) return INT32_MIN;
+    return value;
+}
+
+static int32_t
+saturate_size(size_t value)
+{
+    return value > size_t(INT32_MAX) ? INT32_MAX : value;
+}
+
 unsigned
 pz_builtin_set_parameter_func(void *void_stack, unsigned sp, PZ &pz)
 {
     StackValue *stack = static_cast<StackValue*>(void_stack);
 
-    // int32_t value = stack[sp].s32;
+    int32_t value = stack[sp].s32;
     const char *name = (const char *)stack[sp-1].ptr;
     int32_t result;
 
-    /*
-     * There are no parameters defined but here's how we might define one.
     if (0 == strcmp(name, "heap_max_size")) {
-        result = heap_set_max_size(pz.heap(), value);
+        result = value >= 0 && heap_set_max_size(pz.heap(), value);
+    } else if (0 == strcmp(name, "heap_max_size_kb")) {
+        result = value >= 0 && size_t(value) <= SIZE_MAX / 1024 &&
+            heap_set_max_size(pz.heap(), size_t(value) * 1024);
+    } else if (0 == strcmp(name, "gc_cpu_target")) {
+        result = value >= 0 && heap_set_gc_cpu_target(pz.heap(), value);
     } else {
-    */
         fprintf(stderr, "No such parameter '%s'\n", name);
         result = 0;
-    //}
+    }
 
     sp--;
     stack[sp].sptr = result;
@@ -159,12 +181,25 @@ pz_builtin_get_parameter_func(void *void_stack, unsigned sp, PZ &pz)
     const char *name = (const char *)stack[sp].ptr;
     int32_t result;
     int32_t value;
+    int64_t stat;
 
     if (0 == strcmp(name, "heap_usage")) {
-        value = heap_get_usage(pz.heap());
+        value = saturate_size(heap_get_usage(pz.heap()));
         result = 1;
     } else if (0 == strcmp(name, "heap_collections")) {
-        value = heap_get_collections(pz.heap());
+        value = saturate_s32(heap_get_collections(pz.heap()));
+        result = 1;
+    } else if (0 == strcmp(name, "heap_max_size")) {
+        value = saturate_size(heap_get_max_size(pz.heap()));
+        result = 1;
+    } else if (0 == strcmp(name, "heap_max_size_kb")) {
+        value = saturate_size(heap_get_max_size(pz.heap()) / 1024);
+        result = 1;
+    } else if (0 == strcmp(name, "gc_cpu_target")) {
+        value = heap_get_gc_cpu_target(pz.heap());
+        result = 1;
+    } else if (heap_get_stat(pz.heap(), name, &stat)) {
+        value = saturate_s32(stat);
         result = 1;
     } else {
         fprintf(stderr, "No such parameter '%s'.\n", name);
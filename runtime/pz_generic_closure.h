@@ -32,6 +32,18 @@ class Closure : public GCNew {
 
     void* code() const { return m_code; }
     void* data() const { return m_data; }
+
+    /*
+     * Make a closure at the start of its own environment, which must be a
+     * struct laid out by Struct::make_closure_env().  The closure's data
+     * is the environment, that is the closure itself.
+     */
+    static Closure * make_in_place(void *env, void *code) {
+        Closure *closure = static_cast<Closure*>(env);
+        closure->m_code = code;
+        closure->m_data = env;
+        return closure;
+    }
 };
 
 }
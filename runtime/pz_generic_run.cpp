@@ -15,161 +15,231 @@
 
 #include <stdio.h>
 
+#include <algorithm>
+#include <iterator>
+
 #include "pz_generic_closure.h"
 #include "pz_generic_run.h"
 
 namespace pz {
 
-int
-generic_main_loop(Context   &context,
-                  Heap      *heap,
-                  Closure   *closure,
-                  PZ        &pz)
+/*
+ * Each handler begins with PZ_CASE(token) and ends with PZ_NEXT.  In the
+ * threaded build instructions begin on word boundaries, the builder pads
+ * the code before each handler's address, so PZ_NEXT aligns ip before
+ * reading the next one.  Jumps and calls may leave ip at the start of
+ * that padding.  Development builds check that it is a handler's address,
+ * as the portable build's default case checks the token.
+ */
+#ifdef PZ_THREADED_DISPATCH
+#define PZ_CASE(token) handler_##token
+#ifdef PZ_DEV
+#define PZ_CHECK_HANDLER(handler)                                        \
+    if (std::find(std::begin(handlers), std::end(handlers), *(handler))  \
+            == std::end(handlers))                                       \
+    {                                                                    \
+        fprintf(stderr, "Unknown opcode\n");                             \
+        abort();                                                         \
+    }
+#else
+#define PZ_CHECK_HANDLER(handler)
+#endif
+#define PZ_DISPATCH                                                      \
+    do {                                                                 \
+        void **handler = (void **)AlignUp((size_t)context.ip,            \
+                WORDSIZE_BYTES);                                         \
+        PZ_CHECK_HANDLER(handler)                                        \
+        context.ip = (uint8_t *)(handler + 1);                           \
+        goto **handler;                                                  \
+    } while (0)
+#define PZ_NEXT                                                          \
+    pz_trace_state(heap, context.ip, context.rsp, context.esp,           \
+            (uint64_t *)context.expr_stack);                             \
+    PZ_DISPATCH
+#else
+#define PZ_CASE(token) case token
+#define PZ_NEXT break
+#endif
+
+/*
+ * Run the program, or if handlers_out is non-null return the table of
+ * handlers through it.
+ */
+static int
+main_loop(Context        *context_,
+          Heap           *heap,
+          Closure        *closure,
+          PZ             *pz_,
+          void * const  **handlers_out)
 {
-    int retcode;
+#ifdef PZ_THREADED_DISPATCH
+#define PZ_HANDLER_ADDRESS(token) &&PZ_CASE(token),
+    static void * const handlers[] = {
+        PZ_INSTRUCTION_TOKENS(PZ_HANDLER_ADDRESS)
+    };
+#undef PZ_HANDLER_ADDRESS
+    if (handlers_out) {
+        *handlers_out = handlers;
+        return 0;
+    }
+#else
+    assert(!handlers_out);
+#endif
+
+    Context &context = *context_;
+    PZ      &pz = *pz_;
+    int      retcode;
+
     context.ip = static_cast<uint8_t*>(closure->code());
     context.env = closure->data();
 
     pz_trace_state(heap, context.ip, context.rsp, context.esp,
             (uint64_t *)context.expr_stack);
+#ifdef PZ_THREADED_DISPATCH
+    // These braces stand in for the portable build's loop and switch.
+    PZ_DISPATCH;
+    {
+        {
+#else
     while (true) {
         InstructionToken token = (InstructionToken)(*(context.ip));
 
         context.ip++;
         switch (token) {
-            case PZT_NOP:
+#endif
+            PZ_CASE(PZT_NOP):
                 pz_trace_instr(context.rsp, "nop");
-                break;
-            case PZT_LOAD_IMMEDIATE_8:
+                PZ_NEXT;
+            PZ_CASE(PZT_LOAD_IMMEDIATE_8):
                 context.expr_stack[++context.esp].u8 = *context.ip;
                 context.ip++;
                 pz_trace_instr(context.rsp, "load imm:8");
-                break;
-            case PZT_LOAD_IMMEDIATE_16:
+                PZ_NEXT;
+            PZ_CASE(PZT_LOAD_IMMEDIATE_16):
                 context.ip = (uint8_t *)AlignUp((size_t)context.ip, 2);
                 context.expr_stack[++context.esp].u16 = *(uint16_t *)context.ip;
                 context.ip += 2;
                 pz_trace_instr(context.rsp, "load imm:16");
-                break;
-            case PZT_LOAD_IMMEDIATE_32:
+                PZ_NEXT;
+            PZ_CASE(PZT_LOAD_IMMEDIATE_32):
                 context.ip = (uint8_t *)AlignUp((size_t)context.ip, 4);
                 context.expr_stack[++context.esp].u32 = *(uint32_t *)context.ip;
                 context.ip += 4;
                 pz_trace_instr(context.rsp, "load imm:32");
-                break;
-            case PZT_LOAD_IMMEDIATE_64:
+                PZ_NEXT;
+            PZ_CASE(PZT_LOAD_IMMEDIATE_64):
                 context.ip = (uint8_t *)AlignUp((size_t)context.ip, 8);
                 context.expr_stack[++context.esp].u64 = *(uint64_t *)context.ip;
                 context.ip += 8;
                 pz_trace_instr(context.rsp, "load imm:64");
-                break;
-            case PZT_ZE_8_16:
+                PZ_NEXT;
+            PZ_CASE(PZT_ZE_8_16):
                 context.expr_stack[context.esp].u16 =
                     context.expr_stack[context.esp].u8;
                 pz_trace_instr(context.rsp, "ze:8:16");
-                break;
-            case PZT_ZE_8_32:
+                PZ_NEXT;
+            PZ_CASE(PZT_ZE_8_32):
                 context.expr_stack[context.esp].u32 =
                     context.expr_stack[context.esp].u8;
                 pz_trace_instr(context.rsp, "ze:8:32");
-                break;
-            case PZT_ZE_8_64:
+                PZ_NEXT;
+            PZ_CASE(PZT_ZE_8_64):
                 context.expr_stack[context.esp].u64 =
                     context.expr_stack[context.esp].u8;
                 pz_trace_instr(context.rsp, "ze:8:64");
-                break;
-            case PZT_ZE_16_32:
+                PZ_NEXT;
+            PZ_CASE(PZT_ZE_16_32):
                 context.expr_stack[context.esp].u32 =
                     context.expr_stack[context.esp].u16;
                 pz_trace_instr(context.rsp, "ze:16:32");
-                break;
-            case PZT_ZE_16_64:
+                PZ_NEXT;
+            PZ_CASE(PZT_ZE_16_64):
                 context.expr_stack[context.esp].u64 =
                     context.expr_stack[context.esp].u16;
                 pz_trace_instr(context.rsp, "ze:16:64");
-                break;
-            case PZT_ZE_32_64:
+                PZ_NEXT;
+            PZ_CASE(PZT_ZE_32_64):
                 context.expr_stack[context.esp].u64 =
                     context.expr_stack[context.esp].u32;
                 pz_trace_instr(context.rsp, "ze:32:64");
-                break;
-            case PZT_SE_8_16:
+                PZ_NEXT;
+            PZ_CASE(PZT_SE_8_16):
                 context.expr_stack[context.esp].s16 =
                     context.expr_stack[context.esp].s8;
                 pz_trace_instr(context.rsp, "se:8:16");
-                break;
-            case PZT_SE_8_32:
+                PZ_NEXT;
+            PZ_CASE(PZT_SE_8_32):
                 context.expr_stack[context.esp].s32 =
                     context.expr_stack[context.esp].s8;
                 pz_trace_instr(context.rsp, "se:8:32");
-                break;
-            case PZT_SE_8_64:
+                PZ_NEXT;
+            PZ_CASE(PZT_SE_8_64):
                 context.expr_stack[context.esp].s64 =
                     context.expr_stack[context.esp].s8;
                 pz_trace_instr(context.rsp, "se:8:64");
-                break;
-            case PZT_SE_16_32:
+                PZ_NEXT;
+            PZ_CASE(PZT_SE_16_32):
                 context.expr_stack[context.esp].s32 =
                     context.expr_stack[context.esp].s16;
                 pz_trace_instr(context.rsp, "se:16:32");
-                break;
-            case PZT_SE_16_64:
+                PZ_NEXT;
+            PZ_CASE(PZT_SE_16_64):
                 context.expr_stack[context.esp].s64 =
                     context.expr_stack[context.esp].s16;
                 pz_trace_instr(context.rsp, "se:16:64");
-                break;
-            case PZT_SE_32_64:
+                PZ_NEXT;
+            PZ_CASE(PZT_SE_32_64):
                 context.expr_stack[context.esp].s64 =
                     context.expr_stack[context.esp].s32;
                 pz_trace_instr(context.rsp, "se:32:64");
-                break;
-            case PZT_TRUNC_64_32:
+                PZ_NEXT;
+            PZ_CASE(PZT_TRUNC_64_32):
                 context.expr_stack[context.esp].u32 =
                     context.expr_stack[context.esp].u64 & 0xFFFFFFFFu;
                 pz_trace_instr(context.rsp, "trunc:64:32");
-                break;
-            case PZT_TRUNC_64_16:
+                PZ_NEXT;
+            PZ_CASE(PZT_TRUNC_64_16):
                 context.expr_stack[context.esp].u16 =
                     context.expr_stack[context.esp].u64 & 0xFFFF;
                 pz_trace_instr(context.rsp, "trunc:64:16");
-                break;
-            case PZT_TRUNC_64_8:
+                PZ_NEXT;
+            PZ_CASE(PZT_TRUNC_64_8):
                 context.expr_stack[context.esp].u8 =
                     context.expr_stack[context.esp].u64 & 0xFF;
                 pz_trace_instr(context.rsp, "trunc:64:8");
-                break;
-            case PZT_TRUNC_32_16:
+                PZ_NEXT;
+            PZ_CASE(PZT_TRUNC_32_16):
                 context.expr_stack[context.esp].u16 =
                     context.expr_stack[context.esp].u32 & 0xFFFF;
                 pz_trace_instr(context.rsp, "trunc:32:16");
-                break;
-            case PZT_TRUNC_32_8:
+                PZ_NEXT;
+            PZ_CASE(PZT_TRUNC_32_8):
                 context.expr_stack[context.esp].u8 =
                     context.expr_stack[context.esp].u32 & 0xFF;
                 pz_trace_instr(context.rsp, "trunc:32:8");
-                break;
-            case PZT_TRUNC_16_8:
+                PZ_NEXT;
+            PZ_CASE(PZT_TRUNC_16_8):
                 context.expr_stack[context.esp].u8 =
                     context.expr_stack[context.esp].u16 & 0xFF;
                 pz_trace_instr(context.rsp, "trunc:16:8");
-                break;
+                PZ_NEXT;
 
 #define PZ_RUN_ARITHMETIC(opcode_base, width, signedness, operator,         \
                           op_name)                                          \
-    case opcode_base##_##width:                                             \
+    PZ_CASE(opcode_base##_##width):                                         \
         context.expr_stack[context.esp - 1].signedness##width =             \
                 (context.expr_stack[context.esp - 1].signedness##width      \
             operator context.expr_stack[context.esp].signedness##width);    \
         context.esp--;                                                      \
         pz_trace_instr(context.rsp, op_name);                               \
-        break
+        PZ_NEXT
 #define PZ_RUN_ARITHMETIC1(opcode_base, width, signedness, operator,        \
                            op_name)                                         \
-    case opcode_base##_##width:                                             \
+    PZ_CASE(opcode_base##_##width):                                         \
         context.expr_stack[context.esp].signedness##width =                 \
                 operator context.expr_stack[context.esp].signedness##width; \
         pz_trace_instr(context.rsp, op_name);                               \
-        break
+        PZ_NEXT
 
                 PZ_RUN_ARITHMETIC(PZT_ADD, 8, s, +, "add:8");
                 PZ_RUN_ARITHMETIC(PZT_ADD, 16, s, +, "add:16");
@@ -232,13 +302,13 @@ generic_main_loop(Context   &context,
 #undef PZ_RUN_ARITHMETIC1
 
 #define PZ_RUN_SHIFT(opcode_base, width, operator, op_name)           \
-    case opcode_base##_##width:                                       \
+    PZ_CASE(opcode_base##_##width):                                   \
         context.expr_stack[context.esp - 1].u##width =                \
           (context.expr_stack[context.esp - 1].u##width operator      \
             context.expr_stack[context.esp].u8);                      \
         context.esp--;                                                \
         pz_trace_instr(context.rsp, op_name);                         \
-        break
+        PZ_NEXT
 
                 PZ_RUN_SHIFT(PZT_LSHIFT, 8, <<, "lshift:8");
                 PZ_RUN_SHIFT(PZT_LSHIFT, 16, <<, "lshift:16");
@@ -251,26 +321,26 @@ generic_main_loop(Context   &context,
 
 #undef PZ_RUN_SHIFT
 
-            case PZT_DUP:
+            PZ_CASE(PZT_DUP):
                 context.esp++;
                 context.expr_stack[context.esp] =
                     context.expr_stack[context.esp - 1];
                 pz_trace_instr(context.rsp, "dup");
-                break;
-            case PZT_DROP:
+                PZ_NEXT;
+            PZ_CASE(PZT_DROP):
                 context.esp--;
                 pz_trace_instr(context.rsp, "drop");
-                break;
-            case PZT_SWAP: {
+                PZ_NEXT;
+            PZ_CASE(PZT_SWAP): {
                 StackValue temp;
                 temp = context.expr_stack[context.esp];
                 context.expr_stack[context.esp] =
                     context.expr_stack[context.esp - 1];
                 context.expr_stack[context.esp - 1] = temp;
                 pz_trace_instr(context.rsp, "swap");
-                break;
+                PZ_NEXT;
             }
-            case PZT_ROLL: {
+            PZ_CASE(PZT_ROLL): {
                 uint8_t     depth = *context.ip;
                 StackValue  temp;
                 context.ip++;
@@ -294,9 +364,9 @@ generic_main_loop(Context   &context,
                         context.expr_stack[context.esp] = temp;
                 }
                 pz_trace_instr2(context.rsp, "roll", depth + 1);
-                break;
+                PZ_NEXT;
             }
-            case PZT_PICK: {
+            PZ_CASE(PZT_PICK): {
                 /*
                  * As with PZT_ROLL we would subract 1 here, but we also
                  * have to add 1 because we increment the stack pointer
@@ -308,9 +378,9 @@ generic_main_loop(Context   &context,
                 context.expr_stack[context.esp] =
                     context.expr_stack[context.esp - depth];
                 pz_trace_instr2(context.rsp, "pick", depth);
-                break;
+                PZ_NEXT;
             }
-            case PZT_CALL: {
+            PZ_CASE(PZT_CALL): {
                 pz::Closure *closure;
 
                 context.ip = (uint8_t *)AlignUp((size_t)context.ip,
@@ -324,9 +394,9 @@ generic_main_loop(Context   &context,
                 context.env = closure->data();
 
                 pz_trace_instr(context.rsp, "call");
-                break;
+                PZ_NEXT;
             }
-            case PZT_CALL_IND: {
+            PZ_CASE(PZT_CALL_IND): {
                 pz::Closure *closure;
 
                 context.return_stack[++context.rsp] =
@@ -338,9 +408,9 @@ generic_main_loop(Context   &context,
                 context.env = closure->data();
 
                 pz_trace_instr(context.rsp, "call_ind");
-                break;
+                PZ_NEXT;
             }
-            case PZT_CALL_PROC:
+            PZ_CASE(PZT_CALL_PROC):
                 context.ip = (uint8_t *)AlignUp((size_t)context.ip,
                         WORDSIZE_BYTES);
                 context.return_stack[++context.rsp] =
@@ -349,8 +419,8 @@ generic_main_loop(Context   &context,
                         context.ip + WORDSIZE_BYTES;
                 context.ip = *(uint8_t **)context.ip;
                 pz_trace_instr(context.rsp, "call_proc");
-                break;
-            case PZT_TCALL: {
+                PZ_NEXT;
+            PZ_CASE(PZT_TCALL): {
                 pz::Closure *closure;
 
                 context.ip = (uint8_t *)AlignUp((size_t)context.ip,
@@ -360,9 +430,9 @@ generic_main_loop(Context   &context,
                 context.env = closure->data();
 
                 pz_trace_instr(context.rsp, "tcall");
-                break;
+                PZ_NEXT;
             }
-            case PZT_TCALL_IND: {
+            PZ_CASE(PZT_TCALL_IND): {
                 pz::Closure *closure;
 
                 closure = (pz::Closure *)context.expr_stack[context.esp--].ptr;
@@ -370,15 +440,15 @@ generic_main_loop(Context   &context,
                 context.env = closure->data();
 
                 pz_trace_instr(context.rsp, "call_ind");
-                break;
+                PZ_NEXT;
             }
-            case PZT_TCALL_PROC:
+            PZ_CASE(PZT_TCALL_PROC):
                 context.ip = (uint8_t *)AlignUp((size_t)context.ip,
                         WORDSIZE_BYTES);
                 context.ip = *(uint8_t **)context.ip;
                 pz_trace_instr(context.rsp, "tcall_proc");
-                break;
-            case PZT_CJMP_8:
+                PZ_NEXT;
+            PZ_CASE(PZT_CJMP_8):
                 context.ip = (uint8_t *)AlignUp((size_t)context.ip,
                         WORDSIZE_BYTES);
                 if (context.expr_stack[context.esp--].u8) {
@@ -388,8 +458,8 @@ generic_main_loop(Context   &context,
                     context.ip += WORDSIZE_BYTES;
                     pz_trace_instr(context.rsp, "cjmp:8 not taken");
                 }
-                break;
-            case PZT_CJMP_16:
+                PZ_NEXT;
+            PZ_CASE(PZT_CJMP_16):
                 context.ip = (uint8_t *)AlignUp((size_t)context.ip,
                         WORDSIZE_BYTES);
                 if (context.expr_stack[context.esp--].u16) {
@@ -399,8 +469,8 @@ generic_main_loop(Context   &context,
                     context.ip += WORDSIZE_BYTES;
                     pz_trace_instr(context.rsp, "cjmp:16 not taken");
                 }
-                break;
-            case PZT_CJMP_32:
+                PZ_NEXT;
+            PZ_CASE(PZT_CJMP_32):
                 context.ip = (uint8_t *)AlignUp((size_t)context.ip,
                         WORDSIZE_BYTES);
                 if (context.expr_stack[context.esp--].u32) {
@@ -410,8 +480,8 @@ generic_main_loop(Context   &context,
                     context.ip += WORDSIZE_BYTES;
                     pz_trace_instr(context.rsp, "cjmp:32 not taken");
                 }
-                break;
-            case PZT_CJMP_64:
+                PZ_NEXT;
+            PZ_CASE(PZT_CJMP_64):
                 context.ip = (uint8_t *)AlignUp((size_t)context.ip,
                         WORDSIZE_BYTES);
                 if (context.expr_stack[context.esp--].u64) {
@@ -421,34 +491,31 @@ generic_main_loop(Context   &context,
                     context.ip += WORDSIZE_BYTES;
                     pz_trace_instr(context.rsp, "cjmp:64 not taken");
                 }
-                break;
-            case PZT_JMP:
+                PZ_NEXT;
+            PZ_CASE(PZT_JMP):
                 context.ip = (uint8_t *)AlignUp((size_t)context.ip,
                         WORDSIZE_BYTES);
                 context.ip = *(uint8_t **)context.ip;
                 pz_trace_instr(context.rsp, "jmp");
-                break;
-            case PZT_RET:
+                PZ_NEXT;
+            PZ_CASE(PZT_RET):
                 context.ip = context.return_stack[context.rsp--];
                 context.env = context.return_stack[context.rsp--];
                 pz_trace_instr(context.rsp, "ret");
-                break;
-            case PZT_ALLOC: {
-                size_t    size;
-                void     *addr;
+                PZ_NEXT;
+            PZ_CASE(PZT_ALLOC): {
+                const Struct *struct_;
+                void         *addr;
                 context.ip = (uint8_t *)AlignUp((size_t)context.ip,
                         WORDSIZE_BYTES);
-                size = *(size_t *)context.ip;
+                struct_ = *(const Struct **)context.ip;
                 context.ip += WORDSIZE_BYTES;
-                // pz_gc_alloc uses size in machine words, round the value
-                // up and convert it to words rather than bytes.
-                addr = context.alloc(
-                        (size+WORDSIZE_BYTES-1) / WORDSIZE_BYTES);
+                addr = data_new_struct_data(context.alloc_buffer, struct_);
                 context.expr_stack[++context.esp].ptr = addr;
                 pz_trace_instr(context.rsp, "alloc");
-                break;
+                PZ_NEXT;
             }
-            case PZT_MAKE_CLOSURE: {
+            PZ_CASE(PZT_MAKE_CLOSURE): {
                 void       *code, *data;
 
                 context.ip = (uint8_t *)AlignUp((size_t)context.ip,
@@ -456,13 +523,30 @@ generic_main_loop(Context   &context,
                 code = *(void**)context.ip;
                 context.ip = (context.ip + WORDSIZE_BYTES);
                 data = context.expr_stack[context.esp].ptr;
-                Closure *closure = new(context)
+                Closure *closure = new(context.alloc_buffer)
                     Closure(static_cast<uint8_t*>(code), data);
+                // The closure may be allocated marked, during incremental
+                // marking, and the data may not be.
+                context.alloc_buffer.write_barrier(closure);
                 context.expr_stack[context.esp].ptr = closure;
                 pz_trace_instr(context.rsp, "make_closure");
-                break;
+                PZ_NEXT;
+            }
+            PZ_CASE(PZT_MAKE_CLOSURE_IN_PLACE): {
+                void       *code;
+
+                context.ip = (uint8_t *)AlignUp((size_t)context.ip,
+                        WORDSIZE_BYTES);
+                code = *(void**)context.ip;
+                context.ip = (context.ip + WORDSIZE_BYTES);
+                Closure *closure = Closure::make_in_place(
+                        context.expr_stack[context.esp].ptr, code);
+                context.alloc_buffer.write_barrier(closure);
+                context.expr_stack[context.esp].ptr = closure;
+                pz_trace_instr(context.rsp, "make_closure_in_place");
+                PZ_NEXT;
             }
-            case PZT_LOAD_8: {
+            PZ_CASE(PZT_LOAD_8): {
                 uint16_t offset;
                 void *   addr;
                 context.ip = (uint8_t *)AlignUp((size_t)context.ip, 2);
@@ -475,9 +559,9 @@ generic_main_loop(Context   &context,
                 context.expr_stack[context.esp].u8 = *(uint8_t *)addr;
                 context.esp++;
                 pz_trace_instr(context.rsp, "load_8");
-                break;
+                PZ_NEXT;
             }
-            case PZT_LOAD_16: {
+            PZ_CASE(PZT_LOAD_16): {
                 uint16_t offset;
                 void *   addr;
                 context.ip = (uint8_t *)AlignUp((size_t)context.ip, 2);
@@ -490,9 +574,9 @@ generic_main_loop(Context   &context,
                 context.expr_stack[context.esp].u16 = *(uint16_t *)addr;
                 context.esp++;
                 pz_trace_instr(context.rsp, "load_16");
-                break;
+                PZ_NEXT;
             }
-            case PZT_LOAD_32: {
+            PZ_CASE(PZT_LOAD_32): {
                 uint16_t offset;
                 void *   addr;
                 context.ip = (uint8_t *)AlignUp((size_t)context.ip, 2);
@@ -505,9 +589,9 @@ generic_main_loop(Context   &context,
                 context.expr_stack[context.esp].u32 = *(uint32_t *)addr;
                 context.esp++;
                 pz_trace_instr(context.rsp, "load_32");
-                break;
+                PZ_NEXT;
             }
-            case PZT_LOAD_64: {
+            PZ_CASE(PZT_LOAD_64): {
                 uint16_t offset;
                 void *   addr;
                 context.ip = (uint8_t *)AlignUp((size_t)context.ip, 2);
@@ -520,9 +604,9 @@ generic_main_loop(Context   &context,
                 context.expr_stack[context.esp].u64 = *(uint64_t *)addr;
                 context.esp++;
                 pz_trace_instr(context.rsp, "load_64");
-                break;
+                PZ_NEXT;
             }
-            case PZT_LOAD_PTR: {
+            PZ_CASE(PZT_LOAD_PTR): {
                 uint16_t offset;
                 void *   addr;
                 context.ip = (uint8_t *)AlignUp((size_t)context.ip, 2);
@@ -535,9 +619,9 @@ generic_main_loop(Context   &context,
                 context.expr_stack[context.esp].ptr = *(void **)addr;
                 context.esp++;
                 pz_trace_instr(context.rsp, "load_ptr");
-                break;
+                PZ_NEXT;
             }
-            case PZT_STORE_8: {
+            PZ_CASE(PZT_STORE_8): {
                 uint16_t offset;
                 void *   addr;
                 context.ip = (uint8_t *)AlignUp((size_t)context.ip, 2);
@@ -550,9 +634,9 @@ generic_main_loop(Context   &context,
                     context.expr_stack[context.esp].ptr;
                 context.esp--;
                 pz_trace_instr(context.rsp, "store_8");
-                break;
+                PZ_NEXT;
             }
-            case PZT_STORE_16: {
+            PZ_CASE(PZT_STORE_16): {
                 uint16_t offset;
                 void *   addr;
                 context.ip = (uint8_t *)AlignUp((size_t)context.ip, 2);
@@ -565,9 +649,9 @@ generic_main_loop(Context   &context,
                     context.expr_stack[context.esp].ptr;
                 context.esp--;
                 pz_trace_instr(context.rsp, "store_16");
-                break;
+                PZ_NEXT;
             }
-            case PZT_STORE_32: {
+            PZ_CASE(PZT_STORE_32): {
                 uint16_t offset;
                 void *   addr;
                 context.ip = (uint8_t *)AlignUp((size_t)context.ip, 2);
@@ -576,13 +660,17 @@ generic_main_loop(Context   &context,
                 /* (* ptr - ptr) */
                 addr = (uint8_t*)context.expr_stack[context.esp].ptr + offset;
                 *(uint32_t *)addr = context.expr_stack[context.esp - 1].u32;
+                if (WORDSIZE_BYTES == 4) {
+                    context.alloc_buffer.write_barrier(
+                            context.expr_stack[context.esp].ptr);
+                }
                 context.expr_stack[context.esp - 1].ptr =
                     context.expr_stack[context.esp].ptr;
                 context.esp--;
                 pz_trace_instr(context.rsp, "store_32");
-                break;
+                PZ_NEXT;
             }
-            case PZT_STORE_64: {
+            PZ_CASE(PZT_STORE_64): {
                 uint16_t offset;
                 void *   addr;
                 context.ip = (uint8_t *)AlignUp((size_t)context.ip, 2);
@@ -591,19 +679,21 @@ generic_main_loop(Context   &context,
                 /* (* ptr - ptr) */
                 addr = (uint8_t*)context.expr_stack[context.esp].ptr + offset;
                 *(uint64_t *)addr = context.expr_stack[context.esp - 1].u64;
+                context.alloc_buffer.write_barrier(
+                        context.expr_stack[context.esp].ptr);
                 context.expr_stack[context.esp - 1].ptr =
                     context.expr_stack[context.esp].ptr;
                 context.esp--;
                 pz_trace_instr(context.rsp, "store_64");
-                break;
+                PZ_NEXT;
             }
-            case PZT_GET_ENV: {
+            PZ_CASE(PZT_GET_ENV): {
                 context.expr_stack[++context.esp].ptr = context.env;
                 pz_trace_instr(context.rsp, "get_env");
-                break;
+                PZ_NEXT;
             }
 
-            case PZT_END:
+            PZ_CASE(PZT_END):
                 retcode = context.expr_stack[context.esp].s32;
                 if (context.esp != 1) {
                     fprintf(stderr, "Stack misaligned, esp: %d should be 1\n",
@@ -614,7 +704,7 @@ generic_main_loop(Context   &context,
                 pz_trace_state(heap, context.ip, context.rsp, context.esp,
                         (uint64_t *)context.expr_stack);
                 return retcode;
-            case PZT_CCALL: {
+            PZ_CASE(PZT_CCALL): {
                 pz_builtin_c_func callee;
                 context.ip = (uint8_t *)AlignUp((size_t)context.ip,
                         WORDSIZE_BYTES);
@@ -622,9 +712,9 @@ generic_main_loop(Context   &context,
                 context.esp = callee(context.expr_stack, context.esp);
                 context.ip += WORDSIZE_BYTES;
                 pz_trace_instr(context.rsp, "ccall");
-                break;
+                PZ_NEXT;
             }
-            case PZT_CCALL_ALLOC: {
+            PZ_CASE(PZT_CCALL_ALLOC): {
                 pz_builtin_c_alloc_func callee;
                 context.ip = (uint8_t *)AlignUp((size_t)context.ip,
                         WORDSIZE_BYTES);
@@ -632,9 +722,9 @@ generic_main_loop(Context   &context,
                 context.esp = callee(context.expr_stack, context.esp, context);
                 context.ip += WORDSIZE_BYTES;
                 pz_trace_instr(context.rsp, "ccall");
-                break;
+                PZ_NEXT;
             }
-            case PZT_CCALL_SPECIAL: {
+            PZ_CASE(PZT_CCALL_SPECIAL): {
                 pz_builtin_c_special_func callee;
                 context.ip = (uint8_t *)AlignUp((size_t)context.ip,
                         WORDSIZE_BYTES);
@@ -642,8 +732,9 @@ generic_main_loop(Context   &context,
                 context.esp = callee(context.expr_stack, context.esp, pz);
                 context.ip += WORDSIZE_BYTES;
                 pz_trace_instr(context.rsp, "ccall");
-                break;
+                PZ_NEXT;
             }
+#ifndef PZ_THREADED_DISPATCH
 #ifdef PZ_DEV
             case PZT_INVALID_TOKEN:
                 fprintf(stderr, "Attempt to execute poisoned memory\n");
@@ -652,11 +743,43 @@ generic_main_loop(Context   &context,
             default:
                 fprintf(stderr, "Unknown opcode\n");
                 abort();
+#endif
         }
+#ifndef PZ_THREADED_DISPATCH
         pz_trace_state(heap, context.ip, context.rsp, context.esp,
                 (uint64_t *)context.expr_stack);
+#endif
     }
 }
 
+#undef PZ_CASE
+#undef PZ_NEXT
+#ifdef PZ_THREADED_DISPATCH
+#undef PZ_DISPATCH
+#endif
+
+int
+generic_main_loop(Context   &context,
+                  Heap      *heap,
+                  Closure   *closure,
+                  PZ        &pz)
+{
+    return main_loop(&context, heap, closure, &pz, nullptr);
+}
+
+#ifdef PZ_THREADED_DISPATCH
+void *
+generic_handler(InstructionToken token)
+{
+    static void * const *handlers = nullptr;
+
+    if (!handlers) {
+        main_loop(nullptr, nullptr, nullptr, nullptr, &handlers);
+    }
+    assert(token <= PZT_LAST_TOKEN);
+    return handlers[token];
+}
+#endif
+
 } // namespace pz
 
@@ -14,133 +14,150 @@
 #include "pz_gc.h"
 #include "pz_generic_closure.h"
 
+/*
+ * With GCC or Clang the interpreter is direct-threaded: the builder writes
+ * the address of each instruction's handler into the code, rather than
+ * its token, and each handler jumps straight to the next instruction's.
+ * Define PZ_NO_THREADED_DISPATCH to use the portable switch instead.
+ */
+#if defined(__GNUC__) && !defined(PZ_NO_THREADED_DISPATCH)
+#define PZ_THREADED_DISPATCH
+#endif
+
 namespace pz {
 
 /*
- * Tokens for the token-oriented execution.
+ * Tokens for the token-oriented execution.  The list is used to declare
+ * the enum and, in a threaded build, the table of handlers.
  */
+#define PZ_INSTRUCTION_TOKENS(TOKEN)                                   \
+    TOKEN(PZT_NOP)                                                     \
+    TOKEN(PZT_LOAD_IMMEDIATE_8)                                        \
+    TOKEN(PZT_LOAD_IMMEDIATE_16)                                       \
+    TOKEN(PZT_LOAD_IMMEDIATE_32)                                       \
+    TOKEN(PZT_LOAD_IMMEDIATE_64)                                       \
+    TOKEN(PZT_ZE_8_16)                                                 \
+    TOKEN(PZT_ZE_8_32)                                                 \
+    TOKEN(PZT_ZE_8_64)                                                 \
+    TOKEN(PZT_ZE_16_32)                                                \
+    TOKEN(PZT_ZE_16_64)                                                \
+    TOKEN(PZT_ZE_32_64)                                                \
+    TOKEN(PZT_SE_8_16)                                                 \
+    TOKEN(PZT_SE_8_32)                                                 \
+    TOKEN(PZT_SE_8_64)                                                 \
+    TOKEN(PZT_SE_16_32)                                                \
+    TOKEN(PZT_SE_16_64)                                                \
+    TOKEN(PZT_SE_32_64)                                                \
+    TOKEN(PZT_TRUNC_64_32)                                             \
+    TOKEN(PZT_TRUNC_64_16)                                             \
+    TOKEN(PZT_TRUNC_64_8)                                              \
+    TOKEN(PZT_TRUNC_32_16)                                             \
+    TOKEN(PZT_TRUNC_32_8)                                              \
+    TOKEN(PZT_TRUNC_16_8)                                              \
+    TOKEN(PZT_ADD_8)                                                   \
+    TOKEN(PZT_ADD_16)                                                  \
+    TOKEN(PZT_ADD_32)                                                  \
+    TOKEN(PZT_ADD_64)                                                  \
+    TOKEN(PZT_SUB_8)                                                   \
+    TOKEN(PZT_SUB_16)                                                  \
+    TOKEN(PZT_SUB_32)                                                  \
+    TOKEN(PZT_SUB_64)                                                  \
+    TOKEN(PZT_MUL_8)                                                   \
+    TOKEN(PZT_MUL_16)                                                  \
+    TOKEN(PZT_MUL_32)                                                  \
+    TOKEN(PZT_MUL_64)                                                  \
+    TOKEN(PZT_DIV_8)                                                   \
+    TOKEN(PZT_DIV_16)                                                  \
+    TOKEN(PZT_DIV_32)                                                  \
+    TOKEN(PZT_DIV_64)                                                  \
+    TOKEN(PZT_MOD_8)                                                   \
+    TOKEN(PZT_MOD_16)                                                  \
+    TOKEN(PZT_MOD_32)                                                  \
+    TOKEN(PZT_MOD_64)                                                  \
+    TOKEN(PZT_LSHIFT_8)                                                \
+    TOKEN(PZT_LSHIFT_16)                                               \
+    TOKEN(PZT_LSHIFT_32)                                               \
+    TOKEN(PZT_LSHIFT_64)                                               \
+    TOKEN(PZT_RSHIFT_8)                                                \
+    TOKEN(PZT_RSHIFT_16)                                               \
+    TOKEN(PZT_RSHIFT_32)                                               \
+    TOKEN(PZT_RSHIFT_64)                                               \
+    TOKEN(PZT_AND_8)                                                   \
+    TOKEN(PZT_AND_16)                                                  \
+    TOKEN(PZT_AND_32)                                                  \
+    TOKEN(PZT_AND_64)                                                  \
+    TOKEN(PZT_OR_8)                                                    \
+    TOKEN(PZT_OR_16)                                                   \
+    TOKEN(PZT_OR_32)                                                   \
+    TOKEN(PZT_OR_64)                                                   \
+    TOKEN(PZT_XOR_8)                                                   \
+    TOKEN(PZT_XOR_16)                                                  \
+    TOKEN(PZT_XOR_32)                                                  \
+    TOKEN(PZT_XOR_64)                                                  \
+    TOKEN(PZT_LT_U_8)                                                  \
+    TOKEN(PZT_LT_U_16)                                                 \
+    TOKEN(PZT_LT_U_32)                                                 \
+    TOKEN(PZT_LT_U_64)                                                 \
+    TOKEN(PZT_LT_S_8)                                                  \
+    TOKEN(PZT_LT_S_16)                                                 \
+    TOKEN(PZT_LT_S_32)                                                 \
+    TOKEN(PZT_LT_S_64)                                                 \
+    TOKEN(PZT_GT_U_8)                                                  \
+    TOKEN(PZT_GT_U_16)                                                 \
+    TOKEN(PZT_GT_U_32)                                                 \
+    TOKEN(PZT_GT_U_64)                                                 \
+    TOKEN(PZT_GT_S_8)                                                  \
+    TOKEN(PZT_GT_S_16)                                                 \
+    TOKEN(PZT_GT_S_32)                                                 \
+    TOKEN(PZT_GT_S_64)                                                 \
+    TOKEN(PZT_EQ_8)                                                    \
+    TOKEN(PZT_EQ_16)                                                   \
+    TOKEN(PZT_EQ_32)                                                   \
+    TOKEN(PZT_EQ_64)                                                   \
+    TOKEN(PZT_NOT_8)                                                   \
+    TOKEN(PZT_NOT_16)                                                  \
+    TOKEN(PZT_NOT_32)                                                  \
+    TOKEN(PZT_NOT_64)                                                  \
+    TOKEN(PZT_DUP)                                                     \
+    TOKEN(PZT_DROP)                                                    \
+    TOKEN(PZT_SWAP)                                                    \
+    TOKEN(PZT_ROLL)                                                    \
+    TOKEN(PZT_PICK)                                                    \
+    TOKEN(PZT_CALL)                                                    \
+    TOKEN(PZT_CALL_IND)                                                \
+    TOKEN(PZT_CALL_PROC)                                               \
+    TOKEN(PZT_TCALL)                                                   \
+    TOKEN(PZT_TCALL_IND)                                               \
+    TOKEN(PZT_TCALL_PROC)                                              \
+    TOKEN(PZT_CJMP_8)                                                  \
+    TOKEN(PZT_CJMP_16)                                                 \
+    TOKEN(PZT_CJMP_32)                                                 \
+    TOKEN(PZT_CJMP_64)                                                 \
+    TOKEN(PZT_JMP)                                                     \
+    TOKEN(PZT_RET)                                                     \
+    TOKEN(PZT_ALLOC)                                                   \
+    TOKEN(PZT_MAKE_CLOSURE)                                            \
+    TOKEN(PZT_LOAD_8)                                                  \
+    TOKEN(PZT_LOAD_16)                                                 \
+    TOKEN(PZT_LOAD_32)                                                 \
+    TOKEN(PZT_LOAD_64)                                                 \
+    TOKEN(PZT_LOAD_PTR)                                                \
+    TOKEN(PZT_STORE_8)                                                 \
+    TOKEN(PZT_STORE_16)                                                \
+    TOKEN(PZT_STORE_32)                                                \
+    TOKEN(PZT_STORE_64)                                                \
+    TOKEN(PZT_GET_ENV)                                                 \
+    TOKEN(PZT_END) /* Not part of PZ format. */                        \
+    TOKEN(PZT_CCALL) /* Not part of PZ format. */                      \
+    TOKEN(PZT_CCALL_ALLOC) /* Not part of PZ format. */                \
+    TOKEN(PZT_CCALL_SPECIAL) /* Not part of PZ format. */              \
+    TOKEN(PZT_MAKE_CLOSURE_IN_PLACE) /* Not part of PZ format. */
+
 enum InstructionToken {
-    PZT_NOP,
-    PZT_LOAD_IMMEDIATE_8,
-    PZT_LOAD_IMMEDIATE_16,
-    PZT_LOAD_IMMEDIATE_32,
-    PZT_LOAD_IMMEDIATE_64,
-    PZT_ZE_8_16,
-    PZT_ZE_8_32,
-    PZT_ZE_8_64,
-    PZT_ZE_16_32,
-    PZT_ZE_16_64,
-    PZT_ZE_32_64,
-    PZT_SE_8_16,
-    PZT_SE_8_32,
-    PZT_SE_8_64,
-    PZT_SE_16_32,
-    PZT_SE_16_64,
-    PZT_SE_32_64,
-    PZT_TRUNC_64_32,
-    PZT_TRUNC_64_16,
-    PZT_TRUNC_64_8,
-    PZT_TRUNC_32_16,
-    PZT_TRUNC_32_8,
-    PZT_TRUNC_16_8,
-    PZT_ADD_8,
-    PZT_ADD_16,
-    PZT_ADD_32,
-    PZT_ADD_64,
-    PZT_SUB_8,
-    PZT_SUB_16,
-    PZT_SUB_32,
-    PZT_SUB_64,
-    PZT_MUL_8,
-    PZT_MUL_16,
-    PZT_MUL_32,
-    PZT_MUL_64,
-    PZT_DIV_8,
-    PZT_DIV_16,
-    PZT_DIV_32,
-    PZT_DIV_64,
-    PZT_MOD_8,
-    PZT_MOD_16,
-    PZT_MOD_32,
-    PZT_MOD_64,
-    PZT_LSHIFT_8,
-    PZT_LSHIFT_16,
-    PZT_LSHIFT_32,
-    PZT_LSHIFT_64,
-    PZT_RSHIFT_8,
-    PZT_RSHIFT_16,
-    PZT_RSHIFT_32,
-    PZT_RSHIFT_64,
-    PZT_AND_8,
-    PZT_AND_16,
-    PZT_AND_32,
-    PZT_AND_64,
-    PZT_OR_8,
-    PZT_OR_16,
-    PZT_OR_32,
-    PZT_OR_64,
-    PZT_XOR_8,
-    PZT_XOR_16,
-    PZT_XOR_32,
-    PZT_XOR_64,
-    PZT_LT_U_8,
-    PZT_LT_U_16,
-    PZT_LT_U_32,
-    PZT_LT_U_64,
-    PZT_LT_S_8,
-    PZT_LT_S_16,
-    PZT_LT_S_32,
-    PZT_LT_S_64,
-    PZT_GT_U_8,
-    PZT_GT_U_16,
-    PZT_GT_U_32,
-    PZT_GT_U_64,
-    PZT_GT_S_8,
-    PZT_GT_S_16,
-    PZT_GT_S_32,
-    PZT_GT_S_64,
-    PZT_EQ_8,
-    PZT_EQ_16,
-    PZT_EQ_32,
-    PZT_EQ_64,
-    PZT_NOT_8,
-    PZT_NOT_16,
-    PZT_NOT_32,
-    PZT_NOT_64,
-    PZT_DUP,
-    PZT_DROP,
-    PZT_SWAP,
-    PZT_ROLL,
-    PZT_PICK,
-    PZT_CALL,
-    PZT_CALL_IND,
-    PZT_CALL_PROC,
-    PZT_TCALL,
-    PZT_TCALL_IND,
-    PZT_TCALL_PROC,
-    PZT_CJMP_8,
-    PZT_CJMP_16,
-    PZT_CJMP_32,
-    PZT_CJMP_64,
-    PZT_JMP,
-    PZT_RET,
-    PZT_ALLOC,
-    PZT_MAKE_CLOSURE,
-    PZT_LOAD_8,
-    PZT_LOAD_16,
-    PZT_LOAD_32,
-    PZT_LOAD_64,
-    PZT_LOAD_PTR,
-    PZT_STORE_8,
-    PZT_STORE_16,
-    PZT_STORE_32,
-    PZT_STORE_64,
-    PZT_GET_ENV,
-    PZT_END,                // Not part of PZ format.
-    PZT_CCALL,              // Not part of PZ format.
-    PZT_CCALL_ALLOC,        // Not part of PZ format.
-    PZT_CCALL_SPECIAL,      // Not part of PZ format.
-    PZT_LAST_TOKEN = PZT_CCALL_ALLOC,
+#define PZ_TOKEN_ENUM(token) token,
+    PZ_INSTRUCTION_TOKENS(PZ_TOKEN_ENUM)
+#undef PZ_TOKEN_ENUM
+    PZT_LAST_TOKEN = PZT_MAKE_CLOSURE_IN_PLACE,
 #ifdef PZ_DEV
     PZT_INVALID_TOKEN = 0xF0,
 #endif
@@ -168,10 +185,17 @@ struct Context : public AbstractGCTracer {
     StackValue        *expr_stack;
     unsigned           esp;
 
+    // PZT_ALLOC and PZT_MAKE_CLOSURE allocate from here.
+    AllocBuffer        alloc_buffer;
+
+    // Non-null if allocations are being profiled.
+    AllocProfiler     *alloc_profiler;
+
     Context(Heap *heap);
     virtual ~Context();
 
     virtual void do_trace(HeapMarkState *state) const;
+    virtual void sample_allocation(size_t size_bytes) const;
 };
 
 int
@@ -180,6 +204,15 @@ generic_main_loop(Context   &context,
                   Closure   *closure,
                   PZ        &pz);
 
+#ifdef PZ_THREADED_DISPATCH
+/*
+ * The address of the token's handler in generic_main_loop(), which the
+ * builder writes in place of the token.
+ */
+void *
+generic_handler(InstructionToken token);
+#endif
+
 } // namespace pz
 
 #endif // ! PZ_GENERIC_RUN_H
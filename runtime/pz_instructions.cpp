@@ -108,6 +108,8 @@ InstructionInfo instruction_info[] = {
     /* PZI_CCALL_ALLOC */
     { 0, IMT_PROC_REF },
     /* PZI_CCALL_SPECIAL */
+    { 0, IMT_PROC_REF },
+    /* PZI_MAKE_CLOSURE_IN_PLACE */
     { 0, IMT_PROC_REF }
 };
 
@@ -87,9 +87,14 @@ typedef enum {
     PZI_CCALL,
     PZI_CCALL_ALLOC,
     PZI_CCALL_SPECIAL,
+    /*
+     * PZI_MAKE_CLOSURE when the environment was laid out to hold the
+     * closure, see pz_read.cpp.
+     */
+    PZI_MAKE_CLOSURE_IN_PLACE,
 } PZ_Opcode;
 
-#define PZ_NUM_OPCODES (PZI_CCALL_SPECIAL + 1)
+#define PZ_NUM_OPCODES (PZI_MAKE_CLOSURE_IN_PLACE + 1)
 
 #ifdef __cplusplus
 
@@ -31,12 +31,12 @@ Export::Export(pz::Closure *closure, unsigned export_id) :
  * ModuleLoading class
  **********************/
 
-ModuleLoading::ModuleLoading(unsigned num_structs,
+ModuleLoading::ModuleLoading(Heap *heap,
+                             unsigned num_structs,
                              unsigned num_data,
                              unsigned num_procs,
-                             unsigned num_closures,
-                             NoGCScope &no_gc) :
-        AbstractGCTracer(no_gc.heap()),
+                             unsigned num_closures) :
+        AbstractGCTracer(heap, true),
         m_total_code_size(0),
         m_next_export(0)
 {
@@ -44,9 +44,12 @@ ModuleLoading::ModuleLoading(unsigned num_structs,
     m_datas.reserve(num_data);
     m_procs.reserve(num_procs);
     m_closures.reserve(num_closures);
+
+    NoGCScope no_gc(this);
     for (unsigned i = 0; i < num_closures; i++) {
         m_closures.push_back(new(no_gc) Closure());
     }
+    no_gc.abort_if_oom("loading a module");
 }
 
 Struct *
@@ -113,8 +116,8 @@ void
 ModuleLoading::do_trace(HeapMarkState *marker) const
 {
     /*
-     * This is needed in case we GC during loading, we want to keep this
-     * module until we know we're done loading it.
+     * The module's objects are immortal so this marks nothing, unless
+     * something was allocated elsewhere and stored here.
      */
     for (Struct *s : m_structs) {
         marker->mark_root(s);
@@ -143,11 +146,11 @@ ModuleLoading::do_trace(HeapMarkState *marker) const
  ***************/
 
 Module::Module(Heap *heap) :
-    AbstractGCTracer(heap),
+    AbstractGCTracer(heap, true),
     m_entry_closure(nullptr) {}
 
 Module::Module(Heap *heap, ModuleLoading &loading) :
-    AbstractGCTracer(heap),
+    AbstractGCTracer(heap, true),
     m_symbols(loading.m_symbols),
     m_entry_closure(nullptr) {}
 
@@ -37,8 +37,10 @@ class Export {
 /*
  * This class tracks all the information we need to load a module, since
  * loading also includes linking.  Once that's complete a lot of this can be
- * dropped and only the exported symbols need to be kept (anything they
- * point to will be kept by the GC).
+ * dropped and only the exported symbols need to be kept.
+ *
+ * Everything allocated with this (or Module) as the GCCapability goes into
+ * the heap's immortal region, since it's needed until the program exits.
  */
 class ModuleLoading : public AbstractGCTracer {
   private:
@@ -58,14 +60,15 @@ class ModuleLoading : public AbstractGCTracer {
     friend class Module;
 
   public:
-    ModuleLoading(unsigned num_structs,
+    ModuleLoading(Heap *heap,
+                  unsigned num_structs,
                   unsigned num_data,
                   unsigned num_procs,
-                  unsigned num_closures,
-                  NoGCScope &no_gc);
+                  unsigned num_closures);
     virtual ~ModuleLoading() { }
 
     const Struct * struct_(unsigned id) const { return m_structs.at(id); }
+    Struct * struct_(unsigned id) { return m_structs.at(id); }
 
     Struct * new_struct(unsigned num_fields, const GCCapability &gc_cap);
 
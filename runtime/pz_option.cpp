@@ -8,6 +8,7 @@
 
 #include "pz_common.h"
 
+#include <limits.h>
 #include <string.h>
 #include <string>
 #include <unistd.h>
@@ -79,6 +80,93 @@ Options::parseEnvironment()
         while (token) {
             if (strcmp(token, "load_verbose") == 0) {
                 m_verbose = true;
+            } else if (strcmp(token, "gc_background_sweep") == 0) {
+                m_gc_background_sweep = true;
+            } else if (strcmp(token, "gc_generational") == 0) {
+                m_gc_generational = true;
+            } else if (strcmp(token, "gc_compact") == 0) {
+                m_gc_compact = true;
+            } else if (strcmp(token, "gc_huge_pages") == 0) {
+                m_gc_huge_pages = true;
+            } else if (strncmp(token, "gc_mark_threads=", 16) == 0) {
+                char *end;
+                unsigned long threads = strtoul(token + 16, &end, 10);
+                if (*end || threads < 1 || threads > Max_GC_Mark_Threads) {
+                    fprintf(stderr,
+                            "Warning: Invalid value for gc_mark_threads, "
+                            "it must be between 1 and %u: %s\n",
+                            Max_GC_Mark_Threads, token + 16);
+                } else {
+                    m_gc_mark_threads = threads;
+                }
+            } else if (strncmp(token, "gc_release_after=", 17) == 0) {
+                char *end;
+                unsigned long after = strtoul(token + 17, &end, 10);
+                if (*end || after > Max_GC_Release_After) {
+                    fprintf(stderr,
+                            "Warning: Invalid value for gc_release_after, "
+                            "it must be between 0 and %u: %s\n",
+                            Max_GC_Release_After, token + 17);
+                } else {
+                    m_gc_release_after = after;
+                }
+            } else if (strncmp(token, "alloc_profile=", 14) == 0) {
+                m_alloc_profile = token + 14;
+            } else if (strncmp(token, "alloc_profile_interval=", 23) == 0) {
+                char *end;
+                unsigned long interval = strtoul(token + 23, &end, 10);
+                if (*end || interval < 1) {
+                    fprintf(stderr,
+                            "Warning: Invalid value for "
+                            "alloc_profile_interval, it must be a positive "
+                            "number of bytes: %s\n", token + 23);
+                } else {
+                    m_alloc_profile_interval = interval;
+                }
+            } else if (strncmp(token, "gc_stats=", 9) == 0) {
+                m_gc_stats = token + 9;
+            } else if (strncmp(token, "gc_max_heap=", 12) == 0) {
+                // The size may have a K, M or G suffix.
+                char *end;
+                unsigned long long size = strtoull(token + 12, &end, 10);
+                unsigned shift = 0;
+                switch (*end) {
+                    case 'K': shift = 10; end++; break;
+                    case 'M': shift = 20; end++; break;
+                    case 'G': shift = 30; end++; break;
+                }
+                if (*end || end == token + 12 ||
+                        size > (SIZE_MAX >> shift))
+                {
+                    fprintf(stderr,
+                            "Warning: Invalid value for gc_max_heap, "
+                            "it must be a size in bytes with an optional "
+                            "K, M or G suffix: %s\n", token + 12);
+                } else {
+                    m_gc_max_heap = size_t(size) << shift;
+                }
+            } else if (strncmp(token, "gc_cpu_target=", 14) == 0) {
+                char *end;
+                unsigned long target = strtoul(token + 14, &end, 10);
+                if (*end || target > Max_GC_CPU_Target) {
+                    fprintf(stderr,
+                            "Warning: Invalid value for gc_cpu_target, "
+                            "it must be between 0 and %u: %s\n",
+                            Max_GC_CPU_Target, token + 14);
+                } else {
+                    m_gc_cpu_target = target;
+                }
+            } else if (strncmp(token, "gc_max_pause=", 13) == 0) {
+                char *end;
+                unsigned long pause = strtoul(token + 13, &end, 10);
+                if (*end || end == token + 13 || pause > UINT_MAX) {
+                    fprintf(stderr,
+                            "Warning: Invalid value for gc_max_pause, "
+                            "it must be a number of microseconds: %s\n",
+                            token + 13);
+                } else {
+                    m_gc_max_pause = pause;
+                }
             } else {
                 // This warning is non-fatal, so it doesn't set the
                 // error_message_ property or return ERROR.
@@ -92,6 +180,13 @@ Options::parseEnvironment()
         free(opts);
     }
 
+    if (m_gc_max_pause && m_gc_generational) {
+        fprintf(stderr,
+                "Warning: gc_max_pause can't be used with gc_generational, "
+                "it is ignored\n");
+        m_gc_max_pause = 0;
+    }
+
 #ifdef PZ_DEV
     if (char *opts = getenv("PZ_RUNTIME_DEV_OPTS")) {
         opts = strdup(opts);
@@ -37,6 +37,18 @@ class Options {
   private:
     std::string m_pzfile;
     bool        m_verbose;
+    unsigned    m_gc_mark_threads;
+    bool        m_gc_background_sweep;
+    bool        m_gc_generational;
+    bool        m_gc_compact;
+    unsigned    m_gc_release_after;
+    bool        m_gc_huge_pages;
+    size_t      m_gc_max_heap;
+    unsigned    m_gc_cpu_target;
+    unsigned    m_gc_max_pause;
+    std::string m_gc_stats;
+    std::string m_alloc_profile;
+    size_t      m_alloc_profile_interval;
 
 #ifdef PZ_DEV
     bool        m_interp_trace;
@@ -53,6 +65,16 @@ class Options {
 
   public:
     Options() : m_verbose(false)
+        , m_gc_mark_threads(1)
+        , m_gc_background_sweep(false)
+        , m_gc_generational(false)
+        , m_gc_compact(false)
+        , m_gc_release_after(4)
+        , m_gc_huge_pages(false)
+        , m_gc_max_heap(0)
+        , m_gc_cpu_target(10)
+        , m_gc_max_pause(0)
+        , m_alloc_profile_interval(512 * 1024)
 #ifdef PZ_DEV
         , m_interp_trace(false)
         , m_gc_zealous(false)
@@ -73,6 +95,60 @@ class Options {
     bool verbose() const { return m_verbose; }
     std::string pzfile() const { return m_pzfile; }
 
+    // The number of threads, including the collecting thread, that mark
+    // the heap.
+    unsigned gc_mark_threads() const { return m_gc_mark_threads; }
+    static const unsigned Max_GC_Mark_Threads = 256;
+
+    // Sweep in a background thread, after marking the collector only
+    // flags what needs sweeping.
+    bool gc_background_sweep() const { return m_gc_background_sweep; }
+
+    // Most collections are minor collections that only trace the cells
+    // allocated since the last collection.
+    bool gc_generational() const { return m_gc_generational; }
+
+    // Full collections slide the live cells in sparse fit chunks together,
+    // except those that are referenced conservatively.
+    bool gc_compact() const { return m_gc_compact; }
+
+    // Free memory is returned to the OS once it has stayed free for this
+    // many collections, and then empty chunks are unmapped.  Zero keeps
+    // it.
+    unsigned gc_release_after() const { return m_gc_release_after; }
+    static const unsigned Max_GC_Release_After = 255;
+
+    // Map chunks with huge pages if the system has them, the heap reports
+    // which pages it got.
+    bool gc_huge_pages() const { return m_gc_huge_pages; }
+
+    // The initial limit on the heap's size in bytes, or zero for no
+    // limit.  The heap can change it at runtime.
+    size_t gc_max_heap() const { return m_gc_max_heap; }
+
+    // The initial percentage of CPU time the collector aims to use, the
+    // heap grows or shrinks to meet it.  Zero grows the heap by a fixed
+    // factor instead.  The heap can change it at runtime.
+    unsigned gc_cpu_target() const { return m_gc_cpu_target; }
+    static const unsigned Max_GC_CPU_Target = 90;
+
+    // If non-zero, mark incrementally in slices of about this many
+    // microseconds between allocations, rather than all at once.  This
+    // excludes gc_generational.
+    unsigned gc_max_pause() const { return m_gc_max_pause; }
+
+    // If not empty, the file ("-" for stderr) that the collector's
+    // statistics are written to as JSON at exit and after a SIGUSR1.
+    const std::string & gc_stats() const { return m_gc_stats; }
+
+    // If not empty, sample allocations about once every
+    // alloc_profile_interval bytes and write the sampled stacks to this
+    // file at exit.
+    const std::string & alloc_profile() const { return m_alloc_profile; }
+    size_t alloc_profile_interval() const {
+        return m_alloc_profile_interval;
+    }
+
 #ifdef PZ_DEV
     bool interp_trace() const { return m_interp_trace; }
     bool gc_zealous() const { return m_gc_zealous; }
@@ -0,0 +1,112 @@
+/*
+ * Plasma allocation profiler
+ * vim: ts=4 sw=4 et
+ *
+ * Copyright (C) 2019 Plasma Team
+ * Distributed under the terms of the MIT license, see ../LICENSE.code
+ */
+
+#include "pz_common.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "pz_code.h"
+#include "pz_gc.h"
+
+#include "pz_profile.h"
+
+namespace pz {
+
+AllocProfiler::AllocProfiler(const Heap *heap) :
+        m_heap(heap) { }
+
+unsigned
+AllocProfiler::frame_id(void *ip)
+{
+    /*
+     * Instruction pointers point after the instruction that's running, or
+     * after the call for the outer frames, so look up the byte before
+     * them.  Code is allocated with a Proc as its meta information, except
+     * for the wrapper that starts the program.
+     */
+    uint8_t *instr = reinterpret_cast<uint8_t*>(ip) - 1;
+    void *code = heap_interior_ptr_to_ptr(m_heap, instr);
+    const Proc *proc = code ?
+        reinterpret_cast<Proc*>(heap_meta_info(m_heap, code)) : nullptr;
+
+    unsigned line = 0;
+    if (proc && proc->filename()) {
+        unsigned last_lookup = 0;
+        line = proc->line(instr - reinterpret_cast<uint8_t*>(code),
+                &last_lookup);
+    }
+
+    auto key = std::make_pair(proc, line);
+    auto i = m_frame_ids.find(key);
+    if (i != m_frame_ids.end()) return i->second;
+
+    // The name is copied now in case the Proc doesn't last until the
+    // profile is written.
+    std::string name;
+    if (!proc) {
+        name = "[unknown]";
+    } else {
+        name = proc->name() ? proc->name() : "[anonymous]";
+        if (line) {
+            name += " (" + std::string(proc->filename()) + ":" +
+                std::to_string(line) + ")";
+        } else if (proc->is_builtin()) {
+            name += " (builtin)";
+        }
+    }
+
+    unsigned id = m_frames.size();
+    m_frames.push_back(name);
+    m_frame_ids[key] = id;
+    return id;
+}
+
+void
+AllocProfiler::add_frame(void *ip)
+{
+    m_sample.push_back(frame_id(ip));
+}
+
+void
+AllocProfiler::end_sample(size_t size_bytes)
+{
+    m_stacks[m_sample] += size_bytes;
+    m_sample.clear();
+}
+
+bool
+AllocProfiler::write(const char *path) const
+{
+    FILE *stream;
+    if (0 == strcmp(path, "-")) {
+        stream = stderr;
+    } else {
+        stream = fopen(path, "w");
+        if (!stream) {
+            perror(path);
+            return false;
+        }
+    }
+
+    for (auto &stack : m_stacks) {
+        const char *sep = "";
+        for (unsigned frame : stack.first) {
+            fprintf(stream, "%s%s", sep, m_frames[frame].c_str());
+            sep = ";";
+        }
+        fprintf(stream, " %zu\n", stack.second);
+    }
+
+    if (stream != stderr) {
+        fclose(stream);
+    }
+    return true;
+}
+
+} // namespace pz
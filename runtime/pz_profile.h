@@ -0,0 +1,69 @@
+/*
+ * Plasma allocation profiler
+ * vim: ts=4 sw=4 et
+ *
+ * Copyright (C) 2019 Plasma Team
+ * Distributed under the terms of the MIT license, see ../LICENSE.code
+ */
+
+#ifndef PZ_PROFILE_H
+#define PZ_PROFILE_H
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "pz_gc.h"
+
+namespace pz {
+
+class Proc;
+
+/*
+ * The heap samples allocations about once every alloc_profile_interval
+ * bytes, and the interpreter gives the call stack of each sample to this
+ * class.  Samples with the same stack are added together, and written at
+ * exit in the "folded" format used by flamegraph.pl:
+ *
+ *   outer_proc (file.p:12);inner_proc (file.p:34) bytes
+ */
+class AllocProfiler {
+  private:
+    const Heap                                     *m_heap;
+
+    // Each frame is a procedure and line, identified by its index in
+    // m_frames.
+    std::map<std::pair<const Proc*, unsigned>, unsigned> m_frame_ids;
+    std::vector<std::string>                        m_frames;
+
+    // The bytes sampled for each stack of frames.
+    std::map<std::vector<unsigned>, size_t>         m_stacks;
+
+    // The sample being built.
+    std::vector<unsigned>                           m_sample;
+
+    unsigned frame_id(void *ip);
+
+  public:
+    explicit AllocProfiler(const Heap *heap);
+
+    AllocProfiler(const AllocProfiler&) = delete;
+    void operator=(const AllocProfiler&) = delete;
+
+    /*
+     * A sample is made by adding the instruction pointer of each frame
+     * from the outermost, including the current one, then ending it.
+     */
+    void add_frame(void *ip);
+    void end_sample(size_t size_bytes);
+
+    /*
+     * Write the samples to this path, or stderr for "-".
+     */
+    bool write(const char *path) const;
+};
+
+} // namespace pz
+
+#endif // ! PZ_PROFILE_H
@@ -49,6 +49,70 @@ struct ReadInfo {
     Heap * heap() const { return pz.heap(); }
 };
 
+/*
+ * A closure can be made in place, inside its environment, if nothing else
+ * shares that environment.  Then the closure and its environment are one
+ * allocation and calls find the environment's fields in the closure.
+ *
+ * The compiler builds a closure by allocating its environment, storing
+ * the captured values into it, and making the closure from it, all within
+ * one block.  ClosureEnvs follows the environment down the expression
+ * stack from PZI_ALLOC to PZI_MAKE_CLOSURE through the instructions that
+ * sequence uses, and gives up on any other instruction or if the
+ * environment is copied.
+ *
+ * The first pass over the code finds the structs that are used this way,
+ * and if they're not also used by static data their layout reserves room
+ * for the closure before the fields.  Then the second pass writes these
+ * closures as PZI_MAKE_CLOSURE_IN_PLACE.  Closures that are made from an
+ * environment some other way still work, the space is unused.
+ */
+class ClosureEnvs {
+  private:
+    std::vector<bool>   m_used_by_closure;
+    std::vector<bool>   m_used_by_data;
+
+    // The environment being followed, and its depth on the stack.
+    bool                m_tracking;
+    uint32_t            m_struct_id;
+    unsigned            m_depth;
+
+  public:
+    explicit ClosureEnvs(unsigned num_structs) :
+        m_used_by_closure(num_structs),
+        m_used_by_data(num_structs),
+        m_tracking(false),
+        m_struct_id(0),
+        m_depth(0) {}
+
+    void used_by_data(uint32_t struct_id) {
+        m_used_by_data.at(struct_id) = true;
+    }
+
+    /*
+     * After the first pass, lay out the structs that can hold their
+     * closures.
+     */
+    void layout_structs(ModuleLoading &module) {
+        for (unsigned i = 0; i < m_used_by_closure.size(); i++) {
+            if (m_used_by_closure[i] && !m_used_by_data[i]) {
+                module.struct_(i)->make_closure_env();
+            }
+        }
+    }
+
+    void start_block() { m_tracking = false; }
+
+    /*
+     * Follow the environment through an instruction.  The struct id is
+     * that of the instruction's immediate value, if it has one.  Returns
+     * true if this is a PZI_MAKE_CLOSURE of an environment allocated with
+     * struct_id_out.
+     */
+    bool instr(PZ_Opcode opcode, uint32_t struct_id, ImmediateValue imm,
+            uint32_t *struct_id_out);
+};
+
 /*
  * The closure id and signature type for the program's entrypoint
  */
@@ -77,7 +141,8 @@ static bool
 read_data(ReadInfo      &read,
           unsigned       num_datas,
           ModuleLoading &module,
-          Imported      &imports);
+          Imported      &imports,
+          ClosureEnvs   &closure_envs);
 
 static Optional<PZ_Width>
 read_data_width(BinaryInput &file);
@@ -92,12 +157,14 @@ static bool
 read_code(ReadInfo      &read,
           unsigned       num_procs,
           ModuleLoading &module,
-          Imported      &imported);
+          Imported      &imported,
+          ClosureEnvs   &closure_envs);
 
 static unsigned
 read_proc(ReadInfo      &read,
           Imported      &imported,
           ModuleLoading &module,
+          ClosureEnvs   &closure_envs,
           Proc          *proc, /* null fir first pass */
           unsigned     **block_offsets);
 
@@ -105,6 +172,7 @@ static bool
 read_instr(BinaryInput     &file,
            Imported        &imported,
            ModuleLoading   &module,
+           ClosureEnvs     &closure_envs,
            uint8_t         *proc_code,
            unsigned       **block_offsets,
            unsigned        &proc_offset);
@@ -191,19 +259,12 @@ read(PZ &pz, const std::string &filename)
     if (!read.file.read_uint32(&num_closures)) return nullptr;
     if (!read.file.read_uint32(&num_exports)) return nullptr;
 
-    std::unique_ptr<ModuleLoading> module;
-    {
-        NoRootsTracer no_roots(read.heap());
-        NoGCScope no_gc(&no_roots);
-
-        module = std::unique_ptr<ModuleLoading>(
-                new ModuleLoading(num_structs, num_datas, num_procs,
-                    num_closures, no_gc));
-
-        no_gc.abort_if_oom("loading a module");
-    }
+    std::unique_ptr<ModuleLoading> module(
+            new ModuleLoading(read.heap(), num_structs, num_datas,
+                num_procs, num_closures));
 
     Imported imported(num_imports);
+    ClosureEnvs closure_envs(num_structs);
 
     if (!read_imports(read, num_imports, imported)) return nullptr;
 
@@ -215,10 +276,10 @@ read(PZ &pz, const std::string &filename)
      * where each individual entry begins.  Then in the second pass we fill
      * read the bytecode and data, resolving any intra-module references.
      */
-    if (!read_data(read, num_datas, *module, imported)) {
+    if (!read_data(read, num_datas, *module, imported, closure_envs)) {
         return nullptr;
     }
-    if (!read_code(read, num_procs, *module, imported)) {
+    if (!read_code(read, num_procs, *module, imported, closure_envs)) {
         return nullptr;
     }
 
@@ -366,7 +427,8 @@ static bool
 read_data(ReadInfo      &read,
           unsigned       num_datas,
           ModuleLoading &module,
-          Imported      &imports)
+          Imported      &imports,
+          ClosureEnvs   &closure_envs)
 {
     unsigned  total_size = 0;
     void     *data = nullptr;
@@ -398,8 +460,9 @@ read_data(ReadInfo      &read,
                 uint32_t struct_id;
                 if (!read.file.read_uint32(&struct_id)) return false;
                 const Struct *struct_ = module.struct_(struct_id);
+                closure_envs.used_by_data(struct_id);
 
-                data = data_new_struct_data(module, struct_->total_size());
+                data = data_new_struct_data(module, struct_);
                 for (unsigned f = 0; f < struct_->num_fields(); f++) {
                     void *dest = reinterpret_cast<uint8_t*>(data) +
                         struct_->field_offset(f);
@@ -550,7 +613,8 @@ static bool
 read_code(ReadInfo      &read,
           unsigned       num_procs,
           ModuleLoading &module,
-          Imported      &imported)
+          Imported      &imported,
+          ClosureEnvs   &closure_envs)
 {
     bool             result = false;
     unsigned       **block_offsets = new unsigned*[num_procs];
@@ -576,11 +640,16 @@ read_code(ReadInfo      &read,
         }
 
         proc_size =
-          read_proc(read, imported, module, nullptr, &block_offsets[i]);
+          read_proc(read, imported, module, closure_envs, nullptr,
+                  &block_offsets[i]);
         if (proc_size == 0) goto end;
         module.new_proc(proc_size, false, module);
     }
 
+    // This doesn't change the size of any instructions, only the field
+    // offsets they use.
+    closure_envs.layout_structs(module);
+
     /*
      * Now that we've allocated memory for all the procedures, re-read them
      * this time writing them into that memory.  We do this for all the
@@ -596,7 +665,7 @@ read_code(ReadInfo      &read,
             fprintf(stderr, "Reading proc %d\n", i);
         }
 
-        if (0 == read_proc(read, imported, module,
+        if (0 == read_proc(read, imported, module, closure_envs,
                            module.proc(i),
                            &block_offsets[i]))
         {
@@ -625,6 +694,7 @@ static unsigned
 read_proc(ReadInfo      &read,
           Imported      &imported,
           ModuleLoading &module,
+          ClosureEnvs   &closure_envs,
           Proc          *proc,
           unsigned     **block_offsets)
 {
@@ -636,6 +706,7 @@ read_proc(ReadInfo      &read,
     const char * name = file.read_len_string(module);
     if (proc && name) {
         proc->set_name(name);
+        module.write_barrier(proc);
     }
 
     /*
@@ -661,18 +732,24 @@ read_proc(ReadInfo      &read,
             (*block_offsets)[i] = proc_offset;
         }
 
+        closure_envs.start_block();
         if (!file.read_uint32(&num_instructions)) return 0;
         for (uint32_t j = 0; j < num_instructions; j++) {
             uint8_t byte;
             if (!file.read_uint8(&byte)) return false;
 
             if (PZ_CODE_INSTR == byte) {
-                if (!read_instr(file, imported, module,
-                        proc ? proc->code() : nullptr, block_offsets, 
+                if (!read_instr(file, imported, module, closure_envs,
+                        proc ? proc->code() : nullptr, block_offsets,
                         proc_offset))
                 {
                     return 0;
                 }
+                // The instruction's immediate value may point to other
+                // procs, closures or structs.
+                if (proc) {
+                    module.write_barrier(proc->code());
+                }
             } else {
                 if (!read_meta(read, module, proc, proc_offset, byte)) return 0;
             }
@@ -684,13 +761,16 @@ read_proc(ReadInfo      &read,
 
 static bool
 read_instr(BinaryInput &file, Imported &imported, ModuleLoading &module,
-        uint8_t *proc_code, unsigned **block_offsets, unsigned &proc_offset)
+        ClosureEnvs &closure_envs, uint8_t *proc_code,
+        unsigned **block_offsets, unsigned &proc_offset)
 {
     uint8_t             byte;
     PZ_Opcode           opcode;
     Optional<PZ_Width>  width1, width2;
     ImmediateType       immediate_type;
     ImmediateValue      immediate_value;
+    uint32_t            struct_id = 0;
+    uint32_t            env_struct_id;
     bool                first_pass = (proc_code == nullptr);
 
     /*
@@ -783,7 +863,9 @@ read_instr(BinaryInput &file, Imported &imported, ModuleLoading &module,
         case IMT_STRUCT_REF: {
             uint32_t imm32;
             if (!file.read_uint32(&imm32)) return false;
-            immediate_value.word = module.struct_(imm32)->total_size();
+            // The code references the struct, which keeps it alive.
+            immediate_value.word = (uintptr_t)module.struct_(imm32);
+            struct_id = imm32;
             break;
         }
         case IMT_STRUCT_REF_FIELD: {
@@ -794,10 +876,18 @@ read_instr(BinaryInput &file, Imported &imported, ModuleLoading &module,
             if (!file.read_uint8(&imm8)) return false;
             immediate_value.uint16 =
                 module.struct_(imm32)->field_offset(imm8);
+            struct_id = imm32;
             break;
         }
     }
 
+    if (closure_envs.instr(opcode, struct_id, immediate_value,
+                &env_struct_id) &&
+            module.struct_(env_struct_id)->is_closure_env())
+    {
+        opcode = PZI_MAKE_CLOSURE_IN_PLACE;
+    }
+
     if (width1.hasValue()) {
         if (width2.hasValue()) {
             assert(immediate_type == IMT_NONE);
@@ -825,6 +915,71 @@ read_instr(BinaryInput &file, Imported &imported, ModuleLoading &module,
     return true;
 }
 
+bool
+ClosureEnvs::instr(PZ_Opcode opcode, uint32_t struct_id,
+        ImmediateValue imm, uint32_t *struct_id_out)
+{
+    if (opcode == PZI_ALLOC) {
+        m_tracking = true;
+        m_struct_id = struct_id;
+        m_depth = 0;
+        return false;
+    }
+    if (!m_tracking) return false;
+
+    switch (opcode) {
+        case PZI_LOAD_IMMEDIATE_NUM:
+        case PZI_GET_ENV:
+            m_depth++;
+            return false;
+        case PZI_PICK:
+            // A copy of the environment could become another closure.
+            if (m_depth + 1 == imm.uint8) break;
+            m_depth++;
+            return false;
+        case PZI_ROLL:
+            if (m_depth + 1 == imm.uint8) {
+                m_depth = 0;
+            } else if (m_depth + 1 < imm.uint8) {
+                m_depth++;
+            }
+            return false;
+        case PZI_DROP:
+            if (m_depth == 0) break;
+            m_depth--;
+            return false;
+        case PZI_LOAD:
+            // (ptr - * ptr)
+            if (m_depth == 0) {
+                if (struct_id != m_struct_id) break;
+            } else {
+                m_depth++;
+            }
+            return false;
+        case PZI_STORE:
+            // (* ptr - ptr)
+            if (m_depth == 0) {
+                if (struct_id != m_struct_id) break;
+            } else if (m_depth == 1) {
+                break;
+            } else {
+                m_depth--;
+            }
+            return false;
+        case PZI_MAKE_CLOSURE:
+            if (m_depth != 0) return false;
+            m_tracking = false;
+            m_used_by_closure.at(m_struct_id) = true;
+            *struct_id_out = m_struct_id;
+            return true;
+        default:
+            break;
+    }
+
+    m_tracking = false;
+    return false;
+}
+
 static bool
 read_meta(ReadInfo &read, ModuleLoading &module,
         Proc *proc, unsigned proc_offset, uint8_t meta_byte)
@@ -890,6 +1045,7 @@ read_closures(ReadInfo      &read,
         data = module.data(data_id);
 
         module.closure(i)->init(proc_code, data);
+        module.write_barrier(module.closure(i));
     }
 
     return true;
@@ -6,6 +6,7 @@
  * Distributed under the terms of the MIT license, see ../LICENSE.code
  */
 
+#include <stddef.h>
 #include <stdio.h>
 
 #include "pz_common.h"
@@ -76,6 +76,7 @@ class Vector : public GCNew {
         }
 
         m_data[m_len++] = value;
+        gc_cap.write_barrier(m_data);
         return true;
     }
 
@@ -94,6 +95,7 @@ class Vector : public GCNew {
             m_data = new (gc_cap) T[8];
             m_capacity = 8;
         }
+        gc_cap.write_barrier(this);
         return true;
     }
 
@@ -30,6 +30,31 @@ if [ $? -a "$TERM" != "" ]; then
     fi
 fi
 
+# The gc groups run each program with gc_zealous and these runtime
+# options, so that parts of the collector that are off by default are
+# tested too.
+case "$TEST_GROUP" in
+    gc)
+        GCTEST_OPTS=""
+        ;;
+    gc_parallel)
+        GCTEST_OPTS="gc_mark_threads=4,gc_background_sweep"
+        ;;
+    gc_generational)
+        GCTEST_OPTS="gc_generational"
+        ;;
+    gc_compact)
+        GCTEST_OPTS="gc_compact"
+        ;;
+    gc_incremental)
+        GCTEST_OPTS="gc_max_pause=1"
+        ;;
+    gc_*)
+        echo "Unknown test group $TEST_GROUP"
+        exit 1
+        ;;
+esac
+
 for EXPFILE in pzt/*.exp; do
     TESTS="$TESTS ${EXPFILE%.exp}"
 done
@@ -52,7 +77,7 @@ for TEST in $TESTS; do
                 continue
             fi
             ;;
-        gc)
+        gc|gc_*)
             case "$TEST" in
                 valid/die|valid/noentry)
                     continue
@@ -69,13 +94,18 @@ for TEST in $TESTS; do
         echo -n "$DIR/$NAME..."
     fi
 
-    if [ "$TEST_GROUP" = "gc" ]; then
-        TARGET_TYPE=gctest
-    else
-        TARGET_TYPE=test
-    fi
+    case "$TEST_GROUP" in
+        gc|gc_*)
+            TARGET_TYPE=gctest
+            ;;
+        *)
+            TARGET_TYPE=test
+            ;;
+    esac
 
-    if make "$NAME.$TARGET_TYPE" >"$NAME.log" 2>&1; then
+    if make "$NAME.$TARGET_TYPE" GCTEST_OPTS="$GCTEST_OPTS" \
+        >"$NAME.log" 2>&1
+    then
         if [ "$LONG_OUTPUT" = "1" ]; then
             printf "%s pass%s" "$TTY_TEST_SUCC" "$TTY_RST"
         else
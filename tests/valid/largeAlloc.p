@@ -0,0 +1,74 @@
+/*
+ * vim: ft=plasma
+ * This is free and unencumbered software released into the public domain.
+ * See ../LICENSE.unlicense
+ */
+
+module LargeAlloc
+
+export
+func main() uses IO -> Int {
+    // 16 bytes doubled 13 times is 128KB, so the GC allocates the string
+    // in the large object space.
+    var kept = keep_live!(double("0123456789abcdef", 13))
+    if (kept) {
+        print!("The large string was kept while it was live\n")
+    } else {
+        print!("The large string was freed while it was live\n")
+        return 1
+    }
+
+    // Minor collections in generational mode don't free it, so only the
+    // expected output checks this.
+    collect!(heap_collections!() + 2, "")
+    if (heap_usage!() < 64 * 1024) {
+        print!("The large string was freed once it was dead\n")
+    } else {
+        print!("The large string was not freed once it was dead\n")
+    }
+    return 0
+}
+
+func double(s : String, n : Int) -> String {
+    if (n > 0) {
+        return double(s ++ s, n - 1)
+    } else {
+        return s
+    }
+}
+
+func keep_live(big : String) uses IO -> Bool {
+    collect!(heap_collections!() + 2, "")
+    var usage = heap_usage!()
+    // Read the string after the collections, this would crash if its
+    // memory had been unmapped.
+    var copy = big ++ "\n"
+    return usage >= 128 * 1024
+}
+
+// Allocate garbage until there have been this many collections.
+func collect(collections : Int, garbage : String) uses IO {
+    if (heap_collections!() < collections) {
+        collect!(collections,
+            "garbage " ++ int_to_string(collections) ++ "\n")
+    } else {
+    }
+}
+
+func heap_collections() uses IO -> Int {
+    var res, collections = get_parameter!("heap_collections")
+    if (res) {
+    } else {
+        die("Can't retrieve heap_collections\n")
+    }
+    return collections
+}
+
+func heap_usage() uses IO -> Int {
+    var res, usage = get_parameter!("heap_usage")
+    if (res) {
+    } else {
+        die("Can't retrieve heap_usage\n")
+    }
+    return usage
+}
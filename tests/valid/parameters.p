@@ -11,6 +11,14 @@ func main() uses IO -> Int {
     test_parameter!("Squark!", 26, Stable)
     test_parameter!("heap_usage", 100, Volatile)
     test_parameter!("heap_collections", 100, Volatile)
+    test_parameter!("heap_max_size", 100000000, Stable)
+    test_parameter!("heap_max_size_kb", 3145728, Stable)
+    // 3GB doesn't fit in an Int, so it reads as the largest Int.
+    var res, max_size = get_parameter!("heap_max_size")
+    print!(pretty_get_result(res, "heap_max_size", max_size, Stable))
+    test_parameter!("gc_cpu_target", 20, Stable)
+    test_parameter!("gc_max_pause_us", 100, Volatile)
+    test_parameter!("gc_pauses_over_budget", 1, Stable)
     return 0
 }
 